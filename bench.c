@@ -0,0 +1,541 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "wfs.h"
+#include "libwfs.h"
+
+/* --------------------------------------------------------------------------
+ * WFS benchmark driver
+ *
+ * Runs a fixed set of reproducible workloads against a directory (normally a
+ * freshly mounted WFS image, see bench.sh) and prints one JSON object per
+ * workload on stdout: op count, ops/sec and latency percentiles in usec.
+ *
+ * With -i the same workloads run in-process against an image through libwfs,
+ * which takes the kernel and FUSE out of the measurement, and a few extra
+ * "core_*" workloads time individual hot paths (path resolution, block
+ * allocation, data_offset).
+ *
+ * Workloads are sized to stay inside the format's limits: a directory holds
+ * at most D_BLOCK * (BLOCK_SIZE / sizeof(struct wfs_dentry)) entries and a
+ * file at most (D_BLOCK + BLOCK_SIZE / sizeof(off_t)) * BLOCK_SIZE bytes.
+ * --------------------------------------------------------------------------
+ */
+
+#define DIR_ENTRIES ((D_BLOCK * BLOCK_SIZE) / (int)sizeof(struct wfs_dentry))
+#define MAX_FILE    ((D_BLOCK + BLOCK_SIZE / (int)sizeof(off_t)) * BLOCK_SIZE)
+
+static const char *root = ".";
+static int rounds = 4;       // repetitions of each workload
+static uint64_t seed = 537;  // fixed so runs are comparable between commits
+static const char *only;     // run just this workload if set
+static struct wfs_ctx *img;  // set when benchmarking in-process with -i
+
+/* ------------------------------ Measurement ------------------------------- */
+struct samples {
+    uint64_t *ns;
+    size_t n, cap;
+    uint64_t start, total;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void sample_begin(struct samples *s) {
+    s->start = now_ns();
+}
+
+static void sample_end(struct samples *s) {
+    uint64_t d = now_ns() - s->start;
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->ns = realloc(s->ns, s->cap * sizeof(uint64_t));
+        if (!s->ns) { perror("realloc"); exit(1); }
+    }
+    s->ns[s->n++] = d;
+    s->total += d;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct(struct samples *s, double p) {
+    size_t i = (size_t)(p * (s->n - 1) + 0.5);
+    return s->ns[i] / 1000.0;
+}
+
+static void report(const char *workload, struct samples *s) {
+    if (s->n == 0) {
+        printf("{\"workload\":\"%s\",\"ops\":0}\n", workload);
+        return;
+    }
+    qsort(s->ns, s->n, sizeof(uint64_t), cmp_u64);
+    double secs = s->total / 1e9;
+    printf("{\"workload\":\"%s\",\"ops\":%zu,\"secs\":%.6f,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+           workload, s->n, secs, secs > 0 ? s->n / secs : 0.0,
+           pct(s, 0.50), pct(s, 0.90), pct(s, 0.99), pct(s, 0.999), s->ns[s->n - 1] / 1000.0);
+    fflush(stdout);
+    free(s->ns);
+    memset(s, 0, sizeof(*s));
+}
+
+// xorshift64*, so random offsets are identical on every run with the same seed
+static uint64_t rng_next(void) {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 2685821657736338717ull;
+}
+
+static void die(const char *what, const char *path) {
+    fprintf(stderr, "bench: %s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+}
+
+static void path_of(char *out, size_t len, const char *rel) {
+    snprintf(out, len, "%s/%s", root, rel);
+}
+
+/* -------------------------------- Backends -------------------------------- */
+/* Workloads go through these so the same code drives a mount (POSIX calls)
+ * or an image opened with libwfs. A handle is an fd or an inode number. */
+struct bench_fs {
+    int (*mkdir)(const char *rel);
+    int (*create)(const char *rel);
+    int (*stat)(const char *rel);
+    int (*unlink)(const char *rel);
+    int (*list)(const char *rel);       // number of entries, or < 0
+    int (*open)(const char *rel);       // create if missing
+    void (*close)(int h);
+    ssize_t (*pwrite)(int h, const void *buf, size_t len, off_t off);
+    ssize_t (*pread)(int h, void *buf, size_t len, off_t off);
+};
+
+static int posix_mkdir(const char *rel) {
+    char p[4096];
+    path_of(p, sizeof(p), rel);
+    return mkdir(p, 0755) < 0 && errno != EEXIST ? -errno : 0;
+}
+
+static int posix_create(const char *rel) {
+    char p[4096];
+    path_of(p, sizeof(p), rel);
+    int fd = open(p, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0) return -errno;
+    close(fd);
+    return 0;
+}
+
+static int posix_stat(const char *rel) {
+    char p[4096];
+    struct stat sb;
+    path_of(p, sizeof(p), rel);
+    return stat(p, &sb) < 0 ? -errno : 0;
+}
+
+static int posix_unlink(const char *rel) {
+    char p[4096];
+    path_of(p, sizeof(p), rel);
+    return unlink(p) < 0 ? -errno : 0;
+}
+
+static int posix_list(const char *rel) {
+    char p[4096];
+    path_of(p, sizeof(p), rel);
+    DIR *dir = opendir(p);
+    if (!dir) return -errno;
+    int n = 0;
+    while (readdir(dir)) n++;
+    closedir(dir);
+    return n;
+}
+
+static int posix_open(const char *rel) {
+    char p[4096];
+    path_of(p, sizeof(p), rel);
+    int fd = open(p, O_CREAT | O_RDWR, 0644);
+    return fd < 0 ? -errno : fd;
+}
+
+static void posix_close(int h) {
+    close(h);
+}
+
+static ssize_t posix_pwrite(int h, const void *buf, size_t len, off_t off) {
+    return pwrite(h, buf, len, off);
+}
+
+static ssize_t posix_pread(int h, void *buf, size_t len, off_t off) {
+    return pread(h, buf, len, off);
+}
+
+static const struct bench_fs posix_fs = {
+    posix_mkdir, posix_create, posix_stat, posix_unlink, posix_list,
+    posix_open, posix_close, posix_pwrite, posix_pread,
+};
+
+// library paths are absolute; 'rel' is relative to the image root
+static const char *lib_path(char *out, size_t len, const char *rel) {
+    snprintf(out, len, "/%s", rel);
+    return out;
+}
+
+static int lib_mkdir(const char *rel) {
+    char p[4096];
+    int rc = wfs_create(img, lib_path(p, sizeof(p), rel), S_IFDIR | 0755);
+    return rc < 0 && rc != -EEXIST ? rc : 0;
+}
+
+static int lib_create(const char *rel) {
+    char p[4096];
+    int rc = wfs_create(img, lib_path(p, sizeof(p), rel), S_IFREG | 0644);
+    return rc < 0 ? rc : 0;
+}
+
+static int lib_stat(const char *rel) {
+    char p[4096];
+    struct stat sb;
+    int inum;
+    int rc = wfs_lookup(img, lib_path(p, sizeof(p), rel), &inum);
+    return rc < 0 ? rc : wfs_stat(img, inum, &sb);
+}
+
+static int lib_unlink(const char *rel) {
+    char p[4096];
+    return wfs_remove(img, lib_path(p, sizeof(p), rel));
+}
+
+static int count_entry(void *arg, const char *name, int inum) {
+    (void)name; (void)inum;
+    (*(int *)arg)++;
+    return 0;
+}
+
+static int lib_list(const char *rel) {
+    char p[4096];
+    int inum, n = 2; // "." and ".." like readdir(3)
+    int rc = wfs_lookup(img, lib_path(p, sizeof(p), rel), &inum);
+    if (rc < 0) return rc;
+    rc = wfs_iterate(img, inum, count_entry, &n);
+    return rc < 0 ? rc : n;
+}
+
+static int lib_open(const char *rel) {
+    char p[4096];
+    int inum;
+    lib_path(p, sizeof(p), rel);
+    if (wfs_lookup(img, p, &inum) == 0) return inum;
+    return wfs_create(img, p, S_IFREG | 0644);
+}
+
+static void lib_close(int h) {
+    (void)h;
+}
+
+static ssize_t lib_pwrite(int h, const void *buf, size_t len, off_t off) {
+    return wfs_pwrite(img, h, buf, len, off);
+}
+
+static ssize_t lib_pread(int h, void *buf, size_t len, off_t off) {
+    return wfs_pread(img, h, buf, len, off);
+}
+
+static const struct bench_fs lib_fs = {
+    lib_mkdir, lib_create, lib_stat, lib_unlink, lib_list,
+    lib_open, lib_close, lib_pwrite, lib_pread,
+};
+
+static const struct bench_fs *bfs = &posix_fs;
+
+static void check(int rc, const char *what, const char *rel) {
+    if (rc >= 0) return;
+    errno = -rc;
+    die(what, rel);
+}
+
+/* ------------------------------- Workloads -------------------------------- */
+#define STORM_DIRS 8
+
+// create, stat and unlink a full set of files spread across several dirs
+static void bench_storm(void) {
+    struct samples create = {0}, st = {0}, unl = {0};
+    char rel[64];
+    int rc;
+
+    for (int d = 0; d < STORM_DIRS; d++) {
+        snprintf(rel, sizeof(rel), "storm%d", d);
+        check(bfs->mkdir(rel), "mkdir", rel);
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        for (int d = 0; d < STORM_DIRS; d++) {
+            for (int i = 0; i < DIR_ENTRIES; i++) {
+                snprintf(rel, sizeof(rel), "storm%d/f%d", d, i);
+                sample_begin(&create);
+                rc = bfs->create(rel);
+                sample_end(&create);
+                check(rc, "create", rel);
+            }
+        }
+
+        for (int d = 0; d < STORM_DIRS; d++) {
+            for (int i = 0; i < DIR_ENTRIES; i++) {
+                snprintf(rel, sizeof(rel), "storm%d/f%d", d, i);
+                sample_begin(&st);
+                rc = bfs->stat(rel);
+                sample_end(&st);
+                check(rc, "stat", rel);
+            }
+        }
+
+        for (int d = 0; d < STORM_DIRS; d++) {
+            for (int i = 0; i < DIR_ENTRIES; i++) {
+                snprintf(rel, sizeof(rel), "storm%d/f%d", d, i);
+                sample_begin(&unl);
+                rc = bfs->unlink(rel);
+                sample_end(&unl);
+                check(rc, "unlink", rel);
+            }
+        }
+    }
+    report("create", &create);
+    report("stat", &st);
+    report("unlink", &unl);
+}
+
+// lookups that hit the last slot of a full directory, plus misses
+static void bench_wide(void) {
+    struct samples hit = {0}, miss = {0}, rd = {0};
+    char rel[64];
+    int rc;
+
+    check(bfs->mkdir("wide"), "mkdir", "wide");
+    for (int i = 0; i < DIR_ENTRIES; i++) {
+        snprintf(rel, sizeof(rel), "wide/entry_%d", i);
+        int h = bfs->open(rel);
+        check(h, "create", rel);
+        bfs->close(h);
+    }
+
+    snprintf(rel, sizeof(rel), "wide/entry_%d", DIR_ENTRIES - 1);
+    for (int r = 0; r < rounds * 256; r++) {
+        sample_begin(&hit);
+        rc = bfs->stat(rel);
+        sample_end(&hit);
+        check(rc, "stat", rel);
+
+        sample_begin(&miss);
+        bfs->stat("wide/missing");
+        sample_end(&miss);
+    }
+
+    for (int r = 0; r < rounds * 64; r++) {
+        sample_begin(&rd);
+        rc = bfs->list("wide");
+        sample_end(&rd);
+        check(rc, "readdir", "wide");
+        if (rc < DIR_ENTRIES) { fprintf(stderr, "bench: short readdir (%d)\n", rc); exit(1); }
+    }
+
+    report("wide_lookup_hit", &hit);
+    report("wide_lookup_miss", &miss);
+    report("readdir_full", &rd);
+}
+
+#define DEEP_LEVELS 48
+
+// stat at the bottom of a deep chain of directories
+static void bench_deep(void) {
+    struct samples s = {0};
+    char rel[4096] = "deep";
+    int rc;
+
+    check(bfs->mkdir(rel), "mkdir", rel);
+    for (int i = 0; i < DEEP_LEVELS; i++) {
+        strcat(rel, "/d");
+        check(bfs->mkdir(rel), "mkdir", rel);
+    }
+
+    for (int r = 0; r < rounds * 256; r++) {
+        sample_begin(&s);
+        rc = bfs->stat(rel);
+        sample_end(&s);
+        check(rc, "stat", rel);
+    }
+    report("deep_stat", &s);
+}
+
+#define IO_FILES 16
+#define IO_CHUNK 4096
+
+static void bench_io(void) {
+    struct samples sw = {0}, sr = {0}, rw = {0}, rr = {0};
+    char rel[64];
+    char buf[IO_CHUNK];
+    ssize_t n;
+
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (char)rng_next();
+
+    check(bfs->mkdir("io"), "mkdir", "io");
+
+    for (int r = 0; r < rounds; r++) {
+        for (int f = 0; f < IO_FILES; f++) {
+            snprintf(rel, sizeof(rel), "io/file%d", f);
+            int h = bfs->open(rel);
+            check(h, "open", rel);
+
+            // sequential: fill the file to its maximum size, then read it back
+            for (off_t off = 0; off < MAX_FILE; off += IO_CHUNK) {
+                size_t len = MAX_FILE - off < IO_CHUNK ? MAX_FILE - off : IO_CHUNK;
+                sample_begin(&sw);
+                n = bfs->pwrite(h, buf, len, off);
+                sample_end(&sw);
+                if (n != (ssize_t)len) die("pwrite", rel);
+            }
+            for (off_t off = 0; off < MAX_FILE; off += IO_CHUNK) {
+                sample_begin(&sr);
+                n = bfs->pread(h, buf, IO_CHUNK, off);
+                sample_end(&sr);
+                if (n < 0) die("pread", rel);
+            }
+
+            // random block-sized I/O within the file
+            for (int i = 0; i < 64; i++) {
+                off_t off = (off_t)(rng_next() % (MAX_FILE / BLOCK_SIZE)) * BLOCK_SIZE;
+                sample_begin(&rw);
+                n = bfs->pwrite(h, buf, BLOCK_SIZE, off);
+                sample_end(&rw);
+                if (n != BLOCK_SIZE) die("pwrite", rel);
+
+                off = (off_t)(rng_next() % (MAX_FILE / BLOCK_SIZE)) * BLOCK_SIZE;
+                sample_begin(&rr);
+                n = bfs->pread(h, buf, BLOCK_SIZE, off);
+                sample_end(&rr);
+                if (n < 0) die("pread", rel);
+            }
+            bfs->close(h);
+        }
+    }
+    report("seq_write_4k", &sw);
+    report("seq_read_4k", &sr);
+    report("rand_write_512", &rw);
+    report("rand_read_512", &rr);
+}
+
+// hot paths inside libwfs, timed without any FUSE or syscall overhead
+static void bench_core(void) {
+    struct samples lookup = {0}, alloc = {0}, offs = {0};
+    struct wfs_inode *inode;
+    char rel[4096] = "core";
+    char buf[BLOCK_SIZE] = {0};
+    int rc;
+
+    if (!img) return;
+
+    // a deep chain for path resolution and a full file for data_offset
+    check(bfs->mkdir(rel), "mkdir", rel);
+    int h = bfs->open("core/file");
+    check(h, "open", "core/file");
+    for (off_t off = 0; off < MAX_FILE; off += BLOCK_SIZE)
+        if (bfs->pwrite(h, buf, BLOCK_SIZE, off) != BLOCK_SIZE) die("pwrite", "core/file");
+    for (int i = 0; i < DEEP_LEVELS; i++) {
+        strcat(rel, "/d");
+        check(bfs->mkdir(rel), "mkdir", rel);
+    }
+
+    char path[4096];
+    lib_path(path, sizeof(path), rel);
+
+    for (int r = 0; r < rounds * 1024; r++) {
+        sample_begin(&lookup);
+        rc = get_inode_from_path(img, path, &inode);
+        sample_end(&lookup);
+        check(rc, "lookup", path);
+    }
+
+    for (int r = 0; r < rounds * 1024; r++) {
+        sample_begin(&alloc);
+        off_t blk = allocate_data_block(img, 0);
+        free_block(img, blk);
+        sample_end(&alloc);
+        if (blk < 0) die("allocate", "data block");
+    }
+
+    check(get_inode_from_path(img, "/core/file", &inode), "lookup", "/core/file");
+    for (int r = 0; r < rounds * 64; r++) {
+        for (off_t off = 0; off < MAX_FILE; off += BLOCK_SIZE) {
+            sample_begin(&offs);
+            char *p = data_offset(img, inode, off, 0);
+            sample_end(&offs);
+            if (!p) die("data_offset", "/core/file");
+        }
+    }
+
+    report("core_lookup_deep", &lookup);
+    report("core_alloc_free", &alloc);
+    report("core_data_offset", &offs);
+}
+
+/* --------------------------------- Main ----------------------------------- */
+static const struct {
+    const char *name;
+    void (*run)(void);
+} workloads[] = {
+    {"storm", bench_storm},
+    {"wide",  bench_wide},
+    {"deep",  bench_deep},
+    {"io",    bench_io},
+    {"core",  bench_core},
+};
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:i:r:s:w:")) != -1) {
+        switch (opt) {
+        case 'd':
+            root = optarg;
+            break;
+        case 'i':
+            if (!(img = wfs_open_image(optarg))) die("open image", optarg);
+            wfs_start_loaders(img);
+            bfs = &lib_fs;
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        default:
+            printf("usage: ./wfs_bench (-d <mount dir> | -i <disk img>) [-r <rounds>] [-s <seed>] [-w storm|wide|deep|io|core]\n");
+            exit(1);
+        }
+    }
+    if (rounds < 1) rounds = 1;
+    if (seed == 0) seed = 1;
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (only && strcmp(only, workloads[i].name) != 0) continue;
+        workloads[i].run();
+    }
+
+    wfs_close_image(img);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Build a fresh image, mount it and run the benchmark workloads against it.
+# Results go to stdout and bench_output.txt as one JSON object per line.
+# Extra arguments are passed to wfs_bench (e.g. -r 8 -w io). With --core the
+# image is driven in-process through libwfs instead of being mounted.
+
+IMG=bench.img
+MNT=bench_mnt
+
+dd if=/dev/zero of=$IMG bs=1M count=8 status=none || exit 1
+./mkfs -d $IMG -i 1024 -b 4096 > /dev/null || exit 1
+
+if [ "$1" = "--core" ]; then
+    shift
+    trap 'rm -f $IMG' EXIT
+    ./wfs_bench -i $IMG "$@" | tee bench_output.txt
+    exit ${PIPESTATUS[0]}
+fi
+
+mkdir -p $MNT
+./wfs $IMG -s $MNT || exit 1
+trap './umount.sh $MNT; rm -f $IMG; rmdir $MNT' EXIT
+
+# wait for the mount to show up before timing anything
+for i in $(seq 50); do
+    mountpoint -q $MNT && break
+    sleep 0.1
+done
+mountpoint -q $MNT || { echo "bench: mount failed"; exit 1; }
+
+./wfs_bench -d $MNT "$@" | tee bench_output.txt
@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define POLY 0x82f63b78u    // CRC32C, bit reversed
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+// table[k][n] is the CRC of byte n followed by k zero bytes
+static void make_table(void)
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+}
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len && ((uintptr_t)p & 7); len--)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        w ^= crc;
+        crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+              table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+              table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+              table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+    }
+#endif
+    for (; len; len--)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+/* The crc32 instruction issues every cycle but takes three to finish, so
+ * one chain of them runs at a third of the speed the unit can go. Long
+ * buffers are done as three lanes of LANE bytes side by side, joined with
+ * lane_shift: lane_shift[k][n] is what byte k of a CRC turns into after
+ * LANE zero bytes, which is all the earlier lanes' CRC needs to move past
+ * a later one. LANE * 3 fits a 512 byte block with a word to spare. */
+#define LANE 168
+
+static uint32_t lane_shift[4][256];
+static pthread_once_t lane_once = PTHREAD_ONCE_INIT;
+
+static void make_lane_shift(void)
+{
+    uint32_t bit[32];
+    for (int i = 0; i < 32; i++) {
+        uint32_t c = 1u << i;
+        for (int k = 0; k < LANE * 8; k++)
+            c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        bit[i] = c;
+    }
+    for (int k = 0; k < 4; k++)
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = 0;
+            for (int j = 0; j < 8; j++)
+                if (n & (1u << j)) c ^= bit[8 * k + j];
+            lane_shift[k][n] = c;
+        }
+}
+
+static uint32_t shift_lane(uint32_t c)
+{
+    return lane_shift[0][c & 0xff] ^ lane_shift[1][(c >> 8) & 0xff] ^
+           lane_shift[2][(c >> 16) & 0xff] ^ lane_shift[3][c >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    for (; len && ((uintptr_t)p & 7); len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+
+    uint64_t c = crc;
+    for (; len >= 3 * LANE; len -= 3 * LANE, p += 3 * LANE) {
+        uint64_t c1 = 0, c2 = 0;
+        for (int i = 0; i < LANE; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, sizeof(w0));
+            memcpy(&w1, p + LANE + i, sizeof(w1));
+            memcpy(&w2, p + 2 * LANE + i, sizeof(w2));
+            c = __builtin_ia32_crc32di(c, w0);
+            c1 = __builtin_ia32_crc32di(c1, w1);
+            c2 = __builtin_ia32_crc32di(c2, w2);
+        }
+        c = shift_lane((uint32_t)c) ^ c1;
+        c = shift_lane((uint32_t)c) ^ c2;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c = __builtin_ia32_crc32di(c, w);
+    }
+    crc = (uint32_t)c;
+
+    for (; len; len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+typedef uint32_t (*crc_fn)(uint32_t, const uint8_t *, size_t);
+static crc_fn impl;
+
+static crc_fn pick(void)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        pthread_once(&lane_once, make_lane_shift);
+        return crc_hw;
+    }
+#endif
+    pthread_once(&table_once, make_table);
+    return crc_sw;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    crc_fn f = __atomic_load_n(&impl, __ATOMIC_ACQUIRE);
+    if (!f) {
+        f = pick();
+        __atomic_store_n(&impl, f, __ATOMIC_RELEASE);
+    }
+    return ~f(~crc, buf, len);
+}
@@ -0,0 +1,16 @@
+#ifndef WFS_CRC32C_H
+#define WFS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  CRC32C (Castagnoli), as used for block checksums. Runs on the SSE4.2
+  crc32 instruction when the CPU has it and falls back to a slice-by-8
+  table otherwise; both give the same result. Pass 0 to start, or a
+  previous result to continue it over more bytes.
+*/
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
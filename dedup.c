@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/statvfs.h>
+#include "wfs.h"
+#include "libwfs.h"
+
+/* --------------------------------------------------------------------------
+ * wfs_dedup: offline block deduplication
+ *
+ *     ./wfs_dedup <disk img>
+ *
+ * Runs every regular file of an unmounted image through the dedup index in
+ * inode order, so each full block identical to one seen before is pointed
+ * at that block and its own is freed. A mount with --dedup does the same
+ * for blocks as they are written, but only knows what it has seen; this
+ * catches everything already on the image.
+ * --------------------------------------------------------------------------
+ */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        printf("usage: ./wfs_dedup <disk img>\n");
+        exit(1);
+    }
+
+    struct wfs_ctx *fs = wfs_open_image(argv[1]);
+    if (!fs) {
+        fprintf(stderr, "wfs_dedup: %s: %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+    wfs_start_loaders(fs);
+    int rc = wfs_set_dedup(fs, 1);
+    if (rc < 0) {
+        fprintf(stderr, "wfs_dedup: %s: %s\n", argv[1], strerror(-rc));
+        wfs_close_image(fs);
+        exit(1);
+    }
+
+    struct statvfs before, after;
+    wfs_fsstat(fs, &before);
+
+    size_t files = 0, merged = 0;
+    for (fsblkcnt_t inum = 0; inum < before.f_files; inum++) {
+        int n = wfs_dedup_file(fs, inum);
+        if (n < 0) continue;
+        files++;
+        merged += n;
+    }
+
+    wfs_fsstat(fs, &after);
+    printf("%s: %zu inodes scanned, %zu blocks merged, %llu blocks freed\n", argv[1], files, merged,
+           (unsigned long long)(after.f_bfree - before.f_bfree));
+    wfs_close_image(fs);
+    return 0;
+}
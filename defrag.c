@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+#include "wfs.h"
+#include "libwfs.h"
+
+/* --------------------------------------------------------------------------
+ * wfs_defrag: offline defragmentation and fragmentation report
+ *
+ *     ./wfs_defrag [-n] <disk img>
+ *
+ * Lists every file of an unmounted image that is in more than one piece,
+ * with its fragmentation score, then moves each into one free run (-n only
+ * reports) and prints the score of the whole image before and after. A
+ * mount with --defrag=<seconds> does the same in the background, and
+ * /.wfs/frag reports on a mounted image.
+ * --------------------------------------------------------------------------
+ */
+
+static void add(struct wfs_frag *sum, const struct wfs_frag *f) {
+    sum->files += f->files;
+    sum->blocks += f->blocks;
+    sum->fragments += f->fragments;
+}
+
+int main(int argc, char *argv[]) {
+    int dry_run = 0, opt;
+    while ((opt = getopt(argc, argv, "n")) != -1) {
+        if (opt != 'n') {
+            printf("usage: ./wfs_defrag [-n] <disk img>\n");
+            exit(1);
+        }
+        dry_run = 1;
+    }
+    if (optind != argc - 1) {
+        printf("usage: ./wfs_defrag [-n] <disk img>\n");
+        exit(1);
+    }
+    const char *img = argv[optind];
+
+    struct wfs_ctx *fs = wfs_open_image(img);
+    if (!fs) {
+        fprintf(stderr, "wfs_defrag: %s: %s\n", img, strerror(errno));
+        exit(1);
+    }
+    wfs_start_loaders(fs);
+
+    struct statvfs st;
+    wfs_fsstat(fs, &st);
+
+    struct wfs_frag before = {0}, after = {0}, f;
+    size_t moved = 0, stuck = 0;
+    for (fsblkcnt_t inum = 0; inum < st.f_files; inum++) {
+        if (wfs_frag(fs, inum, &f) < 0 || f.files == 0) continue;
+        add(&before, &f);
+        if (f.fragments > 1)
+            printf("inode %lu: %zu blocks in %zu fragments, score %.1f\n", (unsigned long)inum, f.blocks,
+                   f.fragments, wfs_frag_score(&f));
+
+        if (!dry_run && f.fragments > 1) {
+            int n = wfs_defrag_file(fs, inum);
+            if (n > 0) moved += n;
+            else stuck++;
+            wfs_frag(fs, inum, &f);
+        }
+        add(&after, &f);
+    }
+
+    printf("%s: %zu files, %zu blocks in %zu fragments, score %.1f\n", img, before.files, before.blocks,
+           before.fragments, wfs_frag_score(&before));
+    if (!dry_run)
+        printf("%s: %zu blocks moved, %zu files left in pieces, score now %.1f\n", img, moved, stuck,
+               wfs_frag_score(&after));
+    wfs_close_image(fs);
+    return 0;
+}
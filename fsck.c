@@ -0,0 +1,732 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wfs.h"
+#include "libwfs.h"
+#include "crc32c.h"
+
+/* --------------------------------------------------------------------------
+ * fsck.wfs: check and repair a WFS image
+ *
+ *     ./fsck.wfs [-f] [-y] [-j threads] <disk img>
+ *
+ * An image whose superblock carries WFS_STATE_CLEAN was unmounted cleanly
+ * and only gets its superblock checked unless -f is given. Otherwise,
+ * inodes left on the orphan list (unlinked but not yet reclaimed) are
+ * freed first, and then:
+ *
+ *   1. Every inode slot is validated in parallel: type, block pointers
+ *      (in range, block aligned, owned by exactly one inode, the lowest
+ *      numbered claimant wins, unless every pointer to the block is marked
+ *      shared) and size against the blocks it owns. On an image with a
+ *      checksum area, every block a pointer claims as written is checked
+ *      against its CRC32C before anything is changed.
+ *   2. The directory tree is walked from the root by a pool of threads.
+ *      Entries pointing at free or invalid inodes, duplicate names and
+ *      second parents of a directory are dropped; every surviving entry
+ *      adds a reference to its target.
+ *   3. Inodes in use that no directory reaches are orphans. Orphaned
+ *      directories are walked too, so only the top of each orphaned
+ *      subtree is reported.
+ *   4. nlinks is compared against the references found, and so is the
+ *      count in each xattr block; the inode and data bitmaps are rebuilt
+ *      from what is reachable.
+ *
+ * Without -y the image is mapped copy-on-write: repairs are made in
+ * memory so later passes see a consistent image, and nothing is written.
+ * With -y the repairs are written back, every block in use gets its
+ * checksum recomputed, orphans are linked into /lost+found as "#<inum>"
+ * and the image is marked clean, with exact free counts.
+ *
+ * Exit status follows fsck(8): 0 no errors, 1 errors corrected, 4 errors
+ * left uncorrected, 8 operational error.
+ * --------------------------------------------------------------------------
+ */
+
+#define MAX_THREADS 64
+#define PTRS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(off_t)))
+#define DENTS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(struct wfs_dentry)))
+
+static char *base;
+static size_t img_size;
+static struct wfs_sb *sb;
+static struct wfs_layout lay;
+static int repair;
+static int nthreads;
+
+static int *owner;          // per data block: lowest inode claiming it
+static uint32_t *sums;      // the checksum area, NULL if the image has none
+static uint32_t *written;   // per data block: a pointer claims it holds data
+static int any_shared;      // a shared block survived pass 1
+static uint32_t *xattr_refs;  // per data block: inodes keeping their xattrs in it
+
+// owner of a block that only shared (deduplicated) pointers claim
+#define SHARED_OWNER INT_MAX
+static uint8_t *in_use;     // per inode: passed validation
+static uint32_t *refs;      // per inode: directory entries pointing at it
+static int *parent;         // per directory: the directory holding it
+static uint8_t *visited;    // per directory: entries already walked
+static uint32_t *imap, *dmap;
+static uint64_t problems;
+
+#define report(...) do { printf(__VA_ARGS__); __atomic_fetch_add(&problems, 1, __ATOMIC_RELAXED); } while (0)
+
+static struct wfs_inode *slot(size_t inum) {
+    return (struct wfs_inode *)(base + wfs_inode_off(&lay, inum));
+}
+
+static int bit(const uint32_t *map, size_t i) {
+    return (map[i / 32] >> (i % 32)) & 1;
+}
+
+static void set_bit(uint32_t *map, size_t i) {
+    __atomic_fetch_or(&map[i / 32], 1u << (i % 32), __ATOMIC_RELAXED);
+}
+
+static int inline_symlink(struct wfs_inode *inode) {
+    return S_ISLNK(inode->mode) && (size_t)inode->size < sizeof(inode->blocks);
+}
+
+// index of the data block at byte offset 'off', -1 if it is not one
+static long block_index(off_t off) {
+    return wfs_block_num(&lay, blk_addr(off));
+}
+
+// a group's bitmap as it is on disk
+static uint32_t *group_imap(uint32_t g) {
+    return (uint32_t *)(base + lay.groups[g].i_bitmap_ptr);
+}
+
+static uint32_t *group_dmap(uint32_t g) {
+    return (uint32_t *)(base + lay.groups[g].d_bitmap_ptr);
+}
+
+static void run_parallel(void *(*fn)(void *)) {
+    pthread_t th[MAX_THREADS];
+    for (long t = 0; t < nthreads; t++)
+        pthread_create(&th[t], NULL, fn, (void *)t);
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(th[t], NULL);
+}
+
+/* -------------------------------- Superblock ------------------------------ */
+// returns 0 if the layout is usable, -1 if nothing can be trusted
+static int check_sb(void) {
+    if (img_size < sizeof(struct wfs_sb)) {
+        printf("image is smaller than a superblock\n");
+        return -1;
+    }
+
+    if (sb->magic == WFS_MAGIC) {
+        if (wfs_layout_init(&lay, base, img_size) < 0) {
+            printf("superblock layout is inconsistent (%u groups of %u inodes, %u blocks)\n",
+                   sb->num_groups, sb->inodes_per_group, sb->blocks_per_group);
+            return -1;
+        }
+        // each group's regions in order, and no group running into the next
+        off_t end = sb->first_group;
+        for (uint32_t g = 0; g < lay.num_groups; g++) {
+            struct wfs_group_desc *gd = &lay.groups[g];
+            if (gd->i_bitmap_ptr < end ||
+                gd->d_bitmap_ptr < gd->i_bitmap_ptr + (off_t)(lay.inodes_per_group / 8) ||
+                gd->i_blocks_ptr < gd->d_bitmap_ptr + (off_t)(lay.blocks_per_group / 8) ||
+                gd->d_blocks_ptr < gd->i_blocks_ptr + (off_t)wfs_group_inodes(&lay, g) * BLOCK_SIZE) {
+                printf("group %u overlaps its neighbours\n", g);
+                return -1;
+            }
+            end = gd->d_blocks_ptr + (off_t)wfs_group_blocks(&lay, g) * BLOCK_SIZE;
+        }
+        return 0;
+    }
+
+    // flat images: WFS1 ended the superblock at the state field, and mkfs
+    // before the magic was added put the bitmap where the magic now sits
+    off_t start = offsetof(struct wfs_sb, num_groups);
+    if (sb->magic != WFS_MAGIC_V1) {
+        printf("superblock has no magic; assuming a pre-fsck image, no clean flag\n");
+        start = offsetof(struct wfs_sb, magic);
+    }
+
+    if (sb->num_inodes == 0 || sb->num_inodes % 32 || sb->num_data_blocks % 32 ||
+        sb->i_bitmap_ptr != start ||
+        sb->d_bitmap_ptr != sb->i_bitmap_ptr + (off_t)(sb->num_inodes / 8) ||
+        sb->i_blocks_ptr != sb->d_bitmap_ptr + (off_t)(sb->num_data_blocks / 8) ||
+        sb->d_blocks_ptr != sb->i_blocks_ptr + (off_t)(sb->num_inodes * BLOCK_SIZE) ||
+        (size_t)sb->d_blocks_ptr + sb->num_data_blocks * BLOCK_SIZE > img_size) {
+        printf("superblock layout is inconsistent (%zu inodes, %zu blocks, image %zu bytes)\n",
+               sb->num_inodes, sb->num_data_blocks, img_size);
+        return -1;
+    }
+    return wfs_layout_init(&lay, base, img_size);
+}
+
+/* ------------------------------ Orphan list ------------------------------- */
+static void release(off_t ptr) {
+    long b = block_index(ptr);
+    if (b < 0) return;
+    uint32_t *map = group_dmap(b / lay.blocks_per_group);
+    size_t k = b % lay.blocks_per_group;
+    map[k / 32] &= ~(1u << (k % 32));
+}
+
+/* Inodes on the orphan list were unlinked, but the image was closed before
+ * the reclaimer got to them. Free them here, as the next mount would. A
+ * block one of them shares with a live inode is marked again in pass 4. */
+static void reclaim_orphans(void) {
+    size_t n = 0;
+    uint32_t i = sb->orphans;
+
+    while (i != 0) {
+        uint32_t *ibm = i < lay.num_inodes ? group_imap(i / lay.inodes_per_group) : NULL;
+        size_t ib = i % lay.inodes_per_group;
+        if (!ibm || !bit(ibm, ib) || slot(i)->nlinks != 0) {
+            report("orphan list is damaged at inode %u, dropping the rest\n", i);
+            break;
+        }
+        struct wfs_inode *inode = slot(i);
+        if (!inline_symlink(inode)) {
+            for (int k = 0; k < IND_SLOT; k++)
+                release(inode->blocks[k]);
+            if (block_index(inode->blocks[IND_SLOT]) >= 0) {
+                off_t *ind = (off_t *)(base + inode->blocks[IND_SLOT]);
+                for (int k = 0; k < PTRS_PER_BLOCK; k++)
+                    release(ind[k]);
+                release(inode->blocks[IND_SLOT]);
+            }
+        }
+        uint32_t next = inode->next_orphan;
+        ibm[ib / 32] &= ~(1u << (ib % 32));
+        memset(inode, 0, BLOCK_SIZE);
+        n++;
+        i = next;
+    }
+    sb->orphans = 0;
+    if (n) printf("released %zu unlinked inode%s from the orphan list\n", n, n == 1 ? "" : "s");
+}
+
+/* ----------------------------- Pass 1: inodes ----------------------------- */
+static int looks_used(int inum) {
+    struct wfs_inode *inode = slot(inum);
+
+    if (bit(group_imap(inum / lay.inodes_per_group), inum % lay.inodes_per_group)) return 1;
+    // freed slots are zeroed, so a populated one was lost from the bitmap
+    return inode->num == inum && inode->mode != 0 && inode->nlinks > 0;
+}
+
+// a shared pointer only wins a block nobody claims for themselves
+static void claim(int inum, off_t ptr) {
+    long b = block_index(ptr);
+    if (b < 0) return;
+    if (sums && !(ptr & BLK_UNWRITTEN)) set_bit(written, b);
+    if (ptr & BLK_SHARED) inum = SHARED_OWNER;
+    int cur = __atomic_load_n(&owner[b], __ATOMIC_RELAXED);
+    while ((cur < 0 || inum < cur) &&
+           !__atomic_compare_exchange_n(&owner[b], &cur, inum, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// 1a: type checks and block claims
+static void *pass1a(void *arg) {
+    long t = (long)arg;
+    for (size_t i = t; i < sb->num_inodes; i += nthreads) {
+        if (!looks_used(i)) continue;
+        struct wfs_inode *inode = slot(i);
+
+        if (!S_ISREG(inode->mode) && !S_ISDIR(inode->mode) && !S_ISLNK(inode->mode)) {
+            report("inode %zu: bad mode 0%o, clearing\n", i, inode->mode);
+            memset(inode, 0, BLOCK_SIZE);
+            continue;
+        }
+        if (inode->num != (int)i) {
+            report("inode %zu: records number %d, fixing\n", i, inode->num);
+            inode->num = i;
+        }
+        in_use[i] = 1;
+
+        // any number of inodes may share an xattr block
+        if (inode->xattr_blk)
+            claim(i, inode->xattr_blk | BLK_SHARED);
+        if (inline_symlink(inode)) continue;
+        for (int k = 0; k <= IND_SLOT; k++)
+            claim(i, inode->blocks[k]);
+        if (block_index(inode->blocks[IND_SLOT]) >= 0) {
+            off_t *ind = (off_t *)(base + inode->blocks[IND_SLOT]);
+            for (int k = 0; k < PTRS_PER_BLOCK; k++)
+                claim(i, ind[k]);
+        }
+    }
+    return NULL;
+}
+
+// 1c: checksums of the blocks claimed in 1a, while they are as found
+static void *pass1c(void *arg) {
+    long t = (long)arg;
+    size_t per = (sb->num_data_blocks + nthreads - 1) / nthreads;
+    size_t end = (t + 1) * per < sb->num_data_blocks ? (t + 1) * per : sb->num_data_blocks;
+    for (size_t b = t * per; b < end; b++) {
+        if (!bit(written, b)) continue;
+        if (crc32c(0, base + wfs_block_off(&lay, b), BLOCK_SIZE) != sums[b])
+            report("block %zu (inode %d): checksum mismatch%s\n", b, owner[b],
+                   repair ? ", recomputing" : "");
+    }
+    return NULL;
+}
+
+// drop 'ptr' unless it is a valid block this inode won; mark it in the new bitmap
+static int keep(size_t inum, off_t *ptr, const char *what) {
+    if (*ptr == 0) return 0;
+    if (*ptr == BLK_COMPRESSED) return 1;   // stored in its cluster's other blocks
+
+    long b = block_index(*ptr);
+    int shared = (*ptr & BLK_SHARED) != 0;
+    if (b < 0) {
+        report("inode %zu: %s points outside the data region (%lld), clearing\n",
+               inum, what, (long long)*ptr);
+    } else if (owner[b] != (shared ? SHARED_OWNER : (int)inum)) {
+        report("inode %zu: %s block %ld is also used by inode %d, clearing\n",
+               inum, what, b, owner[b]);
+    } else {
+        set_bit(dmap, b);
+        if (shared) __atomic_store_n(&any_shared, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    *ptr = 0;
+    return 0;
+}
+
+// drop the inode's xattr block unless it is valid and nothing else won it
+static void keep_xattr(size_t inum, struct wfs_inode *inode) {
+    if (inode->xattr_blk == 0) return;
+
+    long b = block_index(inode->xattr_blk);
+    if (b < 0 || inode->xattr_blk % BLOCK_SIZE != 0) {
+        report("inode %zu: xattr block points outside the data region (%lld), clearing\n",
+               inum, (long long)inode->xattr_blk);
+    } else if (owner[b] != SHARED_OWNER) {
+        report("inode %zu: xattr block %ld is also used by inode %d, clearing\n", inum, b, owner[b]);
+    } else if (((struct wfs_xattr_hdr *)(base + inode->xattr_blk))->magic != WFS_XATTR_MAGIC ||
+               ((struct wfs_xattr_hdr *)(base + inode->xattr_blk))->used > WFS_XATTR_SPACE) {
+        report("inode %zu: block %ld is not an xattr block, clearing\n", inum, b);
+    } else {
+        set_bit(dmap, b);
+        __atomic_fetch_add(&xattr_refs[b], 1, __ATOMIC_RELAXED);
+        return;
+    }
+    inode->xattr_blk = 0;
+}
+
+// 1b: resolve claims, rebuild the data bitmap, fix sizes
+static void *pass1b(void *arg) {
+    long t = (long)arg;
+    for (size_t i = t; i < sb->num_inodes; i += nthreads) {
+        if (!in_use[i]) continue;
+        struct wfs_inode *inode = slot(i);
+        keep_xattr(i, inode);
+        if (inline_symlink(inode)) continue;
+
+        int last = -1;
+        for (int k = 0; k < D_BLOCK; k++)
+            if (keep(i, &inode->blocks[k], "direct")) last = k;
+
+        if (inode->blocks[IND_BLOCK] != 0) {
+            report("inode %zu: unused block slot is set, clearing\n", i);
+            inode->blocks[IND_BLOCK] = 0;
+        }
+        if (S_ISDIR(inode->mode) && inode->blocks[IND_SLOT] != 0) {
+            report("inode %zu: directory has an indirect block, clearing\n", i);
+            inode->blocks[IND_SLOT] = 0;
+        }
+        if (keep(i, &inode->blocks[IND_SLOT], "indirect")) {
+            off_t *ind = (off_t *)(base + inode->blocks[IND_SLOT]);
+            for (int k = 0; k < PTRS_PER_BLOCK; k++)
+                if (keep(i, &ind[k], "indirect entry")) last = D_BLOCK + k;
+        }
+
+        // the block holding the last byte is always allocated by a write
+        off_t hi = (off_t)(last + 1) * BLOCK_SIZE;
+        off_t lo = last < 0 ? 0 : (off_t)last * BLOCK_SIZE + 1;
+        if (S_ISDIR(inode->mode)) lo = hi;
+        if (inode->size < lo || inode->size > hi) {
+            report("inode %zu: size %lld does not match its blocks, setting %lld\n",
+                   i, (long long)inode->size, (long long)hi);
+            inode->size = hi;
+        }
+    }
+    return NULL;
+}
+
+/* --------------------------- Pass 2: directories -------------------------- */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    int *stack;
+    size_t n;
+    int busy;
+} work = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void push_dir(int inum) {
+    pthread_mutex_lock(&work.lock);
+    work.stack[work.n++] = inum;
+    pthread_cond_signal(&work.more);
+    pthread_mutex_unlock(&work.lock);
+}
+
+static void walk_dir(int dir) {
+    struct wfs_inode *inode = slot(dir);
+
+    for (int b = 0; b < D_BLOCK; b++) {
+        if (inode->blocks[b] == 0) continue;
+        struct wfs_dentry *d = (struct wfs_dentry *)(base + inode->blocks[b]);
+
+        for (int j = 0; j < DENTS_PER_BLOCK; j++) {
+            if (d[j].num == 0 && d[j].name[0] == '\0') continue;
+
+            const char *why = NULL;
+            int target = d[j].num;
+            if (d[j].num == 0 || d[j].name[0] == '\0')
+                why = "half-removed entry";
+            else if (memchr(d[j].name, '\0', MAX_NAME) == NULL)
+                why = "unterminated name";
+            else if (target < 0 || (size_t)target >= sb->num_inodes || !in_use[target])
+                why = "entry points at a free inode";
+
+            // earlier slots win a duplicate name
+            for (int bb = 0; !why && bb <= b; bb++) {
+                if (inode->blocks[bb] == 0) continue;
+                struct wfs_dentry *o = (struct wfs_dentry *)(base + inode->blocks[bb]);
+                for (int jj = 0; jj < (bb == b ? j : DENTS_PER_BLOCK); jj++)
+                    if (o[jj].num != 0 && strncmp(o[jj].name, d[j].name, MAX_NAME) == 0) {
+                        why = "duplicate name";
+                        break;
+                    }
+            }
+
+            int unset = -1;
+            if (!why && S_ISDIR(slot(target)->mode) &&
+                !__atomic_compare_exchange_n(&parent[target], &unset, dir, 0,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                why = "second link to a directory";
+
+            if (why) {
+                report("directory %d: %s \"%.*s\" -> %d, removing\n",
+                       dir, why, MAX_NAME, d[j].name, d[j].num);
+                d[j].num = 0;
+                d[j].name[0] = '\0';
+                continue;
+            }
+
+            __atomic_fetch_add(&refs[target], 1, __ATOMIC_RELAXED);
+            if (S_ISDIR(slot(target)->mode) &&
+                !__atomic_exchange_n(&visited[target], 1, __ATOMIC_ACQ_REL))
+                push_dir(target);
+        }
+    }
+}
+
+static void *walker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&work.lock);
+    for (;;) {
+        while (work.n == 0 && work.busy > 0)
+            pthread_cond_wait(&work.more, &work.lock);
+        if (work.n == 0) break;
+
+        int dir = work.stack[--work.n];
+        work.busy++;
+        pthread_mutex_unlock(&work.lock);
+
+        walk_dir(dir);
+
+        pthread_mutex_lock(&work.lock);
+        work.busy--;
+    }
+    pthread_cond_broadcast(&work.more);
+    pthread_mutex_unlock(&work.lock);
+    return NULL;
+}
+
+// walk the tree under 'dir', which becomes the root of its own tree
+static void walk_from(int dir) {
+    parent[dir] = dir;
+    visited[dir] = 1;
+    work.stack[work.n++] = dir;
+    run_parallel(walker);
+}
+
+/*
+ * Orphaned directories may still hold each other. Walk from the ones no
+ * other orphan points at first, so a subtree stays in one piece; whatever
+ * is left over then sits on a cycle, which is broken at an arbitrary
+ * directory.
+ */
+static void walk_orphans(void) {
+    int *held = malloc(sb->num_inodes * sizeof(int));
+    if (!held) return;
+    memset(held, 0, sb->num_inodes * sizeof(int));
+
+    for (size_t i = 1; i < sb->num_inodes; i++) {
+        struct wfs_inode *inode = slot(i);
+        if (!in_use[i] || !S_ISDIR(inode->mode) || visited[i]) continue;
+
+        for (int b = 0; b < D_BLOCK; b++) {
+            if (inode->blocks[b] == 0) continue;
+            struct wfs_dentry *d = (struct wfs_dentry *)(base + inode->blocks[b]);
+            for (int j = 0; j < DENTS_PER_BLOCK; j++) {
+                int c = d[j].num;
+                if (c > 0 && (size_t)c < sb->num_inodes && c != (int)i && in_use[c] &&
+                    S_ISDIR(slot(c)->mode) && !visited[c])
+                    held[c] = 1;
+            }
+        }
+    }
+
+    for (int pass = 0; pass < 2; pass++)
+        for (size_t i = 1; i < sb->num_inodes; i++)
+            if (in_use[i] && S_ISDIR(slot(i)->mode) && !visited[i] && (pass || !held[i]))
+                walk_from(i);
+    free(held);
+}
+
+/* Count where a group's on-disk bitmap and the rebuilt one (for the whole
+ * image, starting at 'first') disagree, then make the disk match. */
+static void sync_map(uint32_t *disk, const uint32_t *built, size_t first, size_t n,
+                     size_t *leaked, size_t *unmarked) {
+    for (size_t k = 0; k < n; k++) {
+        int d = bit(disk, k), b = bit(built, first + k);
+        *leaked += d && !b;
+        *unmarked += !d && b;
+        if (d != b) disk[k / 32] ^= 1u << (k % 32);
+    }
+}
+
+static size_t count_bits(const uint32_t *map, size_t n) {
+    size_t c = 0;
+    for (size_t i = 0; i < n; i++)
+        c += bit(map, i);
+    return c;
+}
+
+/* ---------------------------------- Main ---------------------------------- */
+static int is_orphan(size_t i) {
+    if (!in_use[i] || i == 0) return 0;
+    return S_ISDIR(slot(i)->mode) ? parent[i] == (int)i : refs[i] == 0;
+}
+
+// give orphans a name under /lost+found; returns how many stayed orphaned
+static int reconnect(const char *path, int *orphans, int n) {
+    struct wfs_ctx *fs = wfs_open_image(path);
+    if (!fs) return n;
+
+    int lf, left = 0;
+    struct wfs_inode *dir;
+    if (wfs_lookup(fs, "/lost+found", &lf) < 0)
+        lf = wfs_create(fs, "/lost+found", S_IFDIR | 0700);
+    if (lf < 0 || !(dir = retrieve_inode(fs, lf)) || !S_ISDIR(dir->mode)) {
+        wfs_close_image(fs);
+        return n;
+    }
+
+    for (int k = 0; k < n; k++) {
+        char name[MAX_NAME];
+        snprintf(name, sizeof(name), "#%d", orphans[k]);
+        if (add_dentry(fs, dir, orphans[k], name) < 0) {
+            printf("lost+found is full, inode %d stays orphaned\n", orphans[k]);
+            left++;
+            continue;
+        }
+        struct wfs_inode *inode = retrieve_inode(fs, orphans[k]);
+        inode->nlinks = 1;
+    }
+    wfs_close_image(fs);
+    return left;
+}
+
+int main(int argc, char *argv[]) {
+    int opt, force = 0;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "fyj:")) != -1) {
+        switch (opt) {
+        case 'f':
+            force = 1;
+            break;
+        case 'y':
+            repair = 1;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+usage:
+        printf("usage: ./fsck.wfs [-f] [-y] [-j <threads>] <disk img>\n");
+        return 8;
+    }
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+    const char *path = argv[optind];
+    int fd = open(path, repair ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return 8;
+    }
+    img_size = st.st_size;
+    base = mmap(NULL, img_size, PROT_READ | PROT_WRITE, repair ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 8;
+    }
+    sb = (struct wfs_sb *)base;
+
+    if (check_sb() < 0)
+        return 4;
+    int has_state = sb->magic == WFS_MAGIC || sb->magic == WFS_MAGIC_V1;
+    if (has_state && (sb->state & WFS_STATE_CLEAN) && !force) {
+        printf("%s: clean, %zu inodes, %zu blocks in %u group%s\n", path, sb->num_inodes,
+               sb->num_data_blocks, lay.num_groups, lay.num_groups == 1 ? "" : "s");
+        return 0;
+    }
+
+    if (lay.csum_ptr) {
+        sums = (uint32_t *)(base + lay.csum_ptr);
+        written = calloc(sb->num_data_blocks / 32 + 1, sizeof(uint32_t));
+    }
+    owner = malloc(sb->num_data_blocks * sizeof(int));
+    parent = malloc(sb->num_inodes * sizeof(int));
+    in_use = calloc(sb->num_inodes, 1);
+    visited = calloc(sb->num_inodes, 1);
+    refs = calloc(sb->num_inodes, sizeof(uint32_t));
+    imap = calloc(sb->num_inodes / 32, sizeof(uint32_t));
+    dmap = calloc(sb->num_data_blocks / 32 + 1, sizeof(uint32_t));
+    xattr_refs = calloc(sb->num_data_blocks, sizeof(uint32_t));
+    work.stack = malloc(sb->num_inodes * sizeof(int));
+    if (!owner || !parent || !in_use || !visited || !refs || !imap || !dmap || !xattr_refs || !work.stack ||
+        (sums && !written)) {
+        perror("fsck");
+        return 8;
+    }
+    memset(owner, 0xff, sb->num_data_blocks * sizeof(int));
+    memset(parent, 0xff, sb->num_inodes * sizeof(int));
+
+    if (sb->magic == WFS_MAGIC)
+        reclaim_orphans();
+
+    printf("pass 1: inodes\n");
+    run_parallel(pass1a);
+    if (sums) run_parallel(pass1c);
+    run_parallel(pass1b);
+
+    struct wfs_inode *root = slot(0);
+    if (!in_use[0] || !S_ISDIR(root->mode)) {
+        report("root directory is missing, recreating it\n");
+        memset(root, 0, BLOCK_SIZE);
+        fillin_inode(root, S_IFDIR | 0755);
+        in_use[0] = 1;
+    }
+
+    printf("pass 2: directory tree\n");
+    walk_from(0);
+
+    printf("pass 3: orphans\n");
+    walk_orphans();
+
+    int *orphans = malloc(sb->num_inodes * sizeof(int)), n_orphans = 0;
+    for (size_t i = 1; i < sb->num_inodes; i++) {
+        if (!is_orphan(i)) continue;
+        report("inode %zu (%s, %lld bytes) is not reachable from the root\n", i,
+               S_ISDIR(slot(i)->mode) ? "directory" : "file", (long long)slot(i)->size);
+        orphans[n_orphans++] = i;
+        refs[i] = 1;
+    }
+
+    printf("pass 4: link counts and bitmaps\n");
+    for (size_t i = 0; i < sb->num_inodes; i++) {
+        if (!in_use[i]) continue;
+        set_bit(imap, i);
+
+        struct wfs_inode *inode = slot(i);
+        int want = S_ISDIR(inode->mode) ? 1 : (int)refs[i];
+        if (inode->nlinks != want) {
+            report("inode %zu: nlinks %d, found %d, fixing\n", i, inode->nlinks, want);
+            inode->nlinks = want;
+        }
+    }
+
+    for (size_t b = 0; b < sb->num_data_blocks; b++) {
+        if (!xattr_refs[b]) continue;
+        struct wfs_xattr_hdr *h = (struct wfs_xattr_hdr *)(base + wfs_block_off(&lay, b));
+        if (h->refs != xattr_refs[b]) {
+            report("xattr block %zu: counts %u inodes, found %u, fixing\n", b, h->refs, xattr_refs[b]);
+            h->refs = xattr_refs[b];
+        }
+    }
+
+    size_t leaked = 0, unmarked = 0;
+    for (uint32_t g = 0; g < lay.num_groups; g++)
+        sync_map(group_imap(g), imap, (size_t)g * lay.inodes_per_group,
+                 wfs_group_inodes(&lay, g), &leaked, &unmarked);
+    if (leaked || unmarked)
+        report("inode bitmap: %zu marked used but free, %zu in use but marked free\n", leaked, unmarked);
+
+    leaked = unmarked = 0;
+    for (uint32_t g = 0; g < lay.num_groups; g++)
+        sync_map(group_dmap(g), dmap, (size_t)g * lay.blocks_per_group,
+                 wfs_group_blocks(&lay, g), &leaked, &unmarked);
+    if (leaked || unmarked)
+        report("data bitmap: %zu blocks marked used but free, %zu in use but marked free\n", leaked, unmarked);
+
+    // exact once repaired, so the next mount need not recount them
+    for (uint32_t g = 0; g < lay.num_groups; g++) {
+        size_t first_i = (size_t)g * lay.inodes_per_group, first_b = (size_t)g * lay.blocks_per_group;
+        lay.groups[g].free_inodes = wfs_group_inodes(&lay, g);
+        lay.groups[g].free_blocks = wfs_group_blocks(&lay, g);
+        for (size_t k = 0; k < wfs_group_inodes(&lay, g); k++)
+            lay.groups[g].free_inodes -= bit(imap, first_i + k);
+        for (size_t k = 0; k < wfs_group_blocks(&lay, g); k++)
+            lay.groups[g].free_blocks -= bit(dmap, first_b + k);
+    }
+
+    int uncorrected = repair ? 0 : problems > 0;
+    if (repair) {
+        if (has_state) {
+            sb->state = (sb->state & ~(WFS_STATE_ERRORS | WFS_STATE_SHARED)) | WFS_STATE_CLEAN |
+                        WFS_STATE_COUNTED;
+            if (any_shared) sb->state |= WFS_STATE_SHARED;
+        }
+        // after every repair above, so the blocks they changed match too
+        if (sums)
+            for (size_t b = 0; b < sb->num_data_blocks; b++)
+                if (bit(dmap, b))
+                    sums[b] = crc32c(0, base + wfs_block_off(&lay, b), BLOCK_SIZE);
+        msync(base, img_size, MS_SYNC);
+        // reconnect last, through libwfs, once the image is consistent
+        if (n_orphans && reconnect(path, orphans, n_orphans) > 0 && has_state) {
+            sb->state |= WFS_STATE_ERRORS;
+            uncorrected = 1;
+        }
+        msync(base, img_size, MS_SYNC);
+    }
+
+    printf("%s: %llu problem%s%s, %zu inodes and %zu blocks in use\n", path,
+           (unsigned long long)problems, problems == 1 ? "" : "s",
+           !problems ? "" : repair ? " fixed" : " found (run with -y to repair)",
+           count_bits(imap, sb->num_inodes), count_bits(dmap, sb->num_data_blocks));
+
+    munmap(base, img_size);
+    close(fd);
+    return uncorrected ? 4 : problems ? 1 : 0;
+}
@@ -0,0 +1,3999 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include "wfs.h"
+#include "libwfs.h"
+#include "lz4.h"
+#include "crc32c.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* --------------------------------------------------------------------------
+ * libwfs: the WFS on-disk format and filesystem logic, independent of FUSE.
+ *
+ * Every function works on a struct wfs_ctx (one per opened image) instead of
+ * process globals, so several images can be open at once and the core can be
+ * linked straight into tools and microbenchmarks. Paths handed to the library
+ * are plain absolute paths; the FUSE frontend in wfs.c strips ANSI color
+ * decorations before calling in.
+ * --------------------------------------------------------------------------
+ */
+
+/* ------------------------------- Checksums -------------------------------- */
+/* Every data block in use has a CRC32C in the checksum area, rewritten
+ * whenever the block changes. A block is checked the first time this
+ * mount reads it; from then on (or once this mount has written it) it
+ * counts as verified, the way a page cache hit is not read again. */
+static int block_verified(struct wfs_ctx *fs, size_t n)
+{
+    return (__atomic_load_n(&fs->verified[n / 64], __ATOMIC_RELAXED) >> (n % 64)) & 1;
+}
+
+static void set_verified(struct wfs_ctx *fs, size_t n)
+{
+    __atomic_fetch_or(&fs->verified[n / 64], 1ull << (n % 64), __ATOMIC_RELAXED);
+}
+
+/* Recompute the checksum of the data block holding 'p'. */
+static void csum_update(struct wfs_ctx *fs, const void *p)
+{
+    uintptr_t off = (uintptr_t)p - (uintptr_t)fs->mregion;
+    if (!fs->csums || off >= fs->size) return;
+    ssize_t n = wfs_block_num(&fs->layout, off - off % BLOCK_SIZE);
+    if (n < 0) return;
+
+    fs->csums[n] = crc32c(0, (char *)fs->mregion + (off - off % BLOCK_SIZE), BLOCK_SIZE);
+    set_verified(fs, n);
+}
+
+/* Check data block 'blk' against its checksum: -EIO if it does not match.
+ * Metadata (directory and indirect blocks, symlink targets) is checked
+ * unless verification is off, file data only with WFS_VERIFY_ALL. */
+static int csum_verify(struct wfs_ctx *fs, off_t blk, int meta)
+{
+    if (!fs->csums || fs->verify == WFS_VERIFY_NONE || (!meta && fs->verify != WFS_VERIFY_ALL))
+        return 0;
+    ssize_t n = wfs_block_num(&fs->layout, blk);
+    if (n < 0 || block_verified(fs, n)) return 0;
+
+    STAT_INC(fs, csums_verified);
+    if (crc32c(0, (char *)fs->mregion + blk, BLOCK_SIZE) != __atomic_load_n(&fs->csums[n], __ATOMIC_RELAXED) &&
+        !block_verified(fs, n)) {   // unless a write to it just finished
+        STAT_INC(fs, csum_errors);
+        return -EIO;
+    }
+    set_verified(fs, n);
+    return 0;
+}
+
+/* Store 'ptr' in one of the block pointer slots of 'inode'; a slot in the
+ * indirect block changes that block's checksum. */
+static void set_slot(struct wfs_ctx *fs, struct wfs_inode *inode, off_t *slot, off_t ptr)
+{
+    *slot = ptr;
+    if ((uintptr_t)slot - (uintptr_t)inode->blocks >= sizeof(inode->blocks))
+        csum_update(fs, slot);
+}
+
+/* The dentries in block 'i' of directory 'dir', NULL if it has none; a
+ * block that fails its checksum is NULL too, with -EIO in *err. */
+static struct wfs_dentry *dir_block(struct wfs_ctx *fs, struct wfs_inode *dir, int i, int *err)
+{
+    off_t blk = dir->blocks[i];
+    if (blk == 0) return NULL;
+    if (csum_verify(fs, blk, 1) < 0) {
+        *err = -EIO;
+        return NULL;
+    }
+    return (struct wfs_dentry *)((char *)fs->mregion + blk);
+}
+
+/* ---------------------------- Inode sequences ----------------------------- */
+/* The size and block map of a file change under its entry in inode_seq,
+ * which is odd while a writer is at it. A writer takes the count from even
+ * to odd, which also keeps other writers of the file out, and back to even
+ * when done. Readers never store to it: they note an even value, read
+ * without a lock, and start over if the count has moved since, so stat and
+ * read on many cores do not pass a lock's cache line around. A writer ends
+ * on the count it began on, whatever the inode's number says by then: the
+ * inode may have been freed and its slot zeroed meanwhile. */
+static unsigned *inode_seq(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    return &fs->inode_seq[inode->num];
+}
+
+static unsigned *seq_write_begin(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    unsigned *seq = inode_seq(fs, inode);
+    for (;;) {
+        unsigned s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+        if (!(s & 1) && __atomic_compare_exchange_n(seq, &s, s + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return seq;
+        sched_yield();
+    }
+}
+
+static void seq_write_end(unsigned *seq)
+{
+    __atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned seq_read_begin(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    unsigned s;
+    while ((s = __atomic_load_n(inode_seq(fs, inode), __ATOMIC_ACQUIRE)) & 1)
+        sched_yield();
+    return s;
+}
+
+// has a writer got in since seq_read_begin returned 's'?
+static int seq_moved(struct wfs_ctx *fs, struct wfs_inode *inode, unsigned s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(inode_seq(fs, inode), __ATOMIC_RELAXED) != s;
+}
+
+// the same, at the end of a read, which then has to start over
+static int seq_read_retry(struct wfs_ctx *fs, struct wfs_inode *inode, unsigned s)
+{
+    if (!seq_moved(fs, inode, s)) return 0;
+    STAT_INC(fs, seq_retries);
+    return 1;
+}
+
+/* ------------------------------ Color index ------------------------------- */
+/* Which inodes carry each color tag, a bit per inode and color. Each
+ * group's bits are filled in when the group is loaded (group_load()) and
+ * kept current by wfs_set_color() and free_inode(), so listing the files
+ * of one color does not read every inode. Snapshot copies are left out. */
+static void color_mark(struct wfs_ctx *fs, int inum, uint8_t code, int on)
+{
+    if (code == WFS_COLOR_NONE || code >= WFS_COLOR_MAX || !fs->colored[code]) return;
+    uint64_t bit = 1ull << (inum % 64);
+    if (on)
+        __atomic_fetch_or(&fs->colored[code][inum / 64], bit, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and(&fs->colored[code][inum / 64], ~bit, __ATOMIC_RELAXED);
+}
+
+static int color_index(struct wfs_ctx *fs)
+{
+    size_t words = (fs->layout.num_inodes + 63) / 64;
+    for (int c = WFS_COLOR_NONE + 1; c < WFS_COLOR_MAX; c++)
+        if (!(fs->colored[c] = calloc(words, sizeof(uint64_t)))) return -ENOMEM;
+    return 0;
+}
+
+/* ---------------------------- Dentry matching ----------------------------- */
+/* A dentry is 32 bytes, one AVX2 register, so a directory block is
+ * scanned for a name with one compare and movemask per entry instead of a
+ * strcmp call each. The key is the name padded to 32 bytes and a bit per
+ * byte that has to match: the name's and the NUL ending it, so whatever a
+ * longer name left behind that NUL stays out of it. x86-64 without AVX2
+ * compares in 16-byte SSE2 halves; elsewhere, with memcmp. */
+_Static_assert(sizeof(struct wfs_dentry) == 32, "a dentry is one 32-byte vector");
+
+struct dentry_key {
+    char name[sizeof(struct wfs_dentry)];
+    uint32_t bytes;     // bit i: byte i is compared
+    size_t len;
+};
+
+/* The key for 'name'; -1 if no dentry can hold it. */
+static int dentry_key(const char *name, struct dentry_key *key)
+{
+    size_t len = 0;
+    memset(key->name, 0, sizeof(key->name));
+    for (; name[len] && len < MAX_NAME; len++)
+        key->name[len] = name[len];
+    if (len == 0 || len >= MAX_NAME) return -1;
+
+    key->bytes = (1u << (len + 1)) - 1;
+    key->len = len;
+    return 0;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static int dentry_scan_avx2(const struct wfs_dentry *ents, int j, int n, const struct dentry_key *key)
+{
+    __m256i want = _mm256_loadu_si256((const __m256i *)key->name);
+    for (; j < n; j++) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)&ents[j]);
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(d, want));
+        if ((eq & key->bytes) == key->bytes) break;
+    }
+    return j;
+}
+
+static int dentry_scan_sse2(const struct wfs_dentry *ents, int j, int n, const struct dentry_key *key)
+{
+    __m128i lo = _mm_loadu_si128((const __m128i *)key->name);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(key->name + 16));
+    for (; j < n; j++) {
+        const __m128i *d = (const __m128i *)&ents[j];
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(d), lo)) |
+                      (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(d + 1), hi)) << 16;
+        if ((eq & key->bytes) == key->bytes) break;
+    }
+    return j;
+}
+#endif
+
+/* The first of entries j to n - 1 at 'ents' holding the key's name, n if
+ * there is none. */
+static int dentry_scan(const struct wfs_dentry *ents, int j, int n, const struct dentry_key *key)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return dentry_scan_avx2(ents, j, n, key);
+    return dentry_scan_sse2(ents, j, n, key);
+#else
+    for (; j < n; j++)
+        if (memcmp(ents[j].name, key->name, key->len + 1) == 0) break;
+    return j;
+#endif
+}
+
+/* Index of the live entry among the 'n' at 'ents' holding the key's name,
+ * -1 if there is none. */
+static int match_dentry(const struct wfs_dentry *ents, int n, const struct dentry_key *key)
+{
+    for (int j = dentry_scan(ents, 0, n, key); j < n; j = dentry_scan(ents, j + 1, n, key))
+        if (ents[j].num != 0) return j;
+    return -1;
+}
+
+/* Find the dentry called 'name' in 'dir'; NULL if there is none, with
+ * -EIO in *err if a block that might hold it fails its checksum. */
+static struct wfs_dentry *find_dentry(struct wfs_ctx *fs, struct wfs_inode *dir, const char *name, int *err)
+{
+    int num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    struct dentry_key key;
+
+    *err = -ENOENT;
+    if (dentry_key(name, &key) < 0) return NULL;
+    for (int i = 0; i < D_BLOCK; i++) {
+      struct wfs_dentry *entries = dir_block(fs, dir, i, err);
+      if (!entries) continue;
+
+      int j = match_dentry(entries, num_entries, &key);
+      if (j >= 0) {
+        STAT_ADD(fs, dentry_scanned, j + 1);
+        return &entries[j];
+      }
+      STAT_ADD(fs, dentry_scanned, num_entries);
+    }
+    return NULL;
+}
+
+/* ------------------------------ Core helpers ------------------------------ */
+int get_inode_from_path(struct wfs_ctx *fs, const char *path, struct wfs_inode **inode)
+{
+    /* TODO: Resolve absolute paths by splitting on '/' and walking from the root inode.
+     * For each component, scan the current directory's dentries (via data_offset) to find the child inode;
+     * on missing component return -ENOENT, otherwise set *inode to the final inode and return 0. */
+    
+    // Case: path is root
+    if (strcmp(path, "/") == 0) {
+        *inode = retrieve_inode(fs, 0);
+        return (*inode ? 0 : -ENOENT);
+    }
+
+    // Path must start with '/' (root file)
+    if (path[0] != '/')
+        return -ENOENT;
+
+    size_t len = strlen(path);
+    if (len >= PATH_MAX) return -ENAMETOOLONG;
+    char tmp[PATH_MAX];
+    memcpy(tmp, path, len + 1);
+
+    // Start at the root inode
+    struct wfs_inode *cur = retrieve_inode(fs, 0);
+    if (!cur) return -ENOENT;
+
+    char *save;
+    char *token = strtok_r(tmp, "/", &save);
+
+    // store inodes in path to handle ".."; each one below the root took a name and a '/'
+    struct wfs_inode *inode_path[PATH_MAX / 2];
+    int idx = 0;
+    inode_path[idx] = cur;
+    
+
+    while (token) {
+
+        // Current must be directory
+        if (!S_ISDIR(cur->mode))
+            return -ENOTDIR;
+
+        // do nothing if next directory in path is current one
+        if (strcmp(token, ".") == 0) {
+          token = strtok_r(NULL, "/", &save);
+          continue;
+        }
+
+        // move back a directory
+        if (strcmp(token, "..") == 0) {
+
+          if (idx > 0) idx--;
+          cur = inode_path[idx];
+
+          token = strtok_r(NULL, "/", &save);
+          continue;
+        }
+
+        // the name may be in a block that failed its checksum
+        int err;
+        struct wfs_dentry *d = find_dentry(fs, cur, token, &err);
+        if (!d)
+            return err;
+
+        cur = retrieve_inode(fs, d->num);
+        if (!cur)
+            return -ENOENT;
+
+        idx++;
+        inode_path[idx] = cur;
+        token = strtok_r(NULL, "/", &save);
+    }
+
+    *inode = cur;
+    return 0;
+
+}
+
+void free_bitmap(uint32_t position, uint32_t* bitmap) {
+    /*TODO: Clear the bit at 'position' in the bitmap */
+    
+    uint32_t position_word = position / 32;
+    uint32_t position_bit = position % 32;
+
+    // change bit in the word to 0
+    bitmap[position_word] = bitmap[position_word] & ~(1u << position_bit);
+}
+
+/* ------------------------------ Block groups ------------------------------ */
+/* Fill in where the groups are. Images without WFS_MAGIC (or from the flat
+ * WFS1 format) get one synthesized group covering the superblock's bitmaps,
+ * so the rest of the code never has to tell the two apart. */
+int wfs_layout_init(struct wfs_layout *l, void *image, size_t size)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)image;
+    memset(l, 0, sizeof(*l));
+
+    l->num_inodes = sb->num_inodes;
+    l->num_data_blocks = sb->num_data_blocks;
+    if (l->num_inodes == 0 || l->num_data_blocks == 0)
+        return -EINVAL;
+
+    if (sb->magic != WFS_MAGIC) {
+        l->num_groups = 1;
+        l->inodes_per_group = l->num_inodes;
+        l->blocks_per_group = l->num_data_blocks;
+        l->first_group = sb->i_bitmap_ptr;
+        l->group_stride = size;
+        l->flat.i_bitmap_ptr = sb->i_bitmap_ptr;
+        l->flat.d_bitmap_ptr = sb->d_bitmap_ptr;
+        l->flat.i_blocks_ptr = sb->i_blocks_ptr;
+        l->flat.d_blocks_ptr = sb->d_blocks_ptr;
+        l->groups = &l->flat;
+    } else {
+        l->num_groups = sb->num_groups;
+        l->inodes_per_group = sb->inodes_per_group;
+        l->blocks_per_group = sb->blocks_per_group;
+        l->first_group = sb->first_group;
+        l->group_stride = sb->group_stride;
+        l->groups = sb->groups;
+
+        // group bitmaps are read a word at a time
+        if (l->num_groups == 0 || l->group_stride <= 0 ||
+            l->inodes_per_group == 0 || l->inodes_per_group % 32 != 0 ||
+            l->blocks_per_group == 0 || l->blocks_per_group % 32 != 0 ||
+            sizeof(*sb) + (size_t)l->num_groups * sizeof(struct wfs_group_desc) > size)
+            return -EINVAL;
+
+        // every group but the last is full
+        uint32_t last = l->num_groups - 1;
+        if (l->num_inodes <= (size_t)last * l->inodes_per_group ||
+            l->num_inodes > (size_t)l->num_groups * l->inodes_per_group ||
+            l->num_data_blocks <= (size_t)last * l->blocks_per_group ||
+            l->num_data_blocks > (size_t)l->num_groups * l->blocks_per_group)
+            return -EINVAL;
+    }
+
+    for (uint32_t g = 0; g < l->num_groups; g++) {
+        struct wfs_group_desc *gd = &l->groups[g];
+        if (gd->i_bitmap_ptr <= 0 || gd->d_bitmap_ptr <= 0 ||
+            gd->i_blocks_ptr <= 0 || gd->d_blocks_ptr <= 0 ||
+            gd->i_bitmap_ptr % sizeof(uint32_t) || gd->d_bitmap_ptr % sizeof(uint32_t) ||
+            gd->i_blocks_ptr + (off_t)wfs_group_inodes(l, g) * BLOCK_SIZE > (off_t)size ||
+            gd->d_blocks_ptr + (off_t)wfs_group_blocks(l, g) * BLOCK_SIZE > (off_t)size)
+            return -EINVAL;
+    }
+
+    if (sb->magic == WFS_MAGIC && (sb->state & WFS_STATE_CSUM)) {
+        l->csum_ptr = wfs_csum_off(l);
+        if (l->csum_ptr + (off_t)(l->num_data_blocks * sizeof(uint32_t)) > (off_t)size)
+            return -EINVAL;
+    }
+    return 0;
+}
+
+static uint32_t *group_imap(struct wfs_ctx *fs, uint32_t g)
+{
+    return (uint32_t *)((char *)fs->mregion + fs->layout.groups[g].i_bitmap_ptr);
+}
+
+static uint32_t *group_dmap(struct wfs_ctx *fs, uint32_t g)
+{
+    return (uint32_t *)((char *)fs->mregion + fs->layout.groups[g].d_bitmap_ptr);
+}
+
+static uint32_t count_free(const uint32_t *bitmap, size_t nbits)
+{
+    uint32_t used = 0;
+    for (size_t i = 0; i < nbits / 32; i++)
+        used += __builtin_popcount(bitmap[i]);
+    if (nbits % 32)
+        used += __builtin_popcount(bitmap[nbits / 32] & ((1u << (nbits % 32)) - 1));
+    return nbits - used;
+}
+
+/* Nothing is scanned at open, however large the image. The free counts in
+ * the group descriptors are exact when the superblock has
+ * WFS_STATE_COUNTED, which a clean close sets; otherwise a group's are
+ * recounted from its bitmaps the first time an allocation looks at it.
+ * The color index is filled in the same way, a group at a time. Loader
+ * threads (wfs_start_loaders()) go through every group meanwhile, so the
+ * first operations find most of it done and a mount never waits for all
+ * of it. Neither scan holds the group's lock. */
+#define GROUP_COUNTED 0x1   // free_inodes and free_blocks are exact
+#define GROUP_INDEXED 0x2   // the color index has the group's inodes
+#define COUNT_TRIES   3     // unlocked counts spoiled by a bitmap change before counting locked
+
+/* Count group 'g' unlocked and publish the counts under its lock, unless
+ * a bitmap changed meanwhile (group_gen); the last try holds the lock. */
+static void group_count(struct wfs_ctx *fs, uint32_t g)
+{
+    struct wfs_layout *l = &fs->layout;
+    pthread_mutex_t *lock = &fs->group_locks[g];
+
+    pthread_mutex_lock(lock);
+    for (int tries = 1; !(__atomic_load_n(&fs->group_state[g], __ATOMIC_RELAXED) & GROUP_COUNTED); tries++) {
+        unsigned gen = fs->group_gen[g];
+        int unlocked = tries < COUNT_TRIES;
+        if (unlocked) pthread_mutex_unlock(lock);
+        uint32_t inodes = count_free(group_imap(fs, g), wfs_group_inodes(l, g));
+        uint32_t blocks = count_free(group_dmap(fs, g), wfs_group_blocks(l, g));
+        if (unlocked) pthread_mutex_lock(lock);
+        if (fs->group_gen[g] != gen) continue;
+
+        l->groups[g].free_inodes = inodes;
+        l->groups[g].free_blocks = blocks;
+        __atomic_fetch_or(&fs->group_state[g], GROUP_COUNTED, __ATOMIC_RELEASE);
+        STAT_INC(fs, groups_counted);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+// a color changed meanwhile may leave a stale bit; wfs_iterate_color() skips those
+static void group_index(struct wfs_ctx *fs, uint32_t g)
+{
+    struct wfs_layout *l = &fs->layout;
+    uint32_t *map = group_imap(fs, g);
+    size_t first = (size_t)g * l->inodes_per_group;
+    for (size_t k = 0; k < wfs_group_inodes(l, g); k++) {
+        if (!(map[k / 32] & (1u << (k % 32)))) continue;
+        struct wfs_inode *inode = (struct wfs_inode *)((char *)fs->mregion + wfs_inode_off(l, first + k));
+        if (!(inode->flags & WFS_INODE_SNAPSHOT))
+            color_mark(fs, first + k, inode->color, 1);
+    }
+    __atomic_fetch_or(&fs->group_state[g], GROUP_INDEXED, __ATOMIC_RELEASE);
+}
+
+static void group_load(struct wfs_ctx *fs, uint32_t g, uint8_t want)
+{
+    uint8_t have = __atomic_load_n(&fs->group_state[g], __ATOMIC_ACQUIRE);
+    if ((want & GROUP_COUNTED) && !(have & GROUP_COUNTED)) group_count(fs, g);
+    if ((want & GROUP_INDEXED) && !(have & GROUP_INDEXED)) group_index(fs, g);
+}
+
+static int groups_counted(struct wfs_ctx *fs)
+{
+    for (uint32_t g = 0; g < fs->layout.num_groups; g++)
+        if (!(__atomic_load_n(&fs->group_state[g], __ATOMIC_ACQUIRE) & GROUP_COUNTED)) return 0;
+    return 1;
+}
+
+static void *group_loader(void *arg)
+{
+    struct wfs_ctx *fs = arg;
+    for (;;) {
+        pthread_rwlock_rdlock(&fs->grow_lock);
+        uint32_t g = __atomic_fetch_add(&fs->load_next, 1, __ATOMIC_RELAXED);
+        int done = g >= fs->layout.num_groups || __atomic_load_n(&fs->load_stop, __ATOMIC_RELAXED);
+        if (!done) group_load(fs, g, GROUP_COUNTED | GROUP_INDEXED);
+        pthread_rwlock_unlock(&fs->grow_lock);
+        if (done) return NULL;
+    }
+}
+
+// close stops only the loaders that were started
+static void stop_loaders(struct wfs_ctx *fs)
+{
+    __atomic_store_n(&fs->load_stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < fs->n_loaders; i++)
+        pthread_join(fs->loaders[i], NULL);
+    fs->n_loaders = 0;
+}
+
+struct wfs_inode *retrieve_inode(struct wfs_ctx *fs, int inum) {
+    /* TODO:
+     * Use superblock fields (i_blocks_ptr, BLOCK_SIZE stride) to compute a pointer to inode 'inum
+     * Also validate 'inum' via the inode bitmap before returning. */
+
+    struct wfs_layout *l = &fs->layout;
+
+    // make sure inum is in range
+    if (inum < 0 || (size_t)inum >= l->num_inodes) return NULL;
+
+    // get the group, word and bit that inode corresponds to
+    uint32_t *inode_bitmap = group_imap(fs, inum / l->inodes_per_group);
+    uint32_t idx = (uint32_t)(inum % l->inodes_per_group);
+    uint32_t inode_word = idx / 32;
+    uint32_t inode_bit = idx % 32;
+
+    // if the bit isn't set, the inode is not in use
+    if (!((inode_bitmap[inode_word] >> inode_bit) & 1u))
+        return NULL;
+
+    // use offset of inode to get inode and return
+    off_t inode_off = wfs_inode_off(l, inum);
+    struct wfs_inode *inode = (struct wfs_inode *)((char *)fs->mregion + inode_off);
+
+
+    return inode;
+}
+
+/* Timestamps. Each public entry point reads the coarse clock once with
+ * op_clock() and everything the operation stamps gets that time; helpers
+ * used on their own (fsck) read it the first time they need it. */
+#define T_ATIME 1
+#define T_CTIME 2
+#define T_MTIME 4
+#define T_ALL   (T_ATIME | T_CTIME | T_MTIME)
+#define LAZY_SLOTS    4096             // power of two
+#define RELATIME_SECS (24 * 60 * 60)
+
+static __thread struct timespec op_time;
+
+static void op_clock(void)
+{
+    clock_gettime(CLOCK_REALTIME_COARSE, &op_time);
+}
+
+static struct timespec now(void)
+{
+    if (op_time.tv_sec == 0) op_clock();
+    return op_time;
+}
+
+// only store what changed, so a repeat within one clock tick stays clean
+static void set_ts(time_t *sec, uint32_t *nsec, struct timespec t)
+{
+    if (*sec != t.tv_sec) *sec = t.tv_sec;
+    if (*nsec != (uint32_t)t.tv_nsec) *nsec = t.tv_nsec;
+}
+
+static void stamp(struct wfs_inode *inode, int which, struct timespec t)
+{
+    if (which & T_ATIME) set_ts(&inode->atim, &inode->atim_ns, t);
+    if (which & T_CTIME) set_ts(&inode->ctim, &inode->ctim_ns, t);
+    if (which & T_MTIME) set_ts(&inode->mtim, &inode->mtim_ns, t);
+}
+
+static void lazy_write(struct wfs_inode *inode, const struct wfs_lazy_times *e)
+{
+    if (e->which & T_ATIME) stamp(inode, T_ATIME, e->atim);
+    if (e->which & T_CTIME) stamp(inode, T_CTIME, e->ctim);
+    if (e->which & T_MTIME) stamp(inode, T_MTIME, e->mtim);
+}
+
+static size_t lazy_home(uint32_t key)
+{
+    return (key * 2654435761u) & (LAZY_SLOTS - 1);
+}
+
+// the slot holding 'inum', or the free one it would go in
+static size_t lazy_slot(struct wfs_ctx *fs, int inum)
+{
+    uint32_t key = (uint32_t)inum + 1;
+    size_t i = lazy_home(key);
+    while (fs->lazy[i].key && fs->lazy[i].key != key)
+        i = (i + 1) & (LAZY_SLOTS - 1);
+    return i;
+}
+
+// empty slot 'i', pulling back later entries so no probe chain breaks
+static void lazy_delete(struct wfs_ctx *fs, size_t i)
+{
+    size_t mask = LAZY_SLOTS - 1;
+    for (size_t j = (i + 1) & mask; fs->lazy[j].key; j = (j + 1) & mask) {
+        size_t home = lazy_home(fs->lazy[j].key);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            fs->lazy[i] = fs->lazy[j];
+            i = j;
+        }
+    }
+    fs->lazy[i].key = 0;
+    fs->lazy_used--;
+}
+
+// write every pending update to its inode; caller holds lazy_lock
+static void lazy_flush(struct wfs_ctx *fs)
+{
+    if (fs->lazy_used == 0) return;
+    for (size_t i = 0; i < LAZY_SLOTS; i++) {
+        if (!fs->lazy[i].key) continue;
+        struct wfs_inode *inode = retrieve_inode(fs, fs->lazy[i].key - 1);
+        if (inode) lazy_write(inode, &fs->lazy[i]);
+    }
+    memset(fs->lazy, 0, LAZY_SLOTS * sizeof(*fs->lazy));
+    fs->lazy_used = 0;
+}
+
+/* Drop the pending update for 'inode', writing it to the inode first
+ * unless the inode is about to be freed. */
+static void lazy_take(struct wfs_ctx *fs, struct wfs_inode *inode, int write)
+{
+    if (!fs->lazy) return;
+
+    pthread_mutex_lock(&fs->lazy_lock);
+    size_t i = lazy_slot(fs, inode->num);
+    if (fs->lazy[i].key) {
+        if (write) lazy_write(inode, &fs->lazy[i]);
+        lazy_delete(fs, i);
+    }
+    pthread_mutex_unlock(&fs->lazy_lock);
+}
+
+// the inode's times as stat sees them, pending updates included
+static struct wfs_lazy_times current_times(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    struct wfs_lazy_times t = {
+        .atim = { inode->atim, inode->atim_ns },
+        .ctim = { inode->ctim, inode->ctim_ns },
+        .mtim = { inode->mtim, inode->mtim_ns },
+    };
+    if (!fs->lazy) return t;
+
+    pthread_mutex_lock(&fs->lazy_lock);
+    struct wfs_lazy_times *e = &fs->lazy[lazy_slot(fs, inode->num)];
+    if (e->key) {
+        if (e->which & T_ATIME) t.atim = e->atim;
+        if (e->which & T_CTIME) t.ctim = e->ctim;
+        if (e->which & T_MTIME) t.mtim = e->mtim;
+    }
+    pthread_mutex_unlock(&fs->lazy_lock);
+    return t;
+}
+
+/* Stamp an inode the caller is changing anyway. */
+static void touch(struct wfs_ctx *fs, struct wfs_inode *inode, int which)
+{
+    lazy_take(fs, inode, 1);
+    stamp(inode, which, now());
+}
+
+/* Stamp an inode when nothing else about it changes. Under lazytime the
+ * update waits in memory; a full table is written back as a whole. */
+static void touch_lazy(struct wfs_ctx *fs, struct wfs_inode *inode, int which)
+{
+    struct timespec t = now();
+    if (!fs->lazy) {
+        stamp(inode, which, t);
+        return;
+    }
+
+    pthread_mutex_lock(&fs->lazy_lock);
+    if (fs->lazy_used >= LAZY_SLOTS * 3 / 4)
+        lazy_flush(fs);
+
+    struct wfs_lazy_times *e = &fs->lazy[lazy_slot(fs, inode->num)];
+    if (!e->key) {
+        e->key = (uint32_t)inode->num + 1;
+        e->which = 0;
+        fs->lazy_used++;
+    }
+    e->which |= which;
+    if (which & T_ATIME) e->atim = t;
+    if (which & T_CTIME) e->ctim = t;
+    if (which & T_MTIME) e->mtim = t;
+    pthread_mutex_unlock(&fs->lazy_lock);
+}
+
+static int ts_after(struct timespec a, struct timespec b)
+{
+    return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+/* atime for a read or readdir, as far as the atime mode asks for one:
+ * relatime skips it while atime is newer than both mtime and ctime and
+ * less than a day old. */
+static void touch_atime(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    if (fs->atime_mode == WFS_NOATIME || (inode->flags & WFS_INODE_SNAPSHOT)) return;
+
+    if (fs->atime_mode == WFS_RELATIME) {
+        struct wfs_lazy_times cur = current_times(fs, inode);
+        if (ts_after(cur.atim, cur.mtim) && ts_after(cur.atim, cur.ctim) &&
+            now().tv_sec - cur.atim.tv_sec < RELATIME_SECS)
+            return;
+    }
+    touch_lazy(fs, inode, T_ATIME);
+}
+
+/* Take the first free bit at or after 'goal', wrapping around to the start
+ * of the bitmap, so consecutive allocations for one file land next to each
+ * other. */
+ssize_t allocate_block(struct wfs_ctx *fs, uint32_t* bitmap, size_t nbits, size_t goal) {
+    size_t words = (nbits + 31) / 32;
+    if (goal >= nbits) goal = 0;
+
+    size_t i = goal / 32;
+    uint32_t mask = ~0u << (goal % 32);   // bits before the goal wait for the wrap
+    for (size_t n = 0; n <= words; n++) {
+        STAT_INC(fs, bitmap_words);
+        uint32_t avail = ~bitmap[i] & mask;
+        if (avail) {
+            size_t k = __builtin_ctz(avail);
+            if (32 * i + k < nbits) { // it is free
+                // allocate
+                bitmap[i] |= 1u << k;
+                return 32 * i + k;
+            }
+        }
+        mask = ~0u;
+        if (++i == words) i = 0;
+    }
+    return -1; // no free blocks found
+}
+
+/* Pick the group a new inode starts looking in. Files and nested
+ * directories stay with their parent; each directory made directly under
+ * the root starts a new subtree in the group with the most free inodes.
+ * A group not counted yet goes by its descriptor's last count. */
+static uint32_t inode_group(struct wfs_ctx *fs, struct wfs_inode *parent, int is_dir)
+{
+    struct wfs_layout *l = &fs->layout;
+    if (!parent) return 0;
+
+    uint32_t g = parent->num / l->inodes_per_group;
+    if (is_dir && parent->num == 0) {
+        uint32_t best = 0;
+        for (uint32_t i = 0; i < l->num_groups; i++) {
+            uint32_t avail = __atomic_load_n(&l->groups[i].free_inodes, __ATOMIC_RELAXED);
+            if (avail > best) {
+                best = avail;
+                g = i;
+            }
+        }
+    }
+    return g;
+}
+
+struct wfs_inode *allocate_inode(struct wfs_ctx *fs, struct wfs_inode *parent, int is_dir) {
+    /* TODO: Allocate an inode slot by marking the inode bitmap and return a
+     * pointer to the inode block within the mapped image (or NULL on failure). */
+
+    struct wfs_layout *l = &fs->layout;
+    uint32_t start = inode_group(fs, parent, is_dir);
+    ssize_t free_idx = -1;
+
+    // the chosen group first, then the ones after it
+    for (uint32_t n = 0; n < l->num_groups && free_idx < 0; n++) {
+        uint32_t g = (start + n) % l->num_groups;
+        struct wfs_group_desc *gd = &l->groups[g];
+        group_load(fs, g, GROUP_COUNTED);
+        if (__atomic_load_n(&gd->free_inodes, __ATOMIC_RELAXED) == 0) continue;
+
+        pthread_mutex_lock(&fs->group_locks[g]);
+        ssize_t idx = allocate_block(fs, group_imap(fs, g), wfs_group_inodes(l, g), 0);
+        if (idx >= 0) {
+            gd->free_inodes--;
+            fs->group_gen[g]++;
+            free_idx = (ssize_t)g * l->inodes_per_group + idx;
+        }
+        pthread_mutex_unlock(&fs->group_locks[g]);
+    }
+
+    if (free_idx < 0) {
+      STAT_INC(fs, enospc);
+      return NULL;
+    }
+    STAT_INC(fs, inodes_allocated);
+
+    // get disk offset to new inode
+    off_t inode_off = wfs_inode_off(l, free_idx);
+    memset((char *)fs->mregion + inode_off, 0, BLOCK_SIZE);
+
+    // set inode num to be index in bitmap
+    struct wfs_inode *new_inode = (struct wfs_inode *)((char *)fs->mregion + inode_off);
+    new_inode->num = (int)free_idx;
+    stamp(new_inode, T_ALL, now());
+
+    return new_inode;
+}
+
+/* Where the next block of 'inode' should go: right behind 'prev' (the block
+ * before it in the file) when there is one, else at the start of the data
+ * area of the inode's own group. */
+static off_t block_goal(struct wfs_ctx *fs, struct wfs_inode *inode, off_t prev)
+{
+    struct wfs_layout *l = &fs->layout;
+    if (prev && wfs_block_num(l, prev + BLOCK_SIZE) >= 0)
+        return prev + BLOCK_SIZE;
+    return l->groups[inode->num / l->inodes_per_group].d_blocks_ptr;
+}
+
+/* Take a free data block near 'goal' and return its byte offset. Only
+ * zeroed if asked: file data is written over right away. */
+static off_t alloc_block(struct wfs_ctx *fs, off_t goal, int zero)
+{
+    struct wfs_layout *l = &fs->layout;
+    ssize_t b = goal ? wfs_block_num(l, goal) : -1;
+    uint32_t start = b < 0 ? 0 : b / l->blocks_per_group;
+    ssize_t free_idx = -1;
+
+    // search the goal's group from the goal on, then the other groups whole
+    for (uint32_t n = 0; n < l->num_groups && free_idx < 0; n++) {
+        uint32_t g = (start + n) % l->num_groups;
+        struct wfs_group_desc *gd = &l->groups[g];
+        group_load(fs, g, GROUP_COUNTED);
+        if (__atomic_load_n(&gd->free_blocks, __ATOMIC_RELAXED) == 0) continue;
+
+        size_t from = (n == 0 && b >= 0) ? b % l->blocks_per_group : 0;
+        pthread_mutex_lock(&fs->group_locks[g]);
+        ssize_t idx = allocate_block(fs, group_dmap(fs, g), wfs_group_blocks(l, g), from);
+        if (idx >= 0) {
+            gd->free_blocks--;
+            fs->group_gen[g]++;
+            free_idx = (ssize_t)g * l->blocks_per_group + idx;
+        }
+        pthread_mutex_unlock(&fs->group_locks[g]);
+    }
+
+    if (free_idx < 0) {
+      STAT_INC(fs, enospc);
+      return -ENOSPC;
+    }
+    STAT_INC(fs, blocks_allocated);
+
+    // get disk offset to new data block
+    off_t data_off = wfs_block_off(l, free_idx);
+    if (zero) {
+        memset((char *)fs->mregion + data_off, 0, BLOCK_SIZE);
+        csum_update(fs, (char *)fs->mregion + data_off);
+    }
+    
+    return data_off;
+}
+
+/* Take up to 'want' unzeroed data blocks in a row, the first near 'goal',
+ * in *first. The rest come from the same group under one lock, so a large
+ * write does not pay a lock and a bitmap search per block. Returns how
+ * many were taken, or -ENOSPC. */
+static int alloc_run(struct wfs_ctx *fs, off_t goal, int want, off_t *first)
+{
+    struct wfs_layout *l = &fs->layout;
+    off_t blk = alloc_block(fs, goal, 0);
+    if (blk < 0) return blk;
+    *first = blk;
+
+    size_t b = wfs_block_num(l, blk);
+    uint32_t g = b / l->blocks_per_group;
+    size_t bit = b % l->blocks_per_group, end = wfs_group_blocks(l, g);
+    uint32_t *map = group_dmap(fs, g);
+
+    int n = 1;
+    pthread_mutex_lock(&fs->group_locks[g]);
+    for (; n < want && bit + n < end; n++) {
+        size_t k = bit + n;
+        if (map[k / 32] & (1u << (k % 32))) break;
+        map[k / 32] |= 1u << (k % 32);
+    }
+    l->groups[g].free_blocks -= n - 1;
+    fs->group_gen[g]++;
+    pthread_mutex_unlock(&fs->group_locks[g]);
+    STAT_ADD(fs, blocks_allocated, n - 1);
+    return n;
+}
+
+off_t allocate_data_block(struct wfs_ctx *fs, off_t goal) {
+    /* TODO: Use the data bitmap to allocate a free data block and return its
+     * on-disk byte OFFSET. Handle error appropriately. */
+    return alloc_block(fs, goal, 1);
+}
+
+static void xattr_put(struct wfs_ctx *fs, off_t blk);
+
+void free_inode(struct wfs_ctx *fs, struct wfs_inode *inode) {
+    /* TODO: Clear the inode bitmap entry and zero the inode block. */
+    struct wfs_layout *l = &fs->layout;
+
+    int inode_idx = inode->num;
+    if (inode_idx < 0 || (size_t)inode_idx >= l->num_inodes) {
+      STAT_INC(fs, range_errors);
+      return;
+    }
+    STAT_INC(fs, inodes_freed);
+
+    // zero the inode block, and forget any timestamps waiting for it
+    lazy_take(fs, inode, 0);
+    color_mark(fs, inode_idx, inode->color, 0);
+    if (inode->xattr_blk) {
+        pthread_mutex_lock(&fs->xattr_lock);
+        xattr_put(fs, inode->xattr_blk);
+        pthread_mutex_unlock(&fs->xattr_lock);
+    }
+    off_t inode_off = wfs_inode_off(l, inode_idx);
+    memset((char *)fs->mregion + inode_off, 0, BLOCK_SIZE);
+
+    // zero bitmap entry
+    uint32_t g = inode_idx / l->inodes_per_group;
+    pthread_mutex_lock(&fs->group_locks[g]);
+    free_bitmap((uint32_t)(inode_idx % l->inodes_per_group), group_imap(fs, g));
+    l->groups[g].free_inodes++;
+    fs->group_gen[g]++;
+    pthread_mutex_unlock(&fs->group_locks[g]);
+}
+
+static int by_offset(const void *a, const void *b)
+{
+    off_t x = *(const off_t *)a, y = *(const off_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Give the host back the image pages in data blocks [from, to) of group
+ * 'g' that hold nothing but free blocks, coalescing neighbouring pages
+ * into one hole. Pages reaching outside the group's data blocks are left
+ * alone. Called with the group's lock held, so no block of a page can be
+ * allocated between checking it and punching it. Returns the bytes
+ * punched, or -errno if the image file can't have holes. */
+static off_t punch_free(struct wfs_ctx *fs, uint32_t g, size_t from, size_t to)
+{
+    struct wfs_layout *l = &fs->layout;
+    const uint32_t *map = group_dmap(fs, g);
+    off_t base = l->groups[g].d_blocks_ptr, end = base + (off_t)wfs_group_blocks(l, g) * BLOCK_SIZE;
+    off_t lo = (base + (off_t)from * BLOCK_SIZE) / WFS_PAGE_SIZE * WFS_PAGE_SIZE;
+    off_t hi = (base + (off_t)to * BLOCK_SIZE + WFS_PAGE_SIZE - 1) / WFS_PAGE_SIZE * WFS_PAGE_SIZE;
+    if (lo < base) lo += WFS_PAGE_SIZE;
+    if (hi > end) hi -= WFS_PAGE_SIZE;
+
+    off_t punched = 0, hole = -1;
+    for (off_t p = lo; p <= hi; p += WFS_PAGE_SIZE) {
+        int empty = p < hi;
+        for (size_t b = (p - base) / BLOCK_SIZE; empty && b < (size_t)(p + WFS_PAGE_SIZE - base) / BLOCK_SIZE; b++)
+            empty = !((map[b / 32] >> (b % 32)) & 1);
+        if (empty && hole < 0) hole = p;
+        if (empty || hole < 0) continue;
+
+        // the same as fallocate(2) punching a hole, through the mapping
+        if (madvise((char *)fs->mregion + hole, p - hole, MADV_REMOVE) < 0)
+            return punched ? punched : -errno;
+        punched += p - hole;
+        hole = -1;
+    }
+    STAT_ADD(fs, blocks_punched, punched / BLOCK_SIZE);
+    return punched;
+}
+
+/* Punch out what a batch of freed blocks, sorted, leaves free: each run of
+ * them with whatever free blocks share its first and last pages. */
+static void discard_blocks(struct wfs_ctx *fs, const off_t *blks, int n)
+{
+    struct wfs_layout *l = &fs->layout;
+    for (int i = 0; i < n;) {
+        ssize_t b = wfs_block_num(l, blks[i]);
+        int j = i + 1;
+        while (j < n && blks[j] == blks[j - 1] + BLOCK_SIZE && wfs_block_num(l, blks[j]) == b + (j - i))
+            j++;
+        if (b >= 0) {
+            uint32_t g = b / l->blocks_per_group;
+            size_t first = b % l->blocks_per_group;
+            pthread_mutex_lock(&fs->group_locks[g]);
+            punch_free(fs, g, first, first + (j - i));
+            pthread_mutex_unlock(&fs->group_locks[g]);
+        }
+        i = j;
+    }
+}
+
+/* Free a batch of data blocks. Sorted, blocks that share a bitmap word are
+ * cleared with one update and each group is locked once per run. Freed
+ * blocks are only zeroed for secure delete. Metadata blocks are zeroed when
+ * allocated again, but file blocks are handed out as they are and marked
+ * BLK_UNWRITTEN: they read as holes, and block_for_write() zeroes whatever
+ * part the first write does not cover, so stale bytes never show. With
+ * discard on, the pages they leave empty are punched out of the image file
+ * afterwards. Sorts 'blks' in place. */
+void free_blocks(struct wfs_ctx *fs, off_t *blks, int n)
+{
+    struct wfs_layout *l = &fs->layout;
+    qsort(blks, n, sizeof(off_t), by_offset);
+
+    int64_t locked = -1;
+    uint32_t *map = NULL, mask = 0, freed = 0;
+    size_t word = 0;
+    for (int i = 0; i <= n; i++) {
+        ssize_t b = -1;
+        if (i < n && (b = wfs_block_num(l, blks[i])) < 0) {
+            STAT_INC(fs, range_errors);
+            continue;
+        }
+        uint32_t g = b < 0 ? 0 : b / l->blocks_per_group;
+        size_t bit = b < 0 ? 0 : b % l->blocks_per_group;
+
+        // flush the word when the next block lands in another one
+        if (mask && (b < 0 || g != locked || bit / 32 != word)) {
+            STAT_INC(fs, bitmap_words);
+            freed += __builtin_popcount(map[word] & mask);
+            map[word] &= ~mask;
+            mask = 0;
+        }
+        if (locked >= 0 && (b < 0 || g != locked)) {
+            l->groups[locked].free_blocks += freed;
+            fs->group_gen[locked]++;
+            STAT_ADD(fs, blocks_freed, freed);
+            pthread_mutex_unlock(&fs->group_locks[locked]);
+            locked = -1;
+            freed = 0;
+        }
+        if (b < 0) continue;
+
+        if (fs->secure_delete)
+            memset((char *)fs->mregion + blks[i], 0, BLOCK_SIZE);
+        if (locked < 0) {
+            pthread_mutex_lock(&fs->group_locks[g]);
+            locked = g;
+            map = group_dmap(fs, g);
+        }
+        word = bit / 32;
+        mask |= 1u << (bit % 32);
+    }
+    if (fs->discard) discard_blocks(fs, blks, n);
+}
+
+void free_block(struct wfs_ctx *fs, off_t blk_offset) {
+    /* TODO: Mark the data block free in the data bitmap and zero it. */
+    free_blocks(fs, &blk_offset, 1);
+}
+
+/* Where the pointer to file block 'block_idx' lives: in blocks[] or in the
+ * indirect block, which is allocated on the way if 'alloc'. Also returns
+ * the block before it in the file (or the indirect block), as an
+ * allocation goal. NULL past the maximum file size, with no indirect, or
+ * with one that points outside the data area; when allocating, that means
+ * -ENOSPC. */
+static off_t *block_slot(struct wfs_ctx *fs, struct wfs_inode *inode, off_t block_idx, int alloc, off_t *prev)
+{
+    int direct_blocks = D_BLOCK;
+    int blocks_per_indirect = BLOCK_SIZE / sizeof(off_t);
+
+    if (block_idx < direct_blocks) {
+        // Direct block
+        *prev = block_idx > 0 ? blk_addr(inode->blocks[block_idx - 1]) : 0;
+        return &inode->blocks[block_idx];
+    }
+
+    // Single indirect
+
+    // check indirect index
+    int indirect_idx = block_idx - direct_blocks;
+    if (indirect_idx < 0 || indirect_idx >= blocks_per_indirect) {
+      STAT_INC(fs, range_errors);
+      return NULL;
+    }
+
+    off_t ind = inode->blocks[direct_blocks];
+    if (ind == 0) {
+        if (!alloc) return NULL;
+        ind = allocate_data_block(fs, block_goal(fs, inode, blk_addr(inode->blocks[direct_blocks - 1])));
+        if (ind < 0) return NULL;
+        inode->blocks[direct_blocks] = ind;
+    }
+    // a reader without the sequence count can catch the indirect block
+    // freed and written over with file data: follow no pointer off the image
+    if (wfs_block_num(&fs->layout, ind) < 0) return NULL;
+
+    off_t *indirect = (off_t *)((char *)fs->mregion + ind);
+    *prev = indirect_idx > 0 ? blk_addr(indirect[indirect_idx - 1]) : ind;
+    return &indirect[indirect_idx];
+}
+
+/* Decompressed clusters. Per thread, so a pointer data_offset() hands out
+ * stays good until the same thread has read a few more clusters. Freeing
+ * a compressed cluster bumps cluster_gen, which empties every cache. */
+#define CACHE_CLUSTERS 8
+
+static unsigned cluster_gen;
+static __thread struct cached_cluster {
+    struct wfs_ctx *fs;
+    off_t first;        // the cluster's first compressed block
+    unsigned gen;
+    char data[WFS_CLUSTER_SIZE];
+} cluster_cache[CACHE_CLUSTERS];
+static __thread unsigned cluster_next;
+
+static void cluster_forget(void)
+{
+    __atomic_add_fetch(&cluster_gen, 1, __ATOMIC_RELEASE);
+}
+
+static struct cached_cluster *cache_lookup(struct wfs_ctx *fs, off_t first)
+{
+    unsigned gen = __atomic_load_n(&cluster_gen, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < CACHE_CLUSTERS; i++) {
+        struct cached_cluster *e = &cluster_cache[i];
+        if (e->fs == fs && e->first == first && e->gen == gen) return e;
+    }
+    return NULL;
+}
+
+static struct cached_cluster *cache_slot(struct wfs_ctx *fs, off_t first)
+{
+    struct cached_cluster *e = &cluster_cache[cluster_next++ % CACHE_CLUSTERS];
+    e->fs = fs;
+    e->first = first;
+    e->gen = __atomic_load_n(&cluster_gen, __ATOMIC_ACQUIRE);
+    return e;
+}
+
+/* The slots of cluster 'c'; NULL where the file has no slot yet. */
+static void cluster_slots(struct wfs_ctx *fs, struct wfs_inode *inode, off_t c, off_t *slots[WFS_CLUSTER_BLOCKS], off_t *prev)
+{
+    off_t p;
+    for (int j = 0; j < WFS_CLUSTER_BLOCKS; j++)
+        slots[j] = block_slot(fs, inode, c * WFS_CLUSTER_BLOCKS + j, 0, j ? &p : prev);
+}
+
+/* The plain contents of compressed cluster 'c', or NULL if it is corrupt. */
+static char *cluster_data(struct wfs_ctx *fs, struct wfs_inode *inode, off_t c)
+{
+    off_t *slots[WFS_CLUSTER_BLOCKS], prev;
+    cluster_slots(fs, inode, c, slots, &prev);
+
+    off_t first = slots[0] ? blk_addr(*slots[0]) : 0;
+    struct cached_cluster *e = cache_lookup(fs, first);
+    if (e) return e->data;
+    STAT_INC(fs, clusters_decoded);
+
+    // the compressed blocks need not be next to each other
+    char packed[WFS_CLUSTER_SIZE];
+    int k = 0;
+    for (int j = 0; j < WFS_CLUSTER_BLOCKS && slots[j] && blk_addr(*slots[j]); j++, k++) {
+        off_t blk = blk_addr(*slots[j]);
+        if (wfs_block_num(&fs->layout, blk) < 0 || csum_verify(fs, blk, 0) < 0) return NULL;
+        memcpy(packed + k * BLOCK_SIZE, (char *)fs->mregion + blk, BLOCK_SIZE);
+    }
+
+    struct wfs_cluster_hdr *h = (struct wfs_cluster_hdr *)packed;
+    e = cache_slot(fs, first);
+    if (k == 0 || h->clen > k * BLOCK_SIZE - sizeof(*h) ||
+        lz4_decompress(h + 1, h->clen, e->data, WFS_CLUSTER_SIZE) != WFS_CLUSTER_SIZE) {
+        e->fs = NULL;
+        return NULL;
+    }
+    return e->data;
+}
+
+/* Write compressed cluster 'c' back out as plain blocks, ahead of a write
+ * into it. Nothing changes if there is no room for them. */
+static int unpack_cluster(struct wfs_ctx *fs, struct wfs_inode *inode, off_t c)
+{
+    off_t *slots[WFS_CLUSTER_BLOCKS], prev;
+    off_t fresh[WFS_CLUSTER_BLOCKS], old[WFS_CLUSTER_BLOCKS];
+    int n_old = 0;
+
+    char *data = cluster_data(fs, inode, c);
+    if (!data) return -EIO;
+    cluster_slots(fs, inode, c, slots, &prev);
+
+    for (int j = 0; j < WFS_CLUSTER_BLOCKS; j++) {
+        fresh[j] = alloc_block(fs, block_goal(fs, inode, j ? fresh[j - 1] : prev), 0);
+        if (fresh[j] < 0) {
+            free_blocks(fs, fresh, j);
+            return -ENOSPC;
+        }
+        memcpy((char *)fs->mregion + fresh[j], data + j * BLOCK_SIZE, BLOCK_SIZE);
+        csum_update(fs, (char *)fs->mregion + fresh[j]);
+    }
+
+    for (int j = 0; j < WFS_CLUSTER_BLOCKS; j++) {
+        if (blk_addr(*slots[j])) old[n_old++] = blk_addr(*slots[j]);
+        set_slot(fs, inode, slots[j], fresh[j]);
+    }
+    free_blocks(fs, old, n_old);
+    cluster_forget();
+    STAT_INC(fs, clusters_unpacked);
+    return 0;
+}
+
+/* Store cluster 'c' compressed if that saves at least a block: the data
+ * goes into the cluster's first blocks and the rest are freed. Clusters
+ * with holes or unwritten blocks, or already compressed, are left be. */
+static void pack_cluster(struct wfs_ctx *fs, struct wfs_inode *inode, off_t c)
+{
+    off_t *slots[WFS_CLUSTER_BLOCKS], prev, spare[WFS_CLUSTER_BLOCKS];
+    char plain[WFS_CLUSTER_SIZE], packed[WFS_CLUSTER_SIZE];
+    int n_spare = 0;
+
+    cluster_slots(fs, inode, c, slots, &prev);
+    for (int j = 0; j < WFS_CLUSTER_BLOCKS; j++) {
+        if (!slots[j] || *slots[j] == 0 || (*slots[j] & BLK_FLAGS)) return;
+        if (csum_verify(fs, *slots[j], 0) < 0) return;
+        memcpy(plain + j * BLOCK_SIZE, (char *)fs->mregion + *slots[j], BLOCK_SIZE);
+    }
+
+    struct wfs_cluster_hdr *h = (struct wfs_cluster_hdr *)packed;
+    int room = WFS_CLUSTER_SIZE - BLOCK_SIZE - sizeof(*h);
+    int clen = lz4_compress(plain, WFS_CLUSTER_SIZE, h + 1, room);
+    if (clen == 0) return;
+    h->clen = clen;
+
+    size_t bytes = sizeof(*h) + clen;
+    for (int j = 0; j < WFS_CLUSTER_BLOCKS; j++) {
+        off_t done = (off_t)j * BLOCK_SIZE;
+        if ((size_t)done < bytes) {
+            size_t n = bytes - done < BLOCK_SIZE ? bytes - done : BLOCK_SIZE;
+            memcpy((char *)fs->mregion + *slots[j], packed + done, n);
+            csum_update(fs, (char *)fs->mregion + *slots[j]);
+            set_slot(fs, inode, slots[j], *slots[j] | BLK_COMPRESSED);
+        } else {
+            spare[n_spare++] = *slots[j];
+            set_slot(fs, inode, slots[j], BLK_COMPRESSED);
+        }
+    }
+    free_blocks(fs, spare, n_spare);
+    STAT_INC(fs, clusters_packed);
+
+    // it was just read in plain, so the next read need not decompress it
+    memcpy(cache_slot(fs, blk_addr(*slots[0]))->data, plain, WFS_CLUSTER_SIZE);
+}
+
+/* Compress every full cluster in [off, off + len). */
+static void pack_range(struct wfs_ctx *fs, struct wfs_inode *inode, off_t off, off_t len)
+{
+    for (off_t c = off / WFS_CLUSTER_SIZE; c * WFS_CLUSTER_SIZE < off + len; c++)
+        if ((c + 1) * WFS_CLUSTER_SIZE <= inode->size)
+            pack_cluster(fs, inode, c);
+}
+
+/* Deduplication. Identical full file blocks can all point at one block,
+ * with BLK_SHARED on each pointer and the references counted in refs[]
+ * (rebuilt at open from the pointers). In dedup mode every full block a
+ * write leaves behind is hashed into a fingerprint index, one entry per
+ * bucket, and pointed at the indexed block instead if the bytes match. */
+#define MAX_REFS UINT16_MAX
+
+static uint64_t block_hash(const char *blk)
+{
+    const uint64_t *w = (const uint64_t *)blk;
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+        h ^= w[i] * 0xff51afd7ed558ccdull;
+        h = (h << 31 | h >> 33) * 0xc4ceb9fe1a85ec53ull;
+    }
+    return h ^ (h >> 29);
+}
+
+static int refs_alloc(struct wfs_ctx *fs)
+{
+    if (!fs->refs && !(fs->refs = calloc(fs->layout.num_data_blocks, sizeof(uint16_t))))
+        return -ENOMEM;
+    return 0;
+}
+
+// count every shared pointer in the image; nothing found clears the flag
+static void count_shared(struct wfs_ctx *fs)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)fs->mregion;
+    size_t found = 0;
+    if (refs_alloc(fs) < 0) return;
+
+    for (size_t i = 0; i < fs->layout.num_inodes; i++) {
+        struct wfs_inode *inode = retrieve_inode(fs, i);
+        if (!inode || !S_ISREG(inode->mode)) continue;
+        off_t prev;
+        for (off_t b = 0; b * BLOCK_SIZE < inode->size; b++) {
+            off_t *slot = block_slot(fs, inode, b, 0, &prev);
+            if (slot && (*slot & BLK_SHARED)) {
+                ssize_t n = wfs_block_num(&fs->layout, blk_addr(*slot));
+                if (n >= 0 && fs->refs[n] < MAX_REFS) fs->refs[n]++;
+                found++;
+            }
+        }
+    }
+    if (!found) sb->state &= ~WFS_STATE_SHARED;
+}
+
+/* Drop one reference to shared block 'blk'; true if that was the last
+ * and the block should be freed. Caller holds dedup_lock. */
+static int ref_drop(struct wfs_ctx *fs, off_t blk)
+{
+    ssize_t n = wfs_block_num(&fs->layout, blk);
+    if (n < 0 || !fs->refs) return 0;
+    return fs->refs[n] > 0 && --fs->refs[n] == 0;
+}
+
+/* Give the file its own copy of the shared block in 'slot'. */
+static int unshare(struct wfs_ctx *fs, struct wfs_inode *inode, off_t *slot, off_t prev)
+{
+    off_t old = blk_addr(*slot);
+    if (csum_verify(fs, old, 0) < 0) return -EIO;
+    off_t copy = alloc_block(fs, block_goal(fs, inode, prev), 0);
+    if (copy < 0) return -ENOSPC;
+    memcpy((char *)fs->mregion + copy, (char *)fs->mregion + old, BLOCK_SIZE);
+    csum_update(fs, (char *)fs->mregion + copy);
+
+    pthread_mutex_lock(&fs->dedup_lock);
+    int last = ref_drop(fs, old);
+    set_slot(fs, inode, slot, copy);
+    pthread_mutex_unlock(&fs->dedup_lock);
+
+    if (last) free_block(fs, old);
+    STAT_INC(fs, blocks_unshared);
+    return 0;
+}
+
+/* Look file block 'idx' up in the fingerprint index: point it at an
+ * identical block if there is one, else make it the indexed copy. Only
+ * full, plain (or already shared) blocks take part. Returns 1 if the
+ * block was merged. */
+static int dedup_block(struct wfs_ctx *fs, struct wfs_inode *inode, off_t idx)
+{
+    struct wfs_layout *l = &fs->layout;
+    off_t prev;
+    off_t *slot = block_slot(fs, inode, idx, 0, &prev);
+    if ((idx + 1) * BLOCK_SIZE > inode->size || !slot || *slot == 0 ||
+        (*slot & (BLK_UNWRITTEN | BLK_COMPRESSED)))
+        return 0;
+
+    off_t blk = blk_addr(*slot);
+    const char *data = (char *)fs->mregion + blk;
+    uint64_t h = block_hash(data);
+    int merged = 0, last = 0;
+
+    pthread_mutex_lock(&fs->dedup_lock);
+    struct wfs_fingerprint *e = &fs->fingerprints[h & fs->fp_mask];
+    if (e->blk && e->hash == h) {
+        off_t other = wfs_block_off(l, e->blk - 1);
+        struct wfs_inode *owner = retrieve_inode(fs, e->inum);
+        off_t *os = owner && S_ISREG(owner->mode) ? block_slot(fs, owner, e->idx, 0, &prev) : NULL;
+
+        // the indexed file block must still be that block, with those bytes
+        if (other != blk && os && blk_addr(*os) == other &&
+            !(*os & (BLK_UNWRITTEN | BLK_COMPRESSED)) && fs->refs[e->blk - 1] < MAX_REFS &&
+            memcmp((char *)fs->mregion + other, data, BLOCK_SIZE) == 0 &&
+            csum_verify(fs, other, 0) == 0) {
+            if (!(*os & BLK_SHARED)) {
+                set_slot(fs, owner, os, *os | BLK_SHARED);
+                fs->refs[e->blk - 1] = 1;
+            }
+            fs->refs[e->blk - 1]++;
+            last = (*slot & BLK_SHARED) ? ref_drop(fs, blk) : 1;
+            set_slot(fs, inode, slot, other | BLK_SHARED);
+            ((struct wfs_sb *)fs->mregion)->state |= WFS_STATE_SHARED;
+            merged = 1;
+        }
+    }
+    if (!merged) {
+        e->hash = h;
+        e->blk = wfs_block_num(l, blk) + 1;
+        e->inum = inode->num;
+        e->idx = idx;
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+
+    if (last) free_block(fs, blk);
+    if (merged) STAT_INC(fs, blocks_deduped);
+    return merged;
+}
+
+/* Dedup the full blocks in [off, off + len) of a file. */
+static int dedup_range(struct wfs_ctx *fs, struct wfs_inode *inode, off_t off, off_t len)
+{
+    int merged = 0;
+    if (!fs->fingerprints || (inode->flags & WFS_INODE_COMPRESS)) return 0;
+    for (off_t b = off / BLOCK_SIZE; b * BLOCK_SIZE < off + len; b++)
+        merged += dedup_block(fs, inode, b);
+    return merged;
+}
+
+/* Resolve file offset 'offset' into *out, allocating if asked; *out is
+ * NULL for a hole. A read checks the indirect block and the data block
+ * against their checksums first, and fails with -EIO if one is bad. */
+static int map_block(struct wfs_ctx *fs, struct wfs_inode *inode, off_t offset, int alloc, char **out)
+{
+    STAT_INC(fs, data_offset_calls);
+    *out = NULL;
+
+    if (offset < 0) {
+      STAT_INC(fs, range_errors);
+      return -ENOSPC;
+    }
+
+    off_t block_idx = offset / BLOCK_SIZE;
+    off_t inner_offset = offset % BLOCK_SIZE;
+    int meta = !S_ISREG(inode->mode);
+
+    if (block_idx >= D_BLOCK && inode->blocks[IND_SLOT] &&
+        csum_verify(fs, inode->blocks[IND_SLOT], 1) < 0)
+        return -EIO;
+
+    off_t prev;
+    off_t *slot = block_slot(fs, inode, block_idx, alloc, &prev);
+    if (!slot) return alloc ? -ENOSPC : 0;
+
+    // a read holds no lock, so the slot is read once and checked before
+    // it is followed: the block map may be changing under it
+    off_t ptr = *slot;
+    if (blk_addr(ptr) && wfs_block_num(&fs->layout, blk_addr(ptr)) < 0) return -EIO;
+
+    int err;
+    if ((ptr & BLK_SHARED) && alloc && (err = unshare(fs, inode, slot, prev)) < 0)
+        return err;
+
+    if (ptr & BLK_COMPRESSED) {
+        off_t c = block_idx / WFS_CLUSTER_BLOCKS;
+        if (alloc) {
+            if ((err = unpack_cluster(fs, inode, c)) < 0) return err;
+        } else {
+            char *data = cluster_data(fs, inode, c);
+            if (!data) return -EIO;
+            *out = data + (block_idx % WFS_CLUSTER_BLOCKS) * BLOCK_SIZE + inner_offset;
+            return 0;
+        }
+    }
+    // unsharing or unpacking gave it a new block
+    if (alloc) ptr = *slot;
+
+    if (ptr == 0) {
+        if (!alloc) return 0;
+        ptr = allocate_data_block(fs, block_goal(fs, inode, prev));
+        if (ptr < 0) return -ENOSPC;
+        set_slot(fs, inode, slot, ptr);
+    } else if (ptr & BLK_UNWRITTEN) {
+        if (!alloc) return 0;
+        ptr = blk_addr(ptr);
+        memset((char *)fs->mregion + ptr, 0, BLOCK_SIZE);
+        csum_update(fs, (char *)fs->mregion + ptr);
+        set_slot(fs, inode, slot, ptr);
+    } else if (csum_verify(fs, blk_addr(ptr), meta) < 0) {
+        return -EIO;
+    }
+
+    *out = (char *)fs->mregion + blk_addr(ptr) + inner_offset;
+    return 0;
+}
+
+/* Return pointer to file offset; alloc if requested. Supports direct + single indirect.
+ * An unwritten block reads as a hole; asking to allocate it zeroes it. A
+ * compressed block reads from the cluster cache; asking to allocate it
+ * unpacks its cluster, and a shared one gets copied. NULL for a hole or
+ * on any error. Whoever writes through the pointer must call csum_update()
+ * afterwards. */
+char *data_offset(struct wfs_ctx *fs, struct wfs_inode *inode, off_t offset, int alloc) {
+    /*
+    - Translate a file byte offset into a location within the on-disk storage.
+    - Support the inode’s addressing model (direct blocks plus a single level of indirection).
+    - Enforce capacity limits and report errors appropriately.
+    - Optionally provision storage for missing pieces when requested.
+    - Return a pointer into the mapped image at the resolved location within a block.
+    */
+
+    char *p;
+    map_block(fs, inode, offset, alloc, &p);
+    return p;
+}
+
+/* Give the holes among file blocks [first, last] their blocks before a
+ * write that spans them, in runs rather than one at a time. They are marked
+ * unwritten, exactly as block_for_write would leave them. Best effort: a
+ * hole missed here is filled by block_for_write, which reports the error.
+ * Like block_for_write, leaves the indirect block's checksum to the caller. */
+static void reserve_blocks(struct wfs_ctx *fs, struct wfs_inode *inode, off_t first, off_t last)
+{
+    if (last >= D_BLOCK && inode->blocks[IND_SLOT] && csum_verify(fs, inode->blocks[IND_SLOT], 1) < 0)
+        return;
+
+    off_t run = 0, prev;
+    int left = 0;
+    for (off_t b = first; b <= last; b++) {
+        off_t *slot = block_slot(fs, inode, b, 1, &prev);
+        if (!slot) break;
+        if (*slot) continue;
+        if (left == 0) {
+            // stop short of the indirect block, so it goes where it always has
+            off_t end = b < D_BLOCK && last >= D_BLOCK ? D_BLOCK : last + 1;
+            if ((left = alloc_run(fs, block_goal(fs, inode, prev), end - b, &run)) < 0) {
+                left = 0;
+                break;
+            }
+        }
+        *slot = run | BLK_UNWRITTEN;
+        run += BLOCK_SIZE;
+        left--;
+    }
+    // existing blocks ended the span early
+    for (; left > 0; left--, run += BLOCK_SIZE)
+        free_block(fs, run);
+}
+
+/* Undo reserve_blocks for the blocks a failed write never reached. */
+static void unreserve_blocks(struct wfs_ctx *fs, struct wfs_inode *inode, off_t first, off_t last)
+{
+    off_t prev;
+    for (off_t b = first; b <= last; b++) {
+        off_t *slot = block_slot(fs, inode, b, 0, &prev);
+        if (!slot) break;
+        if (*slot & BLK_UNWRITTEN) {
+            free_block(fs, blk_addr(*slot));
+            *slot = 0;
+        }
+    }
+}
+
+/* Block for writing 'len' bytes at 'offset' (within one block) of a file
+ * that will be 'eof' bytes long afterwards, in *out. A new block is taken
+ * without zeroing it and is marked unwritten until this write lands; only
+ * the bytes inside the file that the write does not cover get zeroed, and
+ * garbage past the old end of file is cleared when the write exposes it.
+ * A block that is only partly overwritten must pass its checksum first.
+ * The indirect block's checksum is not updated for the slot this fills in:
+ * write_inode_data does that once for the whole write. */
+static int block_for_write(struct wfs_ctx *fs, struct wfs_inode *inode, off_t offset, size_t len, off_t eof, char **out)
+{
+    STAT_INC(fs, data_offset_calls);
+    *out = NULL;
+
+    off_t inner = offset % BLOCK_SIZE;
+    off_t start = offset - inner;
+
+    if (offset / BLOCK_SIZE >= D_BLOCK && inode->blocks[IND_SLOT] &&
+        csum_verify(fs, inode->blocks[IND_SLOT], 1) < 0)
+        return -EIO;
+
+    off_t prev;
+    off_t *slot = block_slot(fs, inode, offset / BLOCK_SIZE, 1, &prev);
+    if (!slot) return -ENOSPC;
+
+    int err;
+    if ((*slot & BLK_COMPRESSED) &&
+        (err = unpack_cluster(fs, inode, offset / BLOCK_SIZE / WFS_CLUSTER_BLOCKS)) < 0)
+        return err;
+    if ((*slot & BLK_SHARED) && (err = unshare(fs, inode, slot, prev)) < 0)
+        return err;
+
+    if (*slot == 0) {
+        off_t new_block = alloc_block(fs, block_goal(fs, inode, prev), 0);
+        if (new_block < 0) return -ENOSPC;
+        *slot = new_block | BLK_UNWRITTEN;
+    }
+
+    char *blk = (char *)fs->mregion + blk_addr(*slot);
+    if (*slot & BLK_UNWRITTEN) {
+        off_t tail = (eof - start < BLOCK_SIZE ? eof - start : BLOCK_SIZE) - (inner + (off_t)len);
+        memset(blk, 0, inner);
+        if (tail > 0) memset(blk + inner + len, 0, tail);
+        *slot = blk_addr(*slot);
+    } else {
+        if (len < BLOCK_SIZE && csum_verify(fs, blk_addr(*slot), !S_ISREG(inode->mode)) < 0)
+            return -EIO;
+        if (inode->size < offset) {
+            // bytes between the old end of file and this write were never written
+            off_t gap = inode->size > start ? inode->size - start : 0;
+            memset(blk + gap, 0, inner - gap);
+        }
+    }
+    *out = blk + inner;
+    return 0;
+}
+
+void fillin_inode(struct wfs_inode* inode, mode_t mode)
+{
+    inode->mode = mode;
+    inode->uid = getuid();
+    inode->gid = getgid();
+    inode->size = 0;
+    inode->nlinks = 1;
+    memset(inode->blocks, 0, sizeof(inode->blocks));
+    stamp(inode, T_ALL, now());
+    inode->color = WFS_COLOR_NONE;
+    inode->flags = 0;
+
+}
+
+int add_dentry(struct wfs_ctx *fs, struct wfs_inode* parent, int num, char* name)
+{
+    /*TODO: insert dentry if there is an empty slot.
+    We will not do indirect blocks with directories*/
+    
+    // return error if parent inode isn't a directory
+    if (!S_ISDIR(parent->mode)) {
+      return -ENOTDIR;
+    }
+
+    if (strlen(name) >= MAX_NAME) {
+      return -ENAMETOOLONG;
+    }
+
+    int num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
+
+    int next_block = -1;
+    struct wfs_dentry *next_free = NULL;
+    int next_free_block = -1;
+    int err = 0;
+    struct dentry_key key;
+    int named = dentry_key(name, &key) == 0;
+    
+    // check if the name already exists in the directory and return error if so
+    for (int i = 0; i < D_BLOCK; i++) {
+
+      // if block is empty, set next block to be current block if first empty block found
+      if (parent->blocks[i] == 0) {
+        if (next_block == -1) {
+          next_block = i;
+        } 
+        continue;
+      }
+
+      // a block that fails its checksum might hold the name already
+      struct wfs_dentry *entries = dir_block(fs, parent, i, &err);
+      if (!entries) return err;
+      STAT_ADD(fs, dentry_scanned, num_entries);
+
+      // return error if the name is in the block, else note its first free entry
+      if (named && match_dentry(entries, num_entries, &key) >= 0) return -EEXIST;
+      for (int j = 0; j < num_entries && !next_free; j++) {
+        if (entries[j].num == 0 || entries[j].name[0] == '\0') {
+          next_free = &entries[j];
+          next_free_block = i;
+        }
+      }
+    }
+
+    // if free spot was found, add entry
+    if (next_free) {
+      strcpy(next_free->name, name);
+      next_free->num = num;
+      csum_update(fs, next_free);
+
+      // update parent size if needed
+      off_t needed_size = (off_t)(next_free_block + 1) * BLOCK_SIZE;
+      if (parent->size < needed_size) {
+        parent->size = needed_size;
+      }
+
+      /// update modify and status change times
+      touch(fs, parent, T_MTIME | T_CTIME);
+
+      return 0;
+    }
+
+    // if no empty block was found return error
+    if (next_block < 0) {
+      return -ENOSPC;
+    }
+
+    // allocate new block
+    off_t prev = next_block > 0 ? parent->blocks[next_block - 1] : 0;
+    off_t new_block = allocate_data_block(fs, block_goal(fs, parent, prev));
+    if (new_block < 0) {
+      return new_block;
+    }
+
+    parent->blocks[next_block] = new_block;
+
+    // update directory size based on number of allocated blocks
+    int num_alloc = 0;
+    for (int i = 0; i < D_BLOCK; ++i) {
+      if (parent->blocks[i] != 0) num_alloc++;
+    }
+
+    // create entry
+    struct wfs_dentry *entry = (struct wfs_dentry *)((char *)fs->mregion + parent->blocks[next_block]);
+    strcpy(entry->name, name);
+    entry->num = num;
+    csum_update(fs, entry);
+
+    // update parent size to include block
+    off_t new_size = (off_t)(next_block + 1) * BLOCK_SIZE;
+    if (parent->size < new_size) {
+      parent->size = new_size;
+    }
+
+    // update modify and status change times
+    touch(fs, parent, T_MTIME | T_CTIME);
+    
+    return 0;
+}
+
+int remove_dentry(struct wfs_ctx *fs, struct wfs_inode *dir, int inum)
+{
+    /*TODO: Use inode 0 as a "deleted" inode. 
+    So any directory entry could be marked as 0 to indicate it is deleted. 
+    Removed dentries can result in "holes" in the dentry list, thus it is
+    important to use the first available slot in add_dentry() */
+
+    int num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    int found = 0, err = 0;
+  
+    for (int i = 0; i < D_BLOCK; i++) {
+
+      struct wfs_dentry *entries = dir_block(fs, dir, i, &err);
+      if (!entries) continue;
+
+      // iterate through dentries to find matching inum
+      for (int j = 0; j < num_entries; j++) {
+        STAT_INC(fs, dentry_scanned);
+
+        // set to 0 once found
+        if (entries[j].num == inum) {
+          entries[j].num = 0;
+          entries[j].name[0] = '\0';
+          csum_update(fs, &entries[j]);
+          found = 1;
+          break;
+        }
+      }
+
+      // end early if inode already found and removed
+      if (found) {
+        
+        // update modify and status change times
+        touch(fs, dir, T_MTIME | T_CTIME);
+        break;
+      }
+    }  
+
+    // return error if dentry with matching inum was never found
+    if (!found) {
+      return err ? err : -ENOENT;
+    }
+
+    return 0;
+}
+
+int dentry_to_num(struct wfs_ctx *fs, const char *name, struct wfs_inode *inode)
+{
+    int err;
+    struct wfs_dentry *d = find_dentry(fs, inode, name, &err);
+    return d ? d->num : err;
+}
+
+/* Point the existing dentry 'name' in 'dir' at inode 'num'. The entry is
+ * rewritten in place, so a rename over an existing name never exposes a
+ * window where the name is missing. */
+int set_dentry(struct wfs_ctx *fs, struct wfs_inode *dir, char *name, int num)
+{
+    int err;
+    struct wfs_dentry *d = find_dentry(fs, dir, name, &err);
+    if (!d) return err;
+
+    d->num = num;
+    csum_update(fs, d);
+
+    touch(fs, dir, T_MTIME | T_CTIME);
+    return 0;
+}
+
+/* Remove a dentry by name. Unlike remove_dentry() this is exact when several
+ * hard links to the same inode live in one directory. */
+int remove_dentry_name(struct wfs_ctx *fs, struct wfs_inode *dir, char *name)
+{
+    int err;
+    struct wfs_dentry *d = find_dentry(fs, dir, name, &err);
+    if (!d) return err;
+
+    d->num = 0;
+    d->name[0] = '\0';
+    csum_update(fs, d);
+
+    touch(fs, dir, T_MTIME | T_CTIME);
+    return 0;
+}
+
+int dir_is_empty(struct wfs_ctx *fs, struct wfs_inode *dir)
+{
+    int num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    int err = 0;
+
+    // a block that fails its checksum counts as holding something
+    for (int i = 0; i < D_BLOCK; i++) {
+      struct wfs_dentry *entries = dir_block(fs, dir, i, &err);
+      if (err) return 0;
+      if (!entries) continue;
+
+      STAT_ADD(fs, dentry_scanned, num_entries);
+      for (int j = 0; j < num_entries; j++) {
+        if (entries[j].num != 0 && entries[j].name[0] != '\0') return 0;
+      }
+    }
+    return 1;
+}
+
+/* Short symlink targets live in the blocks[] array itself (a "fast" symlink),
+ * so they cost no data block and resolve without a second fetch. */
+static int inline_symlink(struct wfs_inode *inode)
+{
+    return S_ISLNK(inode->mode) && (size_t)inode->size < sizeof(inode->blocks);
+}
+
+/* Release every data block owned by 'inode' (direct, indirect pointees and
+ * the indirect block itself). The pointers are cleared before the blocks
+ * are freed, so a crash in between leaks blocks rather than sharing them. */
+void free_inode_data(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    if (inline_symlink(inode)) {
+      memset(inode->blocks, 0, sizeof(inode->blocks));
+      return;
+    }
+
+    int num_per_block = BLOCK_SIZE / sizeof(off_t);
+    off_t blks[D_BLOCK + BLOCK_SIZE / sizeof(off_t) + 1];
+    int n = 0;
+
+    int packed = 0;
+
+    // a defragmenter moving the file holds its sequence count
+    unsigned *seq = seq_write_begin(fs, inode);
+
+    // the spare slots of a compressed cluster have no block, and a shared
+    // block goes with its last reference
+    pthread_mutex_lock(&fs->dedup_lock);
+    for (int i = 0; i < D_BLOCK; i++) {
+        off_t ptr = inode->blocks[i];
+        packed |= ptr & BLK_COMPRESSED;
+        if (blk_addr(ptr) != 0 && (!(ptr & BLK_SHARED) || ref_drop(fs, blk_addr(ptr))))
+            blks[n++] = blk_addr(ptr);
+        inode->blocks[i] = 0;
+    }
+
+    if (inode->blocks[IND_SLOT] != 0) {
+
+        off_t indirect_off = inode->blocks[IND_SLOT];
+        off_t *indirect = (off_t *)((char *)fs->mregion + indirect_off);
+
+        // the pointers go with the indirect block itself
+        for (int i = 0; i < num_per_block; i++) {
+            off_t ptr = indirect[i];
+            packed |= ptr & BLK_COMPRESSED;
+            if (blk_addr(ptr) != 0 && (!(ptr & BLK_SHARED) || ref_drop(fs, blk_addr(ptr))))
+                blks[n++] = blk_addr(ptr);
+        }
+
+        blks[n++] = indirect_off;
+        inode->blocks[IND_SLOT] = 0;
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+    inode->size = 0;
+
+    // before the count goes even again, so a reader that could still be
+    // following the old pointers is bound to start over
+    free_blocks(fs, blks, n);
+    if (packed) cluster_forget();
+    seq_write_end(seq);
+}
+
+/* ------------------------------ Reclamation ------------------------------- */
+/* The orphan list lives in the superblock, which flat images don't have
+ * room for; they always free on the spot. */
+static int orphan_list(struct wfs_ctx *fs)
+{
+    return fs->reclaiming && ((struct wfs_sb *)fs->mregion)->magic == WFS_MAGIC;
+}
+
+/* An inode nothing refers to any more: hand it to the reclaimer, or free it
+ * right away if there is none. */
+static void release_inode(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    if (!orphan_list(fs)) {
+        free_inode_data(fs, inode);
+        free_inode(fs, inode);
+        return;
+    }
+
+    struct wfs_sb *sb = (struct wfs_sb *)fs->mregion;
+    pthread_mutex_lock(&fs->orphan_lock);
+    inode->nlinks = 0;
+    inode->next_orphan = sb->orphans;
+    sb->orphans = inode->num;
+    pthread_cond_signal(&fs->orphan_more);
+    pthread_mutex_unlock(&fs->orphan_lock);
+}
+
+/* Free the inode at the head of the orphan list. It stays on the list
+ * until its blocks are gone, so a crash never loses track of it. Returns 0
+ * once the list is empty. Called with orphan_lock held. */
+static int reclaim_one(struct wfs_ctx *fs)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)fs->mregion;
+    uint32_t inum = sb->orphans;
+    if (inum == 0) return 0;
+
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode || inode->nlinks != 0) {
+        // a damaged list; whatever is left on it is fsck's to find
+        STAT_INC(fs, range_errors);
+        sb->orphans = 0;
+        return 0;
+    }
+
+    // wfs_grow may move the image while the list is unlocked
+    pthread_mutex_unlock(&fs->orphan_lock);
+    pthread_rwlock_rdlock(&fs->grow_lock);
+    free_inode_data(fs, retrieve_inode(fs, inum));
+    pthread_rwlock_unlock(&fs->grow_lock);
+    pthread_mutex_lock(&fs->orphan_lock);
+    sb = (struct wfs_sb *)fs->mregion;
+    inode = retrieve_inode(fs, inum);
+
+    // more may have been pushed in front of it meanwhile
+    uint32_t *link = &sb->orphans;
+    while (*link != inum)
+        link = &retrieve_inode(fs, *link)->next_orphan;
+    *link = inode->next_orphan;
+
+    free_inode(fs, inode);
+    return 1;
+}
+
+static void *reclaimer(void *arg)
+{
+    struct wfs_ctx *fs = arg;
+
+    pthread_mutex_lock(&fs->orphan_lock);
+    for (;;) {
+        while (((struct wfs_sb *)fs->mregion)->orphans == 0 && !fs->reclaim_stop)
+            pthread_cond_wait(&fs->orphan_more, &fs->orphan_lock);
+        // drain before stopping, so a clean image has an empty list
+        if (!reclaim_one(fs) && fs->reclaim_stop) break;
+    }
+    pthread_mutex_unlock(&fs->orphan_lock);
+    return NULL;
+}
+
+int wfs_start_reclaimer(struct wfs_ctx *fs)
+{
+    if (fs->reclaiming) return 0;
+    fs->reclaim_stop = 0;
+    int err = pthread_create(&fs->reclaimer, NULL, reclaimer, fs);
+    if (err) return -err;
+    fs->reclaiming = 1;
+    return 0;
+}
+
+// a thread per core, up to WFS_LOADERS; with none, group_load's callers do it all
+int wfs_start_loaders(struct wfs_ctx *fs)
+{
+    if (fs->n_loaders) return 0;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = cores < 1 ? 1 : cores > WFS_LOADERS ? WFS_LOADERS : cores, err = 0;
+    if ((uint32_t)n > fs->layout.num_groups) n = fs->layout.num_groups;
+    for (int i = 0; i < n && !err; i++)
+        if ((err = pthread_create(&fs->loaders[fs->n_loaders], NULL, group_loader, fs)) == 0) fs->n_loaders++;
+    return fs->n_loaders ? 0 : -err;
+}
+
+void wfs_set_secure_delete(struct wfs_ctx *fs, int on)
+{
+    fs->secure_delete = on;
+}
+
+void wfs_set_discard(struct wfs_ctx *fs, int on)
+{
+    fs->discard = on;
+}
+
+off_t wfs_trim(struct wfs_ctx *fs)
+{
+    struct wfs_layout *l = &fs->layout;
+    off_t total = 0;
+    for (uint32_t g = 0; g < l->num_groups; g++) {
+        pthread_mutex_lock(&fs->group_locks[g]);
+        off_t n = punch_free(fs, g, 0, wfs_group_blocks(l, g));
+        pthread_mutex_unlock(&fs->group_locks[g]);
+        if (n < 0) return total ? total : n;
+        total += n;
+    }
+    return total;
+}
+
+void wfs_set_time_mode(struct wfs_ctx *fs, int atime_mode, int lazytime)
+{
+    pthread_mutex_lock(&fs->lazy_lock);
+    fs->atime_mode = atime_mode;
+    if (lazytime && !fs->lazy) {
+        // without the table, updates just go to the inode as before
+        fs->lazy = calloc(LAZY_SLOTS, sizeof(*fs->lazy));
+    } else if (!lazytime && fs->lazy) {
+        lazy_flush(fs);
+        free(fs->lazy);
+        fs->lazy = NULL;
+    }
+    pthread_mutex_unlock(&fs->lazy_lock);
+}
+
+/* Drop one link to 'inode'; the inode and its data go away with the last. */
+void drop_link(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    inode->nlinks--;
+    if (inode->nlinks > 0) {
+      touch(fs, inode, T_CTIME);
+      return;
+    }
+
+    release_inode(fs, inode);
+}
+
+/* Copy 'len' bytes into the file at 'off', allocating blocks as needed.
+ * Returns 0 or a negative errno; does not touch size or timestamps. */
+int write_inode_data(struct wfs_ctx *fs, struct wfs_inode *inode, const char *buf, size_t len, off_t off)
+{
+    size_t left_to_write = len;
+    off_t curr_off = off;
+    off_t eof = off + (off_t)len > inode->size ? off + (off_t)len : inode->size;
+
+    // the old last block's tail was past the end of file and may hold garbage
+    off_t tail_blk = inode->size / BLOCK_SIZE;
+    if (off > inode->size && inode->size % BLOCK_SIZE && tail_blk != off / BLOCK_SIZE) {
+      char *tail = data_offset(fs, inode, inode->size, 0);
+      if (tail) {
+        memset(tail, 0, BLOCK_SIZE - inode->size % BLOCK_SIZE);
+        csum_update(fs, tail);
+      }
+    }
+
+    off_t last = (off + (off_t)len - 1) / BLOCK_SIZE;
+    if (last > off / BLOCK_SIZE)
+      reserve_blocks(fs, inode, off / BLOCK_SIZE, last);
+
+    int err = 0;
+    while (left_to_write > 0) {
+
+      off_t inner_off = curr_off % BLOCK_SIZE;
+
+      size_t curr_chunk = BLOCK_SIZE - inner_off;
+
+      // cap chunk at what is left to write
+      if (curr_chunk > left_to_write) {
+        curr_chunk = left_to_write;
+      }
+
+      char *dst;
+      err = block_for_write(fs, inode, curr_off, curr_chunk, eof, &dst);
+      if (err < 0) {
+        unreserve_blocks(fs, inode, curr_off / BLOCK_SIZE, last);
+        break;
+      }
+
+      memcpy(dst, buf, curr_chunk);
+      csum_update(fs, dst);
+
+      // update buffer and offset to write next chunk
+      buf += curr_chunk;
+      left_to_write -= curr_chunk;
+      curr_off += curr_chunk;
+    }
+
+    // one checksum for all the indirect slots this write filled in, unless
+    // the indirect block was bad to begin with
+    off_t ind = inode->blocks[IND_SLOT];
+    if (last >= D_BLOCK && ind && csum_verify(fs, ind, 1) == 0)
+      csum_update(fs, (char *)fs->mregion + ind);
+    return err;
+}
+
+/* Copy up to 'len' bytes of the file at 'off' into 'buf'; returns how many
+ * (none past the end of file) or a negative errno. Runs without a lock
+ * under sequence count 'seq', which the caller checks afterwards; gives up
+ * with -EAGAIN as soon as a writer gets in, whose frees could hand the
+ * blocks it is about to read to another file. */
+static ssize_t read_inode_data(struct wfs_ctx *fs, struct wfs_inode *inode, char *buf, size_t len, off_t off, unsigned seq)
+{
+    // Offset at or beyond file limit => return 0
+    off_t size = inode->size;
+    if (off >= size)
+        return 0;
+
+    // Clamp read length to file size
+    size_t to_read = len;
+    if (off + len > size)
+        to_read = size - off;
+
+    size_t left_to_read = to_read;
+    while (left_to_read > 0) {
+      
+      off_t inner_off = off % BLOCK_SIZE;
+
+      size_t curr_chunk = BLOCK_SIZE - inner_off;
+
+      // cap chunk at what is left to read
+      if (curr_chunk > left_to_read) {
+        curr_chunk = left_to_read;
+      }
+
+      if (seq_moved(fs, inode, seq)) return -EAGAIN;
+
+      // Compute physical read location
+      char *src;
+      int err = map_block(fs, inode, off, 0, &src);
+      if (err < 0) return err;
+      if (!src) {
+        // fill with zeroes
+        memset(buf, 0, curr_chunk);
+      } else {
+        memcpy(buf, src, curr_chunk);
+      }
+
+      // update buffer and offset to read next chunk
+      buf += curr_chunk;
+      left_to_read -= curr_chunk;
+      off += curr_chunk;
+    }
+    return to_read;
+}
+
+/* Resolve the parent directory of 'path' and copy out the final component. */
+static int lookup_parent(struct wfs_ctx *fs, const char *path, struct wfs_inode **parent, char name[MAX_NAME])
+{
+    char clean_path[PATH_MAX];
+    if (strlen(path) >= sizeof(clean_path)) return -ENAMETOOLONG;
+    strcpy(clean_path, path);
+
+    char *last_slash = strrchr(clean_path, '/');
+    if (!last_slash || last_slash[1] == '\0') return -ENOENT;
+
+    if (strlen(last_slash + 1) >= MAX_NAME) return -ENAMETOOLONG;
+    strcpy(name, last_slash + 1);
+
+    if (last_slash == clean_path) {
+      last_slash[1] = '\0';
+    } else {
+      *last_slash = '\0';
+    }
+
+    int err = get_inode_from_path(fs, clean_path, parent);
+    if (err < 0) return err;
+    if (!S_ISDIR((*parent)->mode)) return -ENOTDIR;
+    return 0;
+}
+
+/* /.snapshots is only ever made by snapshot_dir(); nothing else may take
+ * the name, or snapshots could not be taken any more. */
+static int reserved_name(struct wfs_inode *parent, const char *name)
+{
+    return parent->num == 0 && strcmp(name, WFS_SNAPSHOT_DIR) == 0;
+}
+
+/* Is 'path' equal to or below directory 'dir'? */
+static int path_within(const char *path, const char *dir)
+{
+    size_t n = strlen(dir);
+    return strncmp(path, dir, n) == 0 && (path[n] == '\0' || path[n] == '/');
+}
+
+/* Move the dentry 'from' to 'to'. Both sides are plain dentry updates, so a
+ * rename costs O(1) regardless of file size or directory depth (".." is
+ * resolved from the walked path, not stored on disk). 'flags' accepts
+ * RENAME_NOREPLACE and RENAME_EXCHANGE with their renameat2(2) meaning. */
+int rename_dentry(struct wfs_ctx *fs, const char *from, const char *to, unsigned int flags)
+{
+    if ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE)) return -EINVAL;
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) return -EINVAL;
+
+    struct wfs_inode *src_parent, *dst_parent;
+    char src_name[MAX_NAME], dst_name[MAX_NAME];
+    int err = lookup_parent(fs, from, &src_parent, src_name);
+    if (err < 0) return err;
+    err = lookup_parent(fs, to, &dst_parent, dst_name);
+    if (err < 0) return err;
+    if ((src_parent->flags | dst_parent->flags) & WFS_INODE_SNAPSHOT) return -EROFS;
+
+    int src_num = dentry_to_num(fs, src_name, src_parent);
+    if (src_num < 0) return src_num;
+    struct wfs_inode *src = retrieve_inode(fs, src_num);
+    if (!src) return -ENOENT;
+
+    int dst_num = dentry_to_num(fs, dst_name, dst_parent);
+    struct wfs_inode *dst = dst_num >= 0 ? retrieve_inode(fs, dst_num) : NULL;
+
+    // snapshots, /.snapshots included, stay where they are
+    if ((src->flags | (dst ? dst->flags : 0)) & WFS_INODE_SNAPSHOT) return -EROFS;
+    if (!dst && reserved_name(dst_parent, dst_name)) return -EPERM;
+
+    // one name onto itself, or onto another link to the same inode, changes nothing
+    if (dst_num == src_num) return (flags & RENAME_NOREPLACE) ? -EEXIST : 0;
+
+    // a directory can't be moved below itself
+    if (S_ISDIR(src->mode) && path_within(to, from)) return -EINVAL;
+
+    if (flags & RENAME_EXCHANGE) {
+      if (!dst) return -ENOENT;
+      if (S_ISDIR(dst->mode) && path_within(from, to)) return -EINVAL;
+
+      set_dentry(fs, src_parent, src_name, dst_num);
+      set_dentry(fs, dst_parent, dst_name, src_num);
+
+      touch(fs, src, T_CTIME);
+      touch(fs, dst, T_CTIME);
+      return 0;
+    }
+
+    if (dst) {
+      if (flags & RENAME_NOREPLACE) return -EEXIST;
+
+      if (S_ISDIR(src->mode) && !S_ISDIR(dst->mode)) return -ENOTDIR;
+      if (!S_ISDIR(src->mode) && S_ISDIR(dst->mode)) return -EISDIR;
+      if (S_ISDIR(dst->mode) && !dir_is_empty(fs, dst)) return -ENOTEMPTY;
+
+      // replace in place: 'to' always names either the old or the new inode
+      set_dentry(fs, dst_parent, dst_name, src_num);
+      remove_dentry_name(fs, src_parent, src_name);
+
+      if (S_ISDIR(dst->mode)) {
+        release_inode(fs, dst);
+      } else {
+        drop_link(fs, dst);
+      }
+    } else {
+      // link the new name first so the inode is never unreachable
+      err = add_dentry(fs, dst_parent, src_num, dst_name);
+      if (err != 0) return err < 0 ? err : -EINVAL;
+      remove_dentry_name(fs, src_parent, src_name);
+    }
+
+    touch(fs, src, T_CTIME);
+    return 0;
+}
+
+/* -------------------------- Extended attributes --------------------------- */
+/* Every change gathers an inode's xattrs into one list and lays it out
+ * again. An xattr block is rewritten in place only while one inode uses
+ * it; xattr_cache remembers recently written blocks by hash, so another
+ * inode with the same list points at the same block. All of it happens
+ * under xattr_lock. */
+
+#define XATTR_MAX_SHARE 1024   // inodes the cache puts on one block
+
+struct xattr_list {
+    size_t len;
+    char buf[WFS_XATTR_INLINE + WFS_XATTR_SPACE];
+};
+
+static size_t xattr_len(const struct wfs_xattr *x)
+{
+    return (sizeof(*x) + x->name_len + x->value_len + 3) & ~(size_t)3;
+}
+
+static char *xattr_inline(struct wfs_inode *inode)
+{
+    return (char *)inode + sizeof(struct wfs_inode);
+}
+
+static struct wfs_xattr_hdr *xattr_block(struct wfs_ctx *fs, off_t blk)
+{
+    if (wfs_block_num(&fs->layout, blk) < 0) return NULL;
+    struct wfs_xattr_hdr *h = (struct wfs_xattr_hdr *)((char *)fs->mregion + blk);
+    return h->magic == WFS_XATTR_MAGIC && h->used <= WFS_XATTR_SPACE ? h : NULL;
+}
+
+/* Append the entries in the 'len' bytes at 'area' to 'list'. */
+static int xattr_gather(struct xattr_list *list, const char *area, size_t len)
+{
+    for (size_t at = 0; at + sizeof(struct wfs_xattr) <= len; ) {
+        const struct wfs_xattr *x = (const struct wfs_xattr *)(area + at);
+        if (x->name_len == 0) break;
+        size_t n = xattr_len(x);
+        if (at + n > len || list->len + n > sizeof(list->buf)) return -EIO;
+        memcpy(list->buf + list->len, x, n);
+        list->len += n;
+        at += n;
+    }
+    return 0;
+}
+
+static int xattr_gather_block(struct wfs_ctx *fs, struct wfs_inode *inode, struct xattr_list *list)
+{
+    if (inode->xattr_blk == 0) return 0;
+    struct wfs_xattr_hdr *h = xattr_block(fs, inode->xattr_blk);
+    if (!h || csum_verify(fs, inode->xattr_blk, 1) < 0) return -EIO;
+    return xattr_gather(list, (char *)(h + 1), h->used);
+}
+
+static int xattr_load(struct wfs_ctx *fs, struct wfs_inode *inode, struct xattr_list *list)
+{
+    list->len = 0;
+    int err = xattr_gather(list, xattr_inline(inode), WFS_XATTR_INLINE);
+    return err < 0 ? err : xattr_gather_block(fs, inode, list);
+}
+
+/* The entry called 'name' in 'list', NULL if there is none. */
+static struct wfs_xattr *xattr_find(struct xattr_list *list, const char *name)
+{
+    size_t nlen = strlen(name);
+    for (size_t at = 0; at < list->len; ) {
+        struct wfs_xattr *x = (struct wfs_xattr *)(list->buf + at);
+        if (x->name_len == nlen && memcmp(x + 1, name, nlen) == 0) return x;
+        at += xattr_len(x);
+    }
+    return NULL;
+}
+
+/* Drop one inode's reference to xattr block 'blk', freeing it with the
+ * last one. A damaged block is left to fsck. */
+static void xattr_put(struct wfs_ctx *fs, off_t blk)
+{
+    struct wfs_xattr_hdr *h = xattr_block(fs, blk);
+    if (!h) return;
+    if (--h->refs > 0) {
+        csum_update(fs, h);
+        return;
+    }
+
+    size_t slot = h->hash % WFS_XATTR_CACHE;
+    if (fs->xattr_cache[slot] == blk) fs->xattr_cache[slot] = 0;
+    h->magic = 0;
+    free_block(fs, blk);
+}
+
+/* Point 'inode' at a block holding the 'len' bytes of entries: one already
+ * written with the same entries if the cache knows it, else its own block
+ * rewritten if nobody shares it, else a new one. */
+static int xattr_store(struct wfs_ctx *fs, struct wfs_inode *inode, const char *entries, size_t len)
+{
+    off_t old = inode->xattr_blk, blk;
+    if (len == 0) {
+        inode->xattr_blk = 0;
+        if (old) xattr_put(fs, old);
+        return 0;
+    }
+
+    uint32_t hash = crc32c(0, entries, len);
+    struct wfs_xattr_hdr *h = old ? xattr_block(fs, old) : NULL;
+    if (h && h->hash == hash && h->used == len && memcmp(h + 1, entries, len) == 0) return 0;
+
+    size_t slot = hash % WFS_XATTR_CACHE;
+    struct wfs_xattr_hdr *c = fs->xattr_cache[slot] ? xattr_block(fs, fs->xattr_cache[slot]) : NULL;
+    if (c && c->hash == hash && c->used == len && c->refs < XATTR_MAX_SHARE &&
+        memcmp(c + 1, entries, len) == 0) {
+        blk = fs->xattr_cache[slot];
+        c->refs++;
+        csum_update(fs, c);
+        STAT_INC(fs, xattr_shared);
+    } else {
+        if (h && h->refs == 1) {
+            blk = old;
+            old = 0;
+        } else if ((blk = allocate_data_block(fs, block_goal(fs, inode, 0))) < 0) {
+            return blk;
+        }
+        c = (struct wfs_xattr_hdr *)((char *)fs->mregion + blk);
+        c->magic = WFS_XATTR_MAGIC;
+        c->refs = 1;
+        c->hash = hash;
+        c->used = len;
+        memcpy(c + 1, entries, len);
+        memset((char *)(c + 1) + len, 0, WFS_XATTR_SPACE - len);
+        csum_update(fs, c);
+        fs->xattr_cache[slot] = blk;
+    }
+
+    inode->xattr_blk = blk;
+    if (old) xattr_put(fs, old);
+    return 0;
+}
+
+/* Lay 'list' out again: in order, each entry goes inline if it still fits
+ * and in the block if not. -ENOSPC, with nothing changed, if the block
+ * cannot take the rest. */
+static int xattr_save(struct wfs_ctx *fs, struct wfs_inode *inode, const struct xattr_list *list)
+{
+    char in[WFS_XATTR_INLINE] = {0}, out[WFS_XATTR_SPACE];
+    size_t nin = 0, nout = 0;
+
+    for (size_t at = 0; at < list->len; ) {
+        const struct wfs_xattr *x = (const struct wfs_xattr *)(list->buf + at);
+        size_t n = xattr_len(x);
+        if (nin + n <= sizeof(in)) {
+            memcpy(in + nin, x, n);
+            nin += n;
+        } else if (nout + n <= sizeof(out)) {
+            memcpy(out + nout, x, n);
+            nout += n;
+        } else {
+            return -ENOSPC;
+        }
+        at += n;
+    }
+
+    int err = xattr_store(fs, inode, out, nout);
+    if (err < 0) return err;
+    memcpy(xattr_inline(inode), in, sizeof(in));
+    return 0;
+}
+
+/* A snapshot copy of an inode takes its inline xattrs along and one more
+ * reference to its block. */
+static void xattr_share(struct wfs_ctx *fs, struct wfs_inode *src, struct wfs_inode *copy)
+{
+    memcpy(xattr_inline(copy), xattr_inline(src), WFS_XATTR_INLINE);
+    if (copy->xattr_blk == 0) return;
+
+    pthread_mutex_lock(&fs->xattr_lock);
+    struct wfs_xattr_hdr *h = xattr_block(fs, copy->xattr_blk);
+    if (h && h->refs < UINT32_MAX) {
+        h->refs++;
+        csum_update(fs, h);
+    } else {
+        copy->xattr_blk = 0;
+    }
+    pthread_mutex_unlock(&fs->xattr_lock);
+}
+
+/* ------------------------------- Snapshots -------------------------------- */
+/* A snapshot is a read-only copy of every inode in the tree. File blocks
+ * are not copied: the live pointer and the snapshot's both get BLK_SHARED
+ * and the block a reference in refs[], just like a deduplicated block, so
+ * the first write on either side copies it. 'map' takes each live inode to
+ * its copy, which keeps hard links linked. */
+
+/* The pointer a snapshot of 'src' stores for the block in 'slot'. Plain
+ * blocks are shared. Compressed ones are copied, since unpacking a cluster
+ * frees its blocks outright, and so is a block that can take no more
+ * references. An unwritten block becomes a hole. */
+static int snap_ptr(struct wfs_ctx *fs, struct wfs_inode *src, struct wfs_inode *copy, off_t *slot, off_t *out)
+{
+    pthread_mutex_lock(&fs->dedup_lock);
+    off_t ptr = *slot, blk = blk_addr(ptr);
+    ssize_t n = wfs_block_num(&fs->layout, blk);
+    int share = n >= 0 && !(ptr & (BLK_UNWRITTEN | BLK_COMPRESSED)) && fs->refs[n] < MAX_REFS;
+    if (share) {
+        if (!(ptr & BLK_SHARED)) {
+            set_slot(fs, src, slot, ptr | BLK_SHARED);
+            fs->refs[n] = 1;
+        }
+        fs->refs[n]++;
+        ((struct wfs_sb *)fs->mregion)->state |= WFS_STATE_SHARED;
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+
+    if (share) {
+        *out = blk | BLK_SHARED;
+        return 0;
+    }
+    if (blk == 0 || (ptr & BLK_UNWRITTEN)) {
+        *out = (ptr & BLK_UNWRITTEN) ? 0 : ptr;   // a hole, or a cluster's spare slot
+        return 0;
+    }
+    if (n < 0 || csum_verify(fs, blk, 0) < 0) return -EIO;
+
+    off_t dup = alloc_block(fs, block_goal(fs, copy, 0), 0);
+    if (dup < 0) return -ENOSPC;
+    memcpy((char *)fs->mregion + dup, (char *)fs->mregion + blk, BLOCK_SIZE);
+    csum_update(fs, (char *)fs->mregion + dup);
+    *out = dup | (ptr & BLK_COMPRESSED);
+    return 0;
+}
+
+/* Point the snapshot 'copy' at the blocks of file 'src'; it gets an
+ * indirect block of its own. */
+static int snap_file(struct wfs_ctx *fs, struct wfs_inode *src, struct wfs_inode *copy)
+{
+    for (int i = 0; i < D_BLOCK; i++) {
+        int err = snap_ptr(fs, src, copy, &src->blocks[i], &copy->blocks[i]);
+        if (err < 0) return err;
+    }
+
+    if (src->blocks[IND_SLOT] == 0) return 0;
+    if (csum_verify(fs, src->blocks[IND_SLOT], 1) < 0) return -EIO;
+    off_t ind = allocate_data_block(fs, block_goal(fs, copy, blk_addr(copy->blocks[D_BLOCK - 1])));
+    if (ind < 0) return -ENOSPC;
+    copy->blocks[IND_SLOT] = ind;
+
+    off_t *from = (off_t *)((char *)fs->mregion + src->blocks[IND_SLOT]);
+    off_t *to = (off_t *)((char *)fs->mregion + ind);
+    int err = 0;
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(off_t) && err == 0; i++)
+        err = snap_ptr(fs, src, copy, &from[i], &to[i]);
+    csum_update(fs, to);
+    return err;
+}
+
+static int snap_symlink(struct wfs_ctx *fs, struct wfs_inode *src, struct wfs_inode *copy)
+{
+    char target[PATH_MAX];
+    int err = wfs_read_symlink(fs, src->num, target, sizeof(target));
+    if (err < 0) return err;
+    return write_inode_data(fs, copy, target, copy->size, 0);
+}
+
+/* Drop one link to 'inode' in a snapshot, and the inode with its last
+ * one; a directory takes everything below it along. */
+static void snap_drop(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    if (S_ISDIR(inode->mode)) {
+        int err = 0;
+        for (int i = 0; i < D_BLOCK; i++) {
+            struct wfs_dentry *ents = dir_block(fs, inode, i, &err);
+            if (!ents) continue;   // a bad block leaves its inodes to fsck
+            for (size_t j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+                struct wfs_inode *child = ents[j].num ? retrieve_inode(fs, ents[j].num) : NULL;
+                if (child && (child->flags & WFS_INODE_SNAPSHOT)) snap_drop(fs, child);
+            }
+        }
+    } else if (--inode->nlinks > 0) {
+        return;
+    }
+    free_inode_data(fs, inode);
+    free_inode(fs, inode);
+}
+
+/* How many inodes a snapshot of 'inode' and everything below it takes,
+ * marking each in 'map' so a hard-linked file counts once. */
+static size_t snap_count(struct wfs_ctx *fs, int *map, struct wfs_inode *inode)
+{
+    if (map[inode->num]) return 0;
+    map[inode->num] = 1;
+    size_t n = 1;
+    if (!S_ISDIR(inode->mode)) return n;
+
+    int err = 0;
+    for (int i = 0; i < D_BLOCK; i++) {
+        struct wfs_dentry *ents = dir_block(fs, inode, i, &err);
+        if (!ents) continue;   // snap_dir reports it
+        for (size_t j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+            struct wfs_inode *child = ents[j].num ? retrieve_inode(fs, ents[j].num) : NULL;
+            if (child && !(child->flags & WFS_INODE_SNAPSHOT)) n += snap_count(fs, map, child);
+        }
+    }
+    return n;
+}
+
+static int snap_inode(struct wfs_ctx *fs, int *map, struct wfs_inode *src, struct wfs_inode *parent);
+
+/* Copy the entries of directory 'src' into its snapshot 'copy', leaving
+ * out /.snapshots (and anything else already read-only). */
+static int snap_dir(struct wfs_ctx *fs, int *map, struct wfs_inode *src, struct wfs_inode *copy)
+{
+    int err = 0;
+    for (int i = 0; i < D_BLOCK; i++) {
+        struct wfs_dentry *ents = dir_block(fs, src, i, &err);
+        if (err) return err;
+        if (!ents) continue;
+
+        for (size_t j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+            if (ents[j].num == 0 || ents[j].name[0] == '\0') continue;
+            struct wfs_inode *child = retrieve_inode(fs, ents[j].num);
+            if (!child || (child->flags & WFS_INODE_SNAPSHOT)) continue;
+
+            char name[MAX_NAME];
+            snprintf(name, sizeof(name), "%s", ents[j].name);
+            int num = snap_inode(fs, map, child, copy);
+            if (num < 0) return num;
+            if ((err = add_dentry(fs, copy, num, name)) != 0) {
+                snap_drop(fs, retrieve_inode(fs, num));
+                return err < 0 ? err : -EINVAL;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Snapshot inode 'src' into directory 'parent'; returns the copy's number
+ * with one link counted for the entry the caller is about to add. */
+static int snap_inode(struct wfs_ctx *fs, int *map, struct wfs_inode *src, struct wfs_inode *parent)
+{
+    if (map[src->num]) {
+        struct wfs_inode *copy = retrieve_inode(fs, map[src->num]);
+        copy->nlinks++;
+        return copy->num;
+    }
+
+    struct wfs_lazy_times t = current_times(fs, src);
+    struct wfs_inode *copy = allocate_inode(fs, parent, S_ISDIR(src->mode));
+    if (!copy) return -ENOSPC;
+    int num = copy->num;
+
+    *copy = *src;
+    copy->num = num;
+    copy->nlinks = 1;
+    copy->next_orphan = 0;
+    copy->flags |= WFS_INODE_SNAPSHOT;
+    xattr_share(fs, src, copy);
+    if (!inline_symlink(src))
+        memset(copy->blocks, 0, sizeof(copy->blocks));
+    if (S_ISDIR(src->mode))
+        copy->size = 0;
+    map[src->num] = num;
+
+    int err = 0;
+    if (S_ISREG(src->mode)) {
+        // a write to the file lands wholly before or after the snapshot
+        unsigned *seq = seq_write_begin(fs, src);
+        err = snap_file(fs, src, copy);
+        seq_write_end(seq);
+    } else if (S_ISDIR(src->mode))
+        err = snap_dir(fs, map, src, copy);
+    else if (S_ISLNK(src->mode) && !inline_symlink(src))
+        err = snap_symlink(fs, src, copy);
+    if (err < 0) {
+        snap_drop(fs, copy);
+        return err;
+    }
+
+    // adding entries stamped the directory
+    stamp(copy, T_ATIME, t.atim);
+    stamp(copy, T_CTIME, t.ctim);
+    stamp(copy, T_MTIME, t.mtim);
+    return num;
+}
+
+/* /.snapshots, made on first use if 'create'. A directory of that name
+ * that is not the snapshot directory is -EEXIST. */
+static struct wfs_inode *snapshot_dir(struct wfs_ctx *fs, int create, int *err)
+{
+    struct wfs_inode *root = retrieve_inode(fs, 0);
+    int num = dentry_to_num(fs, WFS_SNAPSHOT_DIR, root);
+    if (num >= 0) {
+        struct wfs_inode *dir = retrieve_inode(fs, num);
+        if (dir && S_ISDIR(dir->mode) && (dir->flags & WFS_INODE_SNAPSHOT)) return dir;
+        *err = -EEXIST;
+        return NULL;
+    }
+    if (num != -ENOENT || !create) {
+        *err = num;
+        return NULL;
+    }
+
+    struct wfs_inode *dir = allocate_inode(fs, root, 1);
+    if (!dir) {
+        *err = -ENOSPC;
+        return NULL;
+    }
+    fillin_inode(dir, S_IFDIR | 0555);
+    dir->flags = WFS_INODE_SNAPSHOT;
+
+    char name[] = WFS_SNAPSHOT_DIR;
+    if ((*err = add_dentry(fs, root, dir->num, name)) != 0) {
+        free_inode(fs, dir);
+        if (*err > 0) *err = -EINVAL;
+        return NULL;
+    }
+    return dir;
+}
+
+/* ---------------------------- Defragmentation ----------------------------- */
+/* A file is in one piece when its blocks follow each other on disk in file
+ * order, the indirect block in its place after the direct ones, as writes
+ * and mkfs -r lay them out. Holes break nothing. Moving a file copies its
+ * blocks into one free run and then switches the pointers, all while the
+ * file's sequence count is odd, so readers start over rather than see it
+ * half moved; a crash in between leaves the old blocks in use and the run
+ * leaked. Compressed clusters and shared blocks stay where they are. */
+
+#define FILE_BLOCKS (D_BLOCK + BLOCK_SIZE / sizeof(off_t) + 1)
+
+/* The slots of 'inode' that point at a block, in file order. Sets *pinned
+ * if a block can't be moved. Returns how many, or -EIO for an indirect
+ * block that fails its checksum. */
+static int file_slots(struct wfs_ctx *fs, struct wfs_inode *inode, off_t *slots[FILE_BLOCKS], int *pinned)
+{
+    int n = 0;
+    *pinned = 0;
+    for (int i = 0; i <= IND_SLOT; i++) {
+        *pinned |= (inode->blocks[i] & (BLK_COMPRESSED | BLK_SHARED)) != 0;
+        if (blk_addr(inode->blocks[i])) slots[n++] = &inode->blocks[i];
+    }
+    off_t ind = inode->blocks[IND_SLOT];
+    if (ind == 0) return n;
+    if (wfs_block_num(&fs->layout, ind) < 0 || csum_verify(fs, ind, 1) < 0) return -EIO;
+
+    off_t *indirect = (off_t *)((char *)fs->mregion + ind);
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+        *pinned |= (indirect[i] & (BLK_COMPRESSED | BLK_SHARED)) != 0;
+        if (blk_addr(indirect[i])) slots[n++] = &indirect[i];
+    }
+    return n;
+}
+
+static size_t count_fragments(off_t *slots[], int n)
+{
+    size_t frags = n > 0;
+    for (int i = 1; i < n; i++)
+        frags += blk_addr(*slots[i]) != blk_addr(*slots[i - 1]) + BLOCK_SIZE;
+    return frags;
+}
+
+/* Take 'n' free data blocks in a row, the first run of them in group 'g'
+ * or after it. Returns the first one's offset, or -ENOSPC if no group has
+ * such a run. */
+static off_t alloc_contig(struct wfs_ctx *fs, uint32_t start, int n)
+{
+    struct wfs_layout *l = &fs->layout;
+    for (uint32_t k = 0; k < l->num_groups; k++) {
+        uint32_t g = (start + k) % l->num_groups;
+        group_load(fs, g, GROUP_COUNTED);
+        if (__atomic_load_n(&l->groups[g].free_blocks, __ATOMIC_RELAXED) < (uint32_t)n) continue;
+
+        uint32_t *map = group_dmap(fs, g);
+        size_t end = wfs_group_blocks(l, g), run = 0;
+        pthread_mutex_lock(&fs->group_locks[g]);
+        for (size_t i = 0; i < end; i++) {
+            if (i % 32 == 0) {
+                STAT_INC(fs, bitmap_words);
+                if (map[i / 32] == ~0u) {   // a full word ends any run
+                    run = 0;
+                    i += 31;
+                    continue;
+                }
+            }
+            run = (map[i / 32] >> (i % 32)) & 1 ? 0 : run + 1;
+            if (run < (size_t)n) continue;
+
+            size_t first = i + 1 - n;
+            for (size_t j = first; j <= i; j++)
+                map[j / 32] |= 1u << (j % 32);
+            l->groups[g].free_blocks -= n;
+            fs->group_gen[g]++;
+            pthread_mutex_unlock(&fs->group_locks[g]);
+            STAT_ADD(fs, blocks_allocated, n);
+            return wfs_block_off(l, (size_t)g * l->blocks_per_group + first);
+        }
+        pthread_mutex_unlock(&fs->group_locks[g]);
+    }
+    return -ENOSPC;
+}
+
+/* Move the 'n' blocks in 'slots' of 'inode' to the run at 'to', leaving
+ * the blocks it moved them from in 'old' for the caller to free once the
+ * file's sequence count is even again. Returns how many moved: 0 if one
+ * of them was shared meanwhile. */
+static int move_file(struct wfs_ctx *fs, struct wfs_inode *inode, off_t *slots[], int n, off_t to, off_t old[])
+{
+    off_t fresh[FILE_BLOCKS];
+    off_t *ind = &inode->blocks[IND_SLOT], *new_ind = NULL;
+    for (int i = 0; i < n; i++) {
+        old[i] = blk_addr(*slots[i]);
+        fresh[i] = to + (off_t)i * BLOCK_SIZE;
+        if (slots[i] == ind)
+            new_ind = (off_t *)((char *)fs->mregion + fresh[i]);
+        if (*slots[i] & BLK_UNWRITTEN) continue;
+        if (slots[i] != ind && csum_verify(fs, old[i], 0) < 0) {
+            free_blocks(fs, fresh, n);
+            return -EIO;
+        }
+        memcpy((char *)fs->mregion + fresh[i], (char *)fs->mregion + old[i], BLOCK_SIZE);
+        csum_update(fs, (char *)fs->mregion + fresh[i]);
+    }
+
+    // only a dedup merge, under dedup_lock, can share a block of the file
+    // now; the indirect entries go into the new indirect block
+    pthread_mutex_lock(&fs->dedup_lock);
+    for (int i = 0; i < n; i++) {
+        if (*slots[i] & BLK_SHARED) {
+            pthread_mutex_unlock(&fs->dedup_lock);
+            free_blocks(fs, fresh, n);
+            return 0;
+        }
+    }
+    off_t *old_ind = new_ind ? (off_t *)((char *)fs->mregion + *ind) : NULL;
+    for (int i = 0; i < n; i++) {
+        if (slots[i] == ind) continue;
+        int direct = (uintptr_t)slots[i] - (uintptr_t)inode->blocks < sizeof(inode->blocks);
+        off_t *slot = direct ? slots[i] : new_ind + (slots[i] - old_ind);
+        *slot = fresh[i] | (*slots[i] & BLK_FLAGS);
+    }
+    if (new_ind) {
+        csum_update(fs, new_ind);
+        *ind = (char *)new_ind - (char *)fs->mregion;
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+    return n;
+}
+
+/* Every 'defrag_interval' seconds, try every file in turn. Each one is
+ * moved under grow_lock, so wfs_grow waits for it. */
+static void *defragger(void *arg)
+{
+    struct wfs_ctx *fs = arg;
+
+    pthread_mutex_lock(&fs->defrag_lock);
+    while (!fs->defrag_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += fs->defrag_interval;
+        while (!fs->defrag_stop &&
+               pthread_cond_timedwait(&fs->defrag_wake, &fs->defrag_lock, &until) != ETIMEDOUT)
+            ;
+        if (fs->defrag_stop) break;
+        pthread_mutex_unlock(&fs->defrag_lock);
+
+        for (size_t inum = 1; !__atomic_load_n(&fs->defrag_stop, __ATOMIC_RELAXED); inum++) {
+            pthread_rwlock_rdlock(&fs->grow_lock);
+            int more = inum < fs->layout.num_inodes;
+            if (more) wfs_defrag_file(fs, inum);
+            pthread_rwlock_unlock(&fs->grow_lock);
+            if (!more) break;
+        }
+        pthread_mutex_lock(&fs->defrag_lock);
+    }
+    pthread_mutex_unlock(&fs->defrag_lock);
+    return NULL;
+}
+
+/* -------------------------------- Growing --------------------------------- */
+/* An image grows at its end, by filling up the last group's data blocks
+ * and adding groups laid out like group 0, group_stride apart. That takes
+ * an image whose groups are all spaced that way (every mkfs image is) and
+ * room for their descriptors before first_group. The checksum area always
+ * follows the last group, so it moves to the new end first; the new
+ * groups then grow over where it was. */
+
+// group 'g' of an evenly spaced image, empty
+static struct wfs_group_desc group_at(const struct wfs_sb *sb, uint32_t g)
+{
+    struct wfs_group_desc d = sb->groups[0];
+    off_t shift = (off_t)g * sb->group_stride;
+    d.i_bitmap_ptr += shift;
+    d.d_bitmap_ptr += shift;
+    d.i_blocks_ptr += shift;
+    d.d_blocks_ptr += shift;
+    d.free_inodes = sb->inodes_per_group;
+    d.free_blocks = sb->blocks_per_group;
+    return d;
+}
+
+static int evenly_spaced(const struct wfs_sb *sb)
+{
+    for (uint32_t g = 1; g < sb->num_groups; g++) {
+        struct wfs_group_desc d = group_at(sb, g);
+        const struct wfs_group_desc *gd = &sb->groups[g];
+        if (gd->i_bitmap_ptr != d.i_bitmap_ptr || gd->d_bitmap_ptr != d.d_bitmap_ptr ||
+            gd->i_blocks_ptr != d.i_blocks_ptr || gd->d_blocks_ptr != d.d_blocks_ptr)
+            return 0;
+    }
+    return 1;
+}
+
+/* Make the per-block and per-inode tables kept in memory big enough for
+ * 'blocks' and 'inodes', and 'groups' fresh group locks in *locks. */
+static int grow_tables(struct wfs_ctx *fs, size_t blocks, size_t inodes, uint32_t groups,
+                       pthread_mutex_t **locks)
+{
+    struct wfs_layout *l = &fs->layout;
+    if (fs->verified) {
+        size_t was = (l->num_data_blocks + 63) / 64, now = (blocks + 63) / 64;
+        uint64_t *v = realloc(fs->verified, now * sizeof(uint64_t));
+        if (!v) return -ENOMEM;
+        memset(v + was, 0, (now - was) * sizeof(uint64_t));
+        fs->verified = v;
+    }
+    if (fs->refs) {
+        uint16_t *r = realloc(fs->refs, blocks * sizeof(uint16_t));
+        if (!r) return -ENOMEM;
+        memset(r + l->num_data_blocks, 0, (blocks - l->num_data_blocks) * sizeof(uint16_t));
+        fs->refs = r;
+    }
+    unsigned *seq = realloc(fs->inode_seq, inodes * sizeof(unsigned));
+    if (!seq) return -ENOMEM;
+    memset(seq + l->num_inodes, 0, (inodes - l->num_inodes) * sizeof(unsigned));
+    fs->inode_seq = seq;
+    for (int c = WFS_COLOR_NONE + 1; c < WFS_COLOR_MAX; c++) {
+        size_t was = (l->num_inodes + 63) / 64, now = (inodes + 63) / 64;
+        uint64_t *bits = realloc(fs->colored[c], now * sizeof(uint64_t));
+        if (!bits) return -ENOMEM;
+        memset(bits + was, 0, (now - was) * sizeof(uint64_t));
+        fs->colored[c] = bits;
+    }
+    uint8_t *state = realloc(fs->group_state, groups);
+    if (!state) return -ENOMEM;
+    memset(state + l->num_groups, 0, groups - l->num_groups);
+    fs->group_state = state;
+    unsigned *gen = realloc(fs->group_gen, groups * sizeof(unsigned));
+    if (!gen) return -ENOMEM;
+    memset(gen + l->num_groups, 0, (groups - l->num_groups) * sizeof(unsigned));
+    fs->group_gen = gen;
+
+    if (!(*locks = calloc(groups, sizeof(pthread_mutex_t)))) return -ENOMEM;
+    for (uint32_t g = 0; g < groups; g++)
+        pthread_mutex_init(&(*locks)[g], NULL);
+    return 0;
+}
+
+/* Lay out groups [from, to) and the checksum area behind them in the
+ * mapping at 'base', which already has room for them all. */
+static void grow_layout(struct wfs_ctx *fs, void *base, uint32_t from, uint32_t to, size_t blocks, off_t csum)
+{
+    struct wfs_sb *sb = base;
+    size_t bpg = sb->blocks_per_group, old_blocks = sb->num_data_blocks;
+
+    if (fs->layout.csum_ptr) {
+        memmove((char *)base + csum, (char *)base + fs->layout.csum_ptr, old_blocks * sizeof(uint32_t));
+        memset((char *)base + csum + old_blocks * sizeof(uint32_t), 0,
+               (blocks - old_blocks) * sizeof(uint32_t));
+    }
+
+    // the old last group's bitmap was only ever used up to its old size
+    uint32_t *map = (uint32_t *)((char *)base + sb->groups[from - 1].d_bitmap_ptr);
+    size_t end = to > from ? bpg : blocks - (size_t)(from - 1) * bpg;
+    for (size_t k = old_blocks - (size_t)(from - 1) * bpg; k < end; k++)
+        map[k / 32] &= ~(1u << (k % 32));
+
+    for (uint32_t g = from; g < to; g++) {
+        struct wfs_group_desc d = group_at(sb, g);
+        memset((char *)base + d.i_bitmap_ptr, 0, d.d_blocks_ptr - d.i_bitmap_ptr);
+        sb->groups[g] = d;
+    }
+    sb->num_groups = to;
+    sb->num_inodes = (size_t)to * sb->inodes_per_group;
+    sb->num_data_blocks = blocks;
+}
+
+/* ------------------------------- Public API ------------------------------- */
+/* Flip the superblock's clean flag and push it out before going on. Images
+ * from before the flag existed have no magic and are left alone. The free
+ * counts are vouched for along with it if every group's were loaded. */
+static void set_clean(struct wfs_ctx *fs, int clean)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)fs->mregion;
+    if (sb->magic != WFS_MAGIC && sb->magic != WFS_MAGIC_V1) return;
+
+    if (clean)
+        sb->state |= WFS_STATE_CLEAN | (groups_counted(fs) ? WFS_STATE_COUNTED : 0);
+    else
+        sb->state &= ~(WFS_STATE_CLEAN | WFS_STATE_COUNTED);
+    msync(fs->mregion, sizeof(*sb), MS_SYNC);
+}
+
+struct wfs_ctx *wfs_open_image(const char *path)
+{
+    struct wfs_ctx *fs = calloc(1, sizeof(struct wfs_ctx));
+    if (!fs) return NULL;
+
+    // open the file
+    if ((fs->fd = open(path, O_RDWR, 0666)) < 0) {
+        free(fs);
+        return NULL;
+    }
+
+    // stat so we know how large the mmap needs to be
+    struct stat sb;
+    if (fstat(fs->fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct wfs_sb)) {
+        close(fs->fd);
+        free(fs);
+        errno = EINVAL;
+        return NULL;
+    }
+    fs->size = sb.st_size;
+
+    // setup mmap
+    fs->mregion = mmap(NULL, fs->size, PROT_READ | PROT_WRITE, MAP_SHARED, fs->fd, 0);
+    if (fs->mregion == MAP_FAILED) {
+        close(fs->fd);
+        free(fs);
+        return NULL;
+    }
+
+    // an image without a root directory was never formatted
+    if (wfs_layout_init(&fs->layout, fs->mregion, fs->size) < 0 ||
+        !(fs->group_locks = calloc(fs->layout.num_groups, sizeof(pthread_mutex_t))) ||
+        !(fs->group_state = calloc(fs->layout.num_groups, sizeof(uint8_t))) ||
+        !(fs->group_gen = calloc(fs->layout.num_groups, sizeof(unsigned))) ||
+        !(fs->inode_seq = calloc(fs->layout.num_inodes, sizeof(unsigned))) ||
+        (fs->layout.csum_ptr &&
+         !(fs->verified = calloc((fs->layout.num_data_blocks + 63) / 64, sizeof(uint64_t)))) ||
+        retrieve_inode(fs, 0) == NULL || color_index(fs) < 0) {
+        free(fs->group_locks);
+        free(fs->group_state);
+        free(fs->group_gen);
+        free(fs->inode_seq);
+        free(fs->verified);
+        for (int c = 0; c < WFS_COLOR_MAX; c++)
+            free(fs->colored[c]);
+        munmap(fs->mregion, fs->size);
+        close(fs->fd);
+        free(fs);
+        errno = EINVAL;
+        return NULL;
+    }
+    struct wfs_sb *super = (struct wfs_sb *)fs->mregion;
+    int counted = (super->magic == WFS_MAGIC || super->magic == WFS_MAGIC_V1) && (super->state & WFS_STATE_COUNTED);
+    for (uint32_t g = 0; g < fs->layout.num_groups; g++) {
+        pthread_mutex_init(&fs->group_locks[g], NULL);
+        fs->group_state[g] = counted ? GROUP_COUNTED : 0;
+    }
+    if (fs->layout.csum_ptr)
+        fs->csums = (uint32_t *)((char *)fs->mregion + fs->layout.csum_ptr);
+    pthread_mutex_init(&fs->orphan_lock, NULL);
+    pthread_cond_init(&fs->orphan_more, NULL);
+    pthread_mutex_init(&fs->lazy_lock, NULL);
+    pthread_mutex_init(&fs->dedup_lock, NULL);
+    pthread_mutex_init(&fs->snapshot_lock, NULL);
+    pthread_mutex_init(&fs->namespace_lock, NULL);
+    pthread_rwlock_init(&fs->grow_lock, NULL);
+    pthread_mutex_init(&fs->defrag_lock, NULL);
+    pthread_cond_init(&fs->defrag_wake, NULL);
+    pthread_mutex_init(&fs->xattr_lock, NULL);
+    cluster_forget();   // another ctx may have had this address
+    if (((struct wfs_sb *)fs->mregion)->state & WFS_STATE_SHARED)
+        count_shared(fs);
+
+    // dirty until closed, so a crash leaves a mark for fsck
+    set_clean(fs, 0);
+    return fs;
+}
+
+void wfs_close_image(struct wfs_ctx *fs)
+{
+    if (!fs) return;
+
+    stop_loaders(fs);
+    pthread_mutex_lock(&fs->defrag_lock);
+    fs->defrag_stop = 1;
+    pthread_cond_signal(&fs->defrag_wake);
+    pthread_mutex_unlock(&fs->defrag_lock);
+    if (fs->defragging)
+        pthread_join(fs->defragger, NULL);
+
+    // the reclaimer drains the orphan list before it exits
+    pthread_mutex_lock(&fs->orphan_lock);
+    if (fs->reclaiming) {
+        fs->reclaim_stop = 1;
+        pthread_cond_signal(&fs->orphan_more);
+        pthread_mutex_unlock(&fs->orphan_lock);
+        pthread_join(fs->reclaimer, NULL);
+    } else {
+        // left over from a crash, with nobody started to take care of it
+        if (((struct wfs_sb *)fs->mregion)->magic == WFS_MAGIC)
+            while (reclaim_one(fs))
+                ;
+        pthread_mutex_unlock(&fs->orphan_lock);
+    }
+
+    pthread_mutex_lock(&fs->lazy_lock);
+    if (fs->lazy) lazy_flush(fs);
+    pthread_mutex_unlock(&fs->lazy_lock);
+
+    msync(fs->mregion, fs->size, MS_SYNC);
+    set_clean(fs, 1);
+    munmap(fs->mregion, fs->size);
+    close(fs->fd);
+    for (uint32_t g = 0; g < fs->layout.num_groups; g++)
+        pthread_mutex_destroy(&fs->group_locks[g]);
+    free(fs->group_locks);
+    free(fs->group_state);
+    free(fs->group_gen);
+    pthread_mutex_destroy(&fs->orphan_lock);
+    pthread_cond_destroy(&fs->orphan_more);
+    pthread_mutex_destroy(&fs->lazy_lock);
+    free(fs->lazy);
+    pthread_mutex_destroy(&fs->dedup_lock);
+    pthread_mutex_destroy(&fs->snapshot_lock);
+    pthread_mutex_destroy(&fs->namespace_lock);
+    pthread_rwlock_destroy(&fs->grow_lock);
+    pthread_mutex_destroy(&fs->defrag_lock);
+    pthread_cond_destroy(&fs->defrag_wake);
+    pthread_mutex_destroy(&fs->xattr_lock);
+    free(fs->refs);
+    free(fs->fingerprints);
+    free(fs->verified);
+    free(fs->inode_seq);
+    for (int c = 0; c < WFS_COLOR_MAX; c++)
+        free(fs->colored[c]);
+    free(fs);
+}
+
+int wfs_sync(struct wfs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->lazy_lock);
+    if (fs->lazy) lazy_flush(fs);
+    pthread_mutex_unlock(&fs->lazy_lock);
+
+    return msync(fs->mregion, fs->size, MS_SYNC) < 0 ? -errno : 0;
+}
+
+int wfs_lookup(struct wfs_ctx *fs, const char *path, int *inum)
+{
+    struct wfs_inode *inode;
+    int err = get_inode_from_path(fs, path, &inode);
+    if (err < 0) return err;
+
+    *inum = inode->num;
+    return 0;
+}
+
+// data blocks a file really takes up, which compression makes fewer than its size
+static blkcnt_t stored_blocks(struct wfs_ctx *fs, struct wfs_inode *inode)
+{
+    blkcnt_t n = 0;
+    off_t prev;
+    for (off_t b = 0; b * BLOCK_SIZE < inode->size; b++) {
+        off_t *slot = block_slot(fs, inode, b, 0, &prev);
+        if (slot && blk_addr(*slot)) n++;
+    }
+    return n + (inode->blocks[IND_SLOT] != 0);
+}
+
+int wfs_stat(struct wfs_ctx *fs, int inum, struct stat *st)
+{
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+
+    unsigned seq;
+    do {
+        seq = seq_read_begin(fs, inode);
+        memset(st, 0, sizeof(*st)); // st fields default value is 0
+        st->st_ino = inode->num;
+        st->st_mode = inode->mode;
+        st->st_nlink = inode->nlinks;
+        st->st_uid = inode->uid;
+        st->st_gid = inode->gid;
+        st->st_size = inode->size;
+        st->st_blocks = (inode->size + 511) / 512;
+        if (inode->flags & WFS_INODE_COMPRESS)
+            st->st_blocks = stored_blocks(fs, inode) * (BLOCK_SIZE / 512);
+    } while (seq_read_retry(fs, inode, seq));
+
+    struct wfs_lazy_times t = current_times(fs, inode);
+    st->st_atim = t.atim;
+    st->st_mtim = t.mtim;
+    st->st_ctim = t.ctim;
+
+    return 0;
+}
+
+ssize_t wfs_pread(struct wfs_ctx *fs, int inum, void *out, size_t len, off_t off)
+{
+    op_clock();
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+
+    // Directories can not be read
+    if (S_ISDIR(inode->mode))
+        return -EISDIR;
+
+    ssize_t done;
+    for (;;) {
+        unsigned seq = seq_read_begin(fs, inode);
+        done = read_inode_data(fs, inode, out, len, off, seq);
+        if (!seq_read_retry(fs, inode, seq)) break;
+        // a cluster decoded from a half-written file must not be served again
+        if (inode->flags & WFS_INODE_COMPRESS) cluster_forget();
+    }
+
+    if (done > 0)
+        touch_atime(fs, inode);
+
+    return done;
+}
+
+ssize_t wfs_pwrite(struct wfs_ctx *fs, int inum, const void *buf, size_t len, off_t off)
+{
+    op_clock();
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+
+    // Directories can not be written to
+    if (S_ISDIR(inode->mode))
+        return -EISDIR;
+    if (inode->flags & WFS_INODE_SNAPSHOT)
+        return -EROFS;
+
+    // a zero-length write must not move the size past the allocated blocks
+    if (len == 0)
+        return 0;
+    // nothing of it fits: the file is too large, not the image full
+    if (off >= WFS_MAX_FILE)
+        return -EFBIG;
+    // a write running past the largest file stops short at its end
+    if ((off_t)len > WFS_MAX_FILE - off)
+        len = WFS_MAX_FILE - off;
+
+    unsigned *seq = seq_write_begin(fs, inode);
+    int err = write_inode_data(fs, inode, buf, len, off);
+    if (err < 0) {
+        seq_write_end(seq);
+        return err;
+    }
+
+    // Update file size; an overwrite only changes timestamps
+    off_t end = off + (off_t)len;
+    if (end > inode->size) {
+        inode->size = end;
+        touch(fs, inode, T_MTIME | T_CTIME);
+    } else {
+        touch_lazy(fs, inode, T_MTIME | T_CTIME);
+    }
+
+    if (inode->flags & WFS_INODE_COMPRESS)
+        pack_range(fs, inode, off, len);
+    else
+        dedup_range(fs, inode, off, len);
+    seq_write_end(seq);
+
+    return len;
+}
+
+int wfs_iterate(struct wfs_ctx *fs, int inum, wfs_dir_cb cb, void *arg)
+{
+    op_clock();
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+
+    if (!S_ISDIR(inode->mode))
+        return -ENOTDIR;
+
+    size_t n_ents = BLOCK_SIZE / sizeof(struct wfs_dentry);
+
+    // Iterate all dentry blocks
+    int err = 0;
+    for (int i = 0; i < D_BLOCK; i++) {
+        struct wfs_dentry *ents = dir_block(fs, inode, i, &err);
+        if (err) return err;
+        if (!ents) continue;
+
+        STAT_ADD(fs, dentry_scanned, n_ents);
+
+        for (size_t j = 0; j < n_ents; j++) {
+
+            if (ents[j].num == 0 || ents[j].name[0] == '\0')
+                continue;
+
+            if (!retrieve_inode(fs, ents[j].num))
+                continue;
+
+            if (cb(arg, ents[j].name, ents[j].num) != 0)
+                break;
+        }
+    }
+
+    touch_atime(fs, inode);
+    return 0;
+}
+
+/* Entries are read without a lock, but every change to a directory's
+ * entries happens under namespace_lock, so two of them never pick the
+ * same free slot or act on the same name at once. */
+static int create(struct wfs_ctx *fs, const char *path, mode_t mode)
+{
+    struct wfs_inode *parent;
+    char name[MAX_NAME];
+    int err = lookup_parent(fs, path, &parent, name);
+    if (err < 0) return err;
+    if (parent->flags & WFS_INODE_SNAPSHOT) return -EROFS;
+
+    // Check if it already exists
+    if (dentry_to_num(fs, name, parent) >= 0) return -EEXIST;
+    if (reserved_name(parent, name)) return -EPERM;
+
+    struct wfs_inode *inode = allocate_inode(fs, parent, S_ISDIR(mode));
+    if (!inode) return -ENOSPC;
+
+    fillin_inode(inode, mode);
+    inode->size = 0;
+    if ((fs->compress_new || (parent->flags & WFS_INODE_COMPRESS)) && (S_ISREG(mode) || S_ISDIR(mode)))
+        inode->flags |= WFS_INODE_COMPRESS;
+    err = add_dentry(fs, parent, inode->num, name);
+    if (err != 0) {
+        free_inode(fs, inode);
+        return err < 0 ? err : -EINVAL;
+    }
+    return inode->num;
+}
+
+int wfs_create(struct wfs_ctx *fs, const char *path, mode_t mode)
+{
+    op_clock();
+    pthread_mutex_lock(&fs->namespace_lock);
+    int rc = create(fs, path, mode);
+    pthread_mutex_unlock(&fs->namespace_lock);
+    return rc;
+}
+
+static int remove_path(struct wfs_ctx *fs, const char *path)
+{
+    if (strcmp(path, "/") == 0) return -EPERM;
+
+    struct wfs_inode *parent;
+    char name[MAX_NAME];
+    int err = lookup_parent(fs, path, &parent, name);
+    if (err < 0) return err;
+    if (parent->flags & WFS_INODE_SNAPSHOT) return -EROFS;
+
+    int num = dentry_to_num(fs, name, parent);
+    if (num < 0) return num;
+
+    struct wfs_inode *inode = retrieve_inode(fs, num);
+    if (!inode) return -ENOENT;
+
+    // removing a populated directory would orphan everything below it
+    if (S_ISDIR(inode->mode) && !dir_is_empty(fs, inode)) return -ENOTEMPTY;
+
+    // remove entry from the parent
+    err = remove_dentry_name(fs, parent, name);
+    if (err < 0) return err;
+
+    if (S_ISDIR(inode->mode)) {
+        // Free data blocks of the directory and the inode itself
+        release_inode(fs, inode);
+    } else {
+        // the file's blocks and inode go away with its last link
+        drop_link(fs, inode);
+    }
+    return 0;
+}
+
+int wfs_remove(struct wfs_ctx *fs, const char *path)
+{
+    op_clock();
+    pthread_mutex_lock(&fs->namespace_lock);
+    int rc = remove_path(fs, path);
+    pthread_mutex_unlock(&fs->namespace_lock);
+    return rc;
+}
+
+int wfs_move(struct wfs_ctx *fs, const char *from, const char *to, unsigned int flags)
+{
+    op_clock();
+    pthread_mutex_lock(&fs->namespace_lock);
+    int rc = rename_dentry(fs, from, to, flags);
+    pthread_mutex_unlock(&fs->namespace_lock);
+    return rc;
+}
+
+static int hardlink(struct wfs_ctx *fs, const char *from, const char *to)
+{
+    struct wfs_inode *inode;
+    int err = get_inode_from_path(fs, from, &inode);
+    if (err < 0) return err;
+
+    // no hard links to directories, same as every other unix filesystem
+    if (S_ISDIR(inode->mode)) return -EPERM;
+
+    struct wfs_inode *parent;
+    char name[MAX_NAME];
+    err = lookup_parent(fs, to, &parent, name);
+    if (err < 0) return err;
+
+    // a snapshot's files stay in the snapshot, and it takes no new ones
+    if ((inode->flags | parent->flags) & WFS_INODE_SNAPSHOT) return -EROFS;
+    if (reserved_name(parent, name)) return -EPERM;
+
+    err = add_dentry(fs, parent, inode->num, name);
+    if (err != 0) return err < 0 ? err : -EINVAL;
+
+    inode->nlinks++;
+    touch(fs, inode, T_CTIME);
+    return 0;
+}
+
+int wfs_hardlink(struct wfs_ctx *fs, const char *from, const char *to)
+{
+    op_clock();
+    pthread_mutex_lock(&fs->namespace_lock);
+    int rc = hardlink(fs, from, to);
+    pthread_mutex_unlock(&fs->namespace_lock);
+    return rc;
+}
+
+static int make_symlink(struct wfs_ctx *fs, const char *target, const char *path)
+{
+    size_t len = strlen(target);
+    if (len >= PATH_MAX) return -ENAMETOOLONG;
+
+    struct wfs_inode *parent;
+    char name[MAX_NAME];
+    int err = lookup_parent(fs, path, &parent, name);
+    if (err < 0) return err;
+    if (parent->flags & WFS_INODE_SNAPSHOT) return -EROFS;
+    if (reserved_name(parent, name)) return -EPERM;
+
+    struct wfs_inode *inode = allocate_inode(fs, parent, 0);
+    if (!inode) return -ENOSPC;
+
+    fillin_inode(inode, S_IFLNK | 0777);
+    inode->size = len;
+
+    if (inline_symlink(inode)) {
+      memcpy(inode->blocks, target, len);
+    } else if ((err = write_inode_data(fs, inode, target, len, 0)) < 0) {
+      free_inode_data(fs, inode);
+      free_inode(fs, inode);
+      return err;
+    }
+
+    err = add_dentry(fs, parent, inode->num, name);
+    if (err != 0) {
+      free_inode_data(fs, inode);
+      free_inode(fs, inode);
+      return err < 0 ? err : -EINVAL;
+    }
+    return 0;
+}
+
+int wfs_make_symlink(struct wfs_ctx *fs, const char *target, const char *path)
+{
+    op_clock();
+    pthread_mutex_lock(&fs->namespace_lock);
+    int rc = make_symlink(fs, target, path);
+    pthread_mutex_unlock(&fs->namespace_lock);
+    return rc;
+}
+
+int wfs_read_symlink(struct wfs_ctx *fs, int inum, char *buf, size_t size)
+{
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    if (!S_ISLNK(inode->mode)) return -EINVAL;
+    if (size == 0) return -EINVAL;
+
+    size_t len = inode->size < size - 1 ? inode->size : size - 1;
+
+    if (inline_symlink(inode)) {
+      memcpy(buf, inode->blocks, len);
+    } else {
+      for (size_t done = 0; done < len; ) {
+        size_t chunk = BLOCK_SIZE - (done % BLOCK_SIZE);
+        if (chunk > len - done) chunk = len - done;
+
+        char *src = data_offset(fs, inode, done, 0);
+        if (!src) return -EIO;
+        memcpy(buf + done, src, chunk);
+        done += chunk;
+      }
+    }
+    buf[len] = '\0';
+    return 0;
+}
+
+int wfs_fsstat(struct wfs_ctx *fs, struct statvfs *st)
+{
+    struct wfs_layout *l = &fs->layout;
+
+    // Total blocks and inodes
+    st->f_blocks = l->num_data_blocks;
+    st->f_files  = l->num_inodes;
+
+    // the group descriptors keep the free counts current, once loaded
+    uint64_t free_blocks = 0, free_inodes = 0;
+    for (uint32_t g = 0; g < l->num_groups; g++) {
+        group_load(fs, g, GROUP_COUNTED);
+        free_blocks += __atomic_load_n(&l->groups[g].free_blocks, __ATOMIC_RELAXED);
+        free_inodes += __atomic_load_n(&l->groups[g].free_inodes, __ATOMIC_RELAXED);
+    }
+
+    st->f_bfree  = free_blocks;
+    st->f_bavail = free_blocks;
+    st->f_ffree = free_inodes;
+
+    // Defaults
+    st->f_bsize   = BLOCK_SIZE;
+    st->f_frsize  = BLOCK_SIZE;
+    st->f_namemax = MAX_NAME;
+
+    return 0;
+}
+
+int wfs_get_color(struct wfs_ctx *fs, int inum)
+{
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    return inode->color;
+}
+
+int wfs_set_color(struct wfs_ctx *fs, int inum, uint8_t code)
+{
+    op_clock();
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    if (code >= WFS_COLOR_MAX) return -EINVAL;
+    if (inode->flags & WFS_INODE_SNAPSHOT) return -EROFS;
+
+    color_mark(fs, inum, inode->color, 0);
+    inode->color = code;
+    color_mark(fs, inum, code, 1);
+    touch(fs, inode, T_CTIME);
+    return 0;
+}
+
+int wfs_get_xattr(struct wfs_ctx *fs, int inum, const char *name, void *value, size_t size)
+{
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+
+    // the block is only read for a name that is not inline
+    struct xattr_list list = { 0 };
+    pthread_mutex_lock(&fs->xattr_lock);
+    int rc = xattr_gather(&list, xattr_inline(inode), WFS_XATTR_INLINE);
+    struct wfs_xattr *x = rc < 0 ? NULL : xattr_find(&list, name);
+    if (!x && rc == 0) {
+        list.len = 0;
+        rc = xattr_gather_block(fs, inode, &list);
+        x = rc < 0 ? NULL : xattr_find(&list, name);
+    }
+
+    if (rc == 0 && !x) {
+        rc = -ENODATA;
+    } else if (rc == 0 && size && size < x->value_len) {
+        rc = -ERANGE;
+    } else if (rc == 0) {
+        if (size) memcpy(value, (char *)(x + 1) + x->name_len, x->value_len);
+        rc = x->value_len;
+    }
+    pthread_mutex_unlock(&fs->xattr_lock);
+    return rc;
+}
+
+int wfs_set_xattr(struct wfs_ctx *fs, int inum, const char *name, const void *value, size_t size, int flags)
+{
+    op_clock();
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    if (inode->flags & WFS_INODE_SNAPSHOT) return -EROFS;
+    size_t nlen = strlen(name);
+    if (nlen == 0) return -EINVAL;
+    if (nlen > UINT8_MAX) return -ERANGE;
+    if (sizeof(struct wfs_xattr) + nlen + size > WFS_XATTR_SPACE) return -ENOSPC;
+
+    struct xattr_list list;
+    pthread_mutex_lock(&fs->xattr_lock);
+    int rc = xattr_load(fs, inode, &list);
+    struct wfs_xattr *x = rc < 0 ? NULL : xattr_find(&list, name);
+    if (rc == 0 && x && (flags & WFS_XATTR_CREATE)) rc = -EEXIST;
+    if (rc == 0 && !x && (flags & WFS_XATTR_REPLACE)) rc = -ENODATA;
+    if (rc == 0 && x) {
+        size_t at = (char *)x - list.buf, n = xattr_len(x);
+        memmove(x, (char *)x + n, list.len - at - n);
+        list.len -= n;
+    }
+
+    struct wfs_xattr add = { (uint8_t)nlen, 0, (uint16_t)size };
+    size_t n = xattr_len(&add);
+    if (rc == 0 && list.len + n > sizeof(list.buf)) rc = -ENOSPC;
+    if (rc == 0) {
+        char *at = list.buf + list.len;
+        memset(at, 0, n);
+        memcpy(at, &add, sizeof(add));
+        memcpy(at + sizeof(add), name, nlen);
+        memcpy(at + sizeof(add) + nlen, value, size);
+        list.len += n;
+        rc = xattr_save(fs, inode, &list);
+    }
+    pthread_mutex_unlock(&fs->xattr_lock);
+
+    if (rc == 0) touch(fs, inode, T_CTIME);
+    return rc;
+}
+
+int wfs_remove_xattr(struct wfs_ctx *fs, int inum, const char *name)
+{
+    op_clock();
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    if (inode->flags & WFS_INODE_SNAPSHOT) return -EROFS;
+
+    struct xattr_list list;
+    pthread_mutex_lock(&fs->xattr_lock);
+    int rc = xattr_load(fs, inode, &list);
+    struct wfs_xattr *x = rc < 0 ? NULL : xattr_find(&list, name);
+    if (rc == 0 && !x) rc = -ENODATA;
+    if (rc == 0) {
+        size_t at = (char *)x - list.buf, n = xattr_len(x);
+        memmove(x, (char *)x + n, list.len - at - n);
+        list.len -= n;
+        rc = xattr_save(fs, inode, &list);
+    }
+    pthread_mutex_unlock(&fs->xattr_lock);
+
+    if (rc == 0) touch(fs, inode, T_CTIME);
+    return rc;
+}
+
+int wfs_list_xattr(struct wfs_ctx *fs, int inum, char *names, size_t size)
+{
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+
+    struct xattr_list list;
+    pthread_mutex_lock(&fs->xattr_lock);
+    int rc = xattr_load(fs, inode, &list);
+    size_t total = 0;
+    for (size_t at = 0; rc == 0 && at < list.len; ) {
+        struct wfs_xattr *x = (struct wfs_xattr *)(list.buf + at);
+        if (size && total + x->name_len + 1 > size) {
+            rc = -ERANGE;
+        } else if (size) {
+            memcpy(names + total, x + 1, x->name_len);
+            names[total + x->name_len] = '\0';
+        }
+        total += x->name_len + 1;
+        at += xattr_len(x);
+    }
+    pthread_mutex_unlock(&fs->xattr_lock);
+    return rc < 0 ? rc : (int)total;
+}
+
+int wfs_iterate_color(struct wfs_ctx *fs, uint8_t code, wfs_dir_cb cb, void *arg)
+{
+    if (code == WFS_COLOR_NONE || code >= WFS_COLOR_MAX) return -EINVAL;
+
+    for (uint32_t g = 0; g < fs->layout.num_groups; g++)
+        group_load(fs, g, GROUP_INDEXED);
+
+    size_t words = (fs->layout.num_inodes + 63) / 64;
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = __atomic_load_n(&fs->colored[code][w], __ATOMIC_RELAXED); bits; bits &= bits - 1) {
+            int inum = w * 64 + __builtin_ctzll(bits);
+            struct wfs_inode *inode = retrieve_inode(fs, inum);
+            // an unlinked file waiting for the reclaimer is gone already
+            if (!inode || inode->nlinks == 0 || inode->color != code) continue;
+
+            char name[16];
+            snprintf(name, sizeof(name), "%d", inum);
+            int rc = cb(arg, name, inum);
+            if (rc) return rc;
+        }
+    }
+    return 0;
+}
+
+int wfs_get_compress(struct wfs_ctx *fs, int inum)
+{
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    return (inode->flags & WFS_INODE_COMPRESS) != 0;
+}
+
+int wfs_set_compress(struct wfs_ctx *fs, int inum, int on)
+{
+    op_clock();
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    if (!S_ISREG(inode->mode) && !S_ISDIR(inode->mode)) return -EINVAL;
+    if (inode->flags & WFS_INODE_SNAPSHOT) return -EROFS;
+
+    if (on) {
+        inode->flags |= WFS_INODE_COMPRESS;
+        if (S_ISREG(inode->mode)) {
+            unsigned *seq = seq_write_begin(fs, inode);
+            pack_range(fs, inode, 0, inode->size);
+            seq_write_end(seq);
+        }
+    } else {
+        inode->flags &= ~WFS_INODE_COMPRESS;
+    }
+    touch(fs, inode, T_CTIME);
+    return 0;
+}
+
+void wfs_set_compress_default(struct wfs_ctx *fs, int on)
+{
+    fs->compress_new = on;
+}
+
+int wfs_set_dedup(struct wfs_ctx *fs, int on)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)fs->mregion;
+    pthread_mutex_lock(&fs->dedup_lock);
+    if (on && !fs->fingerprints) {
+        // shared blocks are remembered in the state field, which only
+        // images from mkfs with a magic have
+        if (sb->magic != WFS_MAGIC && sb->magic != WFS_MAGIC_V1) {
+            pthread_mutex_unlock(&fs->dedup_lock);
+            return -EOPNOTSUPP;
+        }
+        size_t n = 1;
+        while (n < 2 * fs->layout.num_data_blocks)
+            n <<= 1;
+        if (refs_alloc(fs) < 0 || !(fs->fingerprints = calloc(n, sizeof(*fs->fingerprints)))) {
+            pthread_mutex_unlock(&fs->dedup_lock);
+            return -ENOMEM;
+        }
+        fs->fp_mask = n - 1;
+    } else if (!on) {
+        free(fs->fingerprints);
+        fs->fingerprints = NULL;
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+    return 0;
+}
+
+int wfs_dedup_file(struct wfs_ctx *fs, int inum)
+{
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    if (!S_ISREG(inode->mode)) return 0;
+    if (!fs->fingerprints) return -EINVAL;
+    unsigned *seq = seq_write_begin(fs, inode);
+    int n = dedup_range(fs, inode, 0, inode->size);
+    seq_write_end(seq);
+    return n;
+}
+
+void wfs_set_verify(struct wfs_ctx *fs, int mode)
+{
+    fs->verify = mode;
+}
+
+int wfs_snapshot(struct wfs_ctx *fs, const char *name)
+{
+    op_clock();
+    // shared blocks are remembered in the state field (see wfs_set_dedup)
+    struct wfs_sb *sb = (struct wfs_sb *)fs->mregion;
+    if (sb->magic != WFS_MAGIC && sb->magic != WFS_MAGIC_V1) return -EOPNOTSUPP;
+    if (!*name || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return -EINVAL;
+    if (strlen(name) >= MAX_NAME) return -ENAMETOOLONG;
+
+    char entry[MAX_NAME];
+    strcpy(entry, name);
+    int *map = NULL, err = 0;
+
+    pthread_mutex_lock(&fs->snapshot_lock);
+    pthread_mutex_lock(&fs->namespace_lock);
+    struct wfs_inode *dir = snapshot_dir(fs, 1, &err);
+    if (dir && dentry_to_num(fs, entry, dir) >= 0) err = -EEXIST;
+
+    pthread_mutex_lock(&fs->dedup_lock);
+    if (!err) err = refs_alloc(fs);
+    pthread_mutex_unlock(&fs->dedup_lock);
+    if (!err && !(map = calloc(fs->layout.num_inodes, sizeof(int)))) err = -ENOMEM;
+
+    // every inode is copied, so make sure of that many before copying any
+    struct statvfs st;
+    if (!err && wfs_fsstat(fs, &st) == 0 && snap_count(fs, map, retrieve_inode(fs, 0)) > st.f_ffree)
+        err = -ENOSPC;
+    if (map) memset(map, 0, fs->layout.num_inodes * sizeof(int));
+
+    if (!err) {
+        int num = snap_inode(fs, map, retrieve_inode(fs, 0), dir);
+        if (num < 0) {
+            err = num;
+        } else if ((err = add_dentry(fs, dir, num, entry)) != 0) {
+            snap_drop(fs, retrieve_inode(fs, num));
+            if (err > 0) err = -EINVAL;
+        }
+    }
+    pthread_mutex_unlock(&fs->namespace_lock);
+    pthread_mutex_unlock(&fs->snapshot_lock);
+    free(map);
+    return err;
+}
+
+int wfs_snapshot_delete(struct wfs_ctx *fs, const char *name)
+{
+    op_clock();
+    if (strlen(name) >= MAX_NAME) return -ENAMETOOLONG;
+    char entry[MAX_NAME];
+    strcpy(entry, name);
+    int err = 0;
+
+    pthread_mutex_lock(&fs->snapshot_lock);
+    pthread_mutex_lock(&fs->namespace_lock);
+    struct wfs_inode *dir = snapshot_dir(fs, 0, &err);
+    int num = dir ? dentry_to_num(fs, entry, dir) : err;
+    struct wfs_inode *snap = num >= 0 ? retrieve_inode(fs, num) : NULL;
+    if (!snap)
+        err = num < 0 ? num : -ENOENT;
+    else if ((err = remove_dentry_name(fs, dir, entry)) == 0)
+        snap_drop(fs, snap);
+    pthread_mutex_unlock(&fs->namespace_lock);
+    pthread_mutex_unlock(&fs->snapshot_lock);
+    return err;
+}
+
+int wfs_frag(struct wfs_ctx *fs, int inum, struct wfs_frag *f)
+{
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    memset(f, 0, sizeof(*f));
+    if (!S_ISREG(inode->mode) || (inode->flags & WFS_INODE_SNAPSHOT)) return 0;
+
+    off_t *slots[FILE_BLOCKS];
+    int n, pinned;
+    unsigned seq;
+    do {
+        seq = seq_read_begin(fs, inode);
+        n = file_slots(fs, inode, slots, &pinned);
+        f->fragments = n > 0 ? count_fragments(slots, n) : 0;
+    } while (seq_read_retry(fs, inode, seq));
+    if (n < 0) return n;
+
+    f->files = n > 0;
+    f->blocks = n;
+    return 0;
+}
+
+double wfs_frag_score(const struct wfs_frag *f)
+{
+    if (f->blocks <= f->files) return 0;
+    return 100.0 * (f->fragments - f->files) / (f->blocks - f->files);
+}
+
+int wfs_defrag_file(struct wfs_ctx *fs, int inum)
+{
+    struct wfs_inode *inode = retrieve_inode(fs, inum);
+    if (!inode) return -ENOENT;
+    if (!S_ISREG(inode->mode) || (inode->flags & WFS_INODE_SNAPSHOT)) return 0;
+
+    off_t *slots[FILE_BLOCKS], old[FILE_BLOCKS];
+    int pinned, moved = 0;
+    unsigned *seq = seq_write_begin(fs, inode);
+    // it may have been freed, or freed and made again, since; and a slot
+    // caught half made reads as inode 0, whose count this is not
+    int n = S_ISREG(inode->mode) && inode->num == inum ? file_slots(fs, inode, slots, &pinned) : 0;
+    if (n < 0) {
+        moved = n;
+    } else if (n > 1 && !pinned && count_fragments(slots, n) > 1) {
+        off_t to = alloc_contig(fs, inum / fs->layout.inodes_per_group, n);
+        if (to >= 0) moved = move_file(fs, inode, slots, n, to, old);
+    }
+    // the old blocks go while the count is odd, as in free_inode_data
+    if (moved > 0) {
+        free_blocks(fs, old, moved);
+        STAT_ADD(fs, blocks_moved, moved);
+    }
+    seq_write_end(seq);
+    return moved;
+}
+
+int wfs_start_defrag(struct wfs_ctx *fs, unsigned interval)
+{
+    if (fs->defragging) return 0;
+    fs->defrag_stop = 0;
+    fs->defrag_interval = interval;
+    int err = pthread_create(&fs->defragger, NULL, defragger, fs);
+    if (err) return -err;
+    fs->defragging = 1;
+    return 0;
+}
+
+// madvise() [off, off + len) of the image, widened to whole pages
+static int advise(struct wfs_ctx *fs, off_t off, off_t len, int advice)
+{
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start = off / page * page;
+    return madvise((char *)fs->mregion + start, len + (off - start), advice) < 0 ? -errno : 0;
+}
+
+int wfs_set_advice(struct wfs_ctx *fs, int data, int hugepages)
+{
+    static const int data_advice[] = {
+        [WFS_ADVISE_NORMAL] = MADV_NORMAL,
+        [WFS_ADVISE_RANDOM] = MADV_RANDOM,
+        [WFS_ADVISE_SEQUENTIAL] = MADV_SEQUENTIAL,
+    };
+    struct wfs_layout *l = &fs->layout;
+    if (data < WFS_ADVISE_NORMAL || data > WFS_ADVISE_SEQUENTIAL) return -EINVAL;
+
+    int err = 0;
+    for (uint32_t g = 0; g < l->num_groups; g++) {
+        struct wfs_group_desc *gd = &l->groups[g];
+        off_t len = (off_t)wfs_group_blocks(l, g) * BLOCK_SIZE;
+
+        // inodes are found by number; reading ahead of one is wasted
+        advise(fs, gd->i_blocks_ptr, (off_t)wfs_group_inodes(l, g) * BLOCK_SIZE, MADV_RANDOM);
+        advise(fs, gd->d_blocks_ptr, len, data_advice[data]);
+#ifdef MADV_HUGEPAGE
+        if (hugepages && !err) err = advise(fs, gd->d_blocks_ptr, len, MADV_HUGEPAGE);
+#else
+        if (hugepages) err = -EOPNOTSUPP;
+#endif
+    }
+    return err;
+}
+
+int wfs_grow(struct wfs_ctx *fs, size_t blocks, size_t inodes)
+{
+    struct wfs_sb *sb = (struct wfs_sb *)fs->mregion;
+    struct wfs_layout *l = &fs->layout;
+    if (sb->magic != WFS_MAGIC || !evenly_spaced(sb)) return -EOPNOTSUPP;
+
+    // whole groups of inodes, and at least one bitmap word of blocks in each
+    size_t bpg = l->blocks_per_group, ipg = l->inodes_per_group;
+    if (blocks < l->num_data_blocks) blocks = l->num_data_blocks;
+    blocks = (blocks + 31) / 32 * 32;
+    size_t groups = (blocks + bpg - 1) / bpg;
+    if (inodes > groups * ipg) groups = (inodes + ipg - 1) / ipg;
+    if (blocks <= (groups - 1) * bpg) blocks = (groups - 1) * bpg + 32;
+    if (blocks == l->num_data_blocks) return 0;
+    if (groups > UINT32_MAX || sizeof(*sb) + groups * sizeof(struct wfs_group_desc) > (size_t)l->first_group)
+        return -ENOSPC;   // no room for the descriptors
+
+    struct wfs_group_desc last = group_at(sb, groups - 1);
+    off_t csum = last.d_blocks_ptr + (off_t)(blocks - (groups - 1) * bpg) * BLOCK_SIZE;
+    off_t size = csum;
+    if (l->csum_ptr)
+        size += (blocks * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    if (size < (off_t)fs->size) size = fs->size;
+    // with discard the new space stays a hole until it is used
+    int err = 0;
+    if (fs->discard)
+        err = ftruncate(fs->fd, size) < 0 ? errno : 0;
+    else
+        err = posix_fallocate(fs->fd, 0, size);
+    if (err) return -err;
+
+    // the reclaimer is the one thing besides our caller that may be running
+    pthread_rwlock_wrlock(&fs->grow_lock);
+    pthread_mutex_lock(&fs->orphan_lock);
+
+    pthread_mutex_t *locks = NULL;
+    void *base = fs->mregion;
+    if ((err = grow_tables(fs, blocks, groups * ipg, groups, &locks)) == 0 && (size_t)size > fs->size) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fs->fd, 0);
+        if (base == MAP_FAILED) err = -errno;
+    }
+    if (err < 0) {
+        pthread_mutex_unlock(&fs->orphan_lock);
+        pthread_rwlock_unlock(&fs->grow_lock);
+        free(locks);
+        return err;
+    }
+
+    grow_layout(fs, base, l->num_groups, groups, blocks, csum);
+    if (base != fs->mregion) {
+        munmap(fs->mregion, fs->size);
+        fs->mregion = base;
+        fs->size = size;
+    }
+    for (uint32_t g = 0; g < l->num_groups; g++)
+        pthread_mutex_destroy(&fs->group_locks[g]);
+    free(fs->group_locks);
+    fs->group_locks = locks;
+
+    // the old last group got longer; the new ones have no inodes to index
+    uint32_t from = l->num_groups;
+    wfs_layout_init(l, fs->mregion, fs->size);
+    if (l->csum_ptr)
+        fs->csums = (uint32_t *)((char *)fs->mregion + l->csum_ptr);
+    fs->group_state[from - 1] &= ~GROUP_COUNTED;
+    for (uint32_t g = from; g < groups; g++)
+        fs->group_state[g] = GROUP_INDEXED;
+    for (uint32_t g = from - 1; g < groups; g++)
+        group_load(fs, g, GROUP_COUNTED);
+
+    pthread_mutex_unlock(&fs->orphan_lock);
+    pthread_rwlock_unlock(&fs->grow_lock);
+    return 0;
+}
+
+struct wfs_stats *wfs_get_stats(struct wfs_ctx *fs)
+{
+    return &fs->stats;
+}
+
+int wfs_format_stats(struct wfs_ctx *fs, char *buf, size_t len)
+{
+    return stats_format(&fs->stats, buf, len);
+}
+
+void wfs_reset_stats(struct wfs_ctx *fs)
+{
+    stats_reset(&fs->stats);
+}
@@ -0,0 +1,229 @@
+#ifndef LIBWFS_H
+#define LIBWFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+/*
+  Embeddable WFS core. Open an image produced by `mkfs` and operate on it
+  in-process, without FUSE:
+
+      struct wfs_ctx *fs = wfs_open_image("disk.img");
+      int inum;
+      if (wfs_lookup(fs, "/a/b", &inum) == 0)
+          wfs_pread(fs, inum, buf, sizeof(buf), 0);
+      wfs_close_image(fs);
+
+  Paths are absolute. Functions return 0 (or a byte count / inode number)
+  on success and a negative errno on failure, matching FUSE conventions.
+*/
+
+struct wfs_ctx;
+struct wfs_stats;
+
+// called once per directory entry; return non-zero to stop early
+typedef int (*wfs_dir_cb)(void *arg, const char *name, int inum);
+
+struct wfs_ctx *wfs_open_image(const char *path);
+void wfs_close_image(struct wfs_ctx *fs);
+int wfs_sync(struct wfs_ctx *fs);
+
+int wfs_lookup(struct wfs_ctx *fs, const char *path, int *inum);
+int wfs_stat(struct wfs_ctx *fs, int inum, struct stat *st);
+ssize_t wfs_pread(struct wfs_ctx *fs, int inum, void *buf, size_t len, off_t off);
+ssize_t wfs_pwrite(struct wfs_ctx *fs, int inum, const void *buf, size_t len, off_t off);
+int wfs_iterate(struct wfs_ctx *fs, int inum, wfs_dir_cb cb, void *arg);
+
+int wfs_create(struct wfs_ctx *fs, const char *path, mode_t mode);  // returns inode number
+int wfs_remove(struct wfs_ctx *fs, const char *path);
+int wfs_move(struct wfs_ctx *fs, const char *from, const char *to, unsigned int flags);
+int wfs_hardlink(struct wfs_ctx *fs, const char *from, const char *to);
+int wfs_make_symlink(struct wfs_ctx *fs, const char *target, const char *path);
+int wfs_read_symlink(struct wfs_ctx *fs, int inum, char *buf, size_t size);
+
+/*
+  Unlinking a file's last name normally frees its blocks on the spot. Once
+  wfs_start_reclaimer() has run, the inode is instead put on an orphan list
+  in the superblock and a background thread frees it; anything still on
+  the list after a crash is picked up by the next reclaimer (or close).
+  With secure delete, freed blocks are zeroed as well.
+*/
+int wfs_start_reclaimer(struct wfs_ctx *fs);
+void wfs_set_secure_delete(struct wfs_ctx *fs, int on);
+
+/*
+  Group summaries. Opening an image reads no bitmaps: a group's free
+  counts are recounted the first time an allocation or wfs_fsstat() needs
+  them (unless the last close left them exact), and its part of the color
+  index is filled in on first use too. wfs_start_loaders() starts threads
+  that load every group in the background, stopped by close. Like the
+  reclaimer, start them after any fork(), such as FUSE daemonizing.
+*/
+int wfs_start_loaders(struct wfs_ctx *fs);
+
+/*
+  Discard. Freed data blocks stay allocated in the image file until the
+  pages holding them are punched out, giving a sparse image's space back
+  to a thin-provisioned host. The punch is madvise(2) MADV_REMOVE, which
+  is fallocate(2) PUNCH_HOLE done through the mapping. With
+  wfs_set_discard() on, every free punches out the pages it leaves with
+  no block in use, neighbouring ones as one hole; wfs_trim() does that
+  for all free space at once, like fstrim(8), and returns the bytes
+  punched, or -EOPNOTSUPP where the file can't have holes. Only whole
+  pages of data blocks are punched, never metadata.
+*/
+void wfs_set_discard(struct wfs_ctx *fs, int on);
+off_t wfs_trim(struct wfs_ctx *fs);
+
+/*
+  Access times. Strict (the default) stamps atime on every read and
+  readdir; relatime only when atime is older than mtime or ctime, or a day
+  old; noatime never. With lazytime, updates that change nothing but
+  timestamps are kept in memory and written to the inode when something
+  else changes it, on wfs_sync() or close, or when the table of pending
+  updates fills up.
+*/
+enum { WFS_STRICTATIME, WFS_RELATIME, WFS_NOATIME };
+void wfs_set_time_mode(struct wfs_ctx *fs, int atime_mode, int lazytime);
+
+int wfs_fsstat(struct wfs_ctx *fs, struct statvfs *st);
+int wfs_get_color(struct wfs_ctx *fs, int inum);
+int wfs_set_color(struct wfs_ctx *fs, int inum, uint8_t code);
+
+/*
+  The inodes carrying a color tag are indexed in memory (built at open,
+  kept current by wfs_set_color() and frees), so wfs_iterate_color() calls
+  'cb' for each inode tagged 'code' in time that grows with the number of
+  matches and the inode count / 64, instead of reading every inode. The
+  name passed is the inode number in decimal. Snapshot copies and files
+  waiting for the reclaimer are not listed; WFS_COLOR_NONE is -EINVAL.
+*/
+int wfs_iterate_color(struct wfs_ctx *fs, uint8_t code, wfs_dir_cb cb, void *arg);
+
+/*
+  Extended attributes, by full name ("user.checksum"). wfs_get_xattr()
+  copies the value into 'value' and returns its length (with 'size' 0,
+  only the length), -ERANGE if it does not fit and -ENODATA if there is no
+  such attribute. wfs_list_xattr() fills 'names' the same way with every
+  name, each ending in a NUL. Small ones are kept in the inode itself and
+  read without fetching another block; the rest share one xattr block per
+  inode of at most WFS_XATTR_SPACE bytes, so a set that would not fit is
+  -ENOSPC. Inodes with identical xattr blocks point at the same one.
+  WFS_XATTR_CREATE and WFS_XATTR_REPLACE are the setxattr(2) flags.
+*/
+enum { WFS_XATTR_CREATE = 1, WFS_XATTR_REPLACE = 2 };
+int wfs_get_xattr(struct wfs_ctx *fs, int inum, const char *name, void *value, size_t size);
+int wfs_set_xattr(struct wfs_ctx *fs, int inum, const char *name, const void *value, size_t size, int flags);
+int wfs_remove_xattr(struct wfs_ctx *fs, int inum, const char *name);
+int wfs_list_xattr(struct wfs_ctx *fs, int inum, char *names, size_t size);
+
+/*
+  Compression. A regular file with it on stores each full cluster of
+  WFS_CLUSTER_BLOCKS blocks LZ4 compressed whenever that saves a block;
+  reads decompress through a small per-thread cluster cache, and a write
+  into a compressed cluster rewrites it plain before compressing it again.
+  Turning it on packs the file's existing clusters; turning it off only
+  stops new ones. Directories pass the setting on to what is created in
+  them, and wfs_set_compress_default() turns it on for everything new.
+*/
+int wfs_get_compress(struct wfs_ctx *fs, int inum);
+int wfs_set_compress(struct wfs_ctx *fs, int inum, int on);
+void wfs_set_compress_default(struct wfs_ctx *fs, int on);
+
+/*
+  Deduplication. With it on, every full block a write leaves in a file is
+  looked up by content, and pointed at an identical block already on disk
+  if there is one; shared blocks are copied again when written. The index
+  only knows blocks written since it was turned on, so wfs_dedup_file()
+  feeds it a whole file (the wfs_dedup tool does that for every file).
+  Returns the number of blocks merged. Files with compression on are left
+  alone.
+*/
+int wfs_set_dedup(struct wfs_ctx *fs, int on);
+int wfs_dedup_file(struct wfs_ctx *fs, int inum);
+
+/*
+  Checksums. On an image made with a checksum area, every data block's
+  CRC32C is kept current as it is written, and each block is checked
+  the first time it is read after the image is opened: a mismatch fails
+  the operation with -EIO. WFS_VERIFY_METADATA checks only directory and
+  indirect blocks and symlink targets; checksums are still written for
+  everything either way.
+*/
+enum { WFS_VERIFY_ALL, WFS_VERIFY_METADATA, WFS_VERIFY_NONE };
+void wfs_set_verify(struct wfs_ctx *fs, int mode);
+
+/*
+  Snapshots. wfs_snapshot() copies the tree to /.snapshots/<name>: every
+  file, directory and symlink gets a read-only copy of its inode, but file
+  blocks are shared with the live files (as deduplicated blocks are), so a
+  snapshot costs inodes, directory and indirect blocks, and data only once
+  the live side is written over. Compressed clusters are copied. It is a
+  walk of the whole tree, not a constant-time checkpoint: it takes time
+  and inodes in proportion to the files, fails with -ENOSPC (having copied
+  nothing) when there are fewer free inodes than that, and holds off
+  other changes to names until done; writes to file data running
+  meanwhile may or may not be in it. Anything in /.snapshots refuses
+  changes with -EROFS; wfs_snapshot_delete() drops a snapshot and frees
+  the blocks nothing else uses.
+*/
+#define WFS_SNAPSHOT_DIR ".snapshots"
+int wfs_snapshot(struct wfs_ctx *fs, const char *name);
+int wfs_snapshot_delete(struct wfs_ctx *fs, const char *name);
+
+/*
+  Defragmentation. A file's fragments are the runs of its blocks that
+  follow each other on disk in file order (the indirect block counts, in
+  its place after the direct ones). wfs_frag() gives a file's block and
+  fragment count; summed over files, wfs_frag_score() turns them into the
+  share of block-to-block steps that jump, from 0 (every file in one
+  piece) to 100. wfs_defrag_file() moves a file of more than one fragment
+  into the first free run that holds it whole, readers waiting on the
+  file meanwhile, and returns how many blocks moved: 0 when it already was
+  in one piece, has compressed or shared blocks, or no run is long enough.
+  Since runs are taken from the start of a group, moving files also packs
+  free space towards the end. wfs_start_defrag() does it to every file,
+  every 'interval' seconds, in a background thread stopped by close;
+  start it after any fork().
+*/
+struct wfs_frag {
+    size_t files;       // 1 for a file with blocks
+    size_t blocks;
+    size_t fragments;
+};
+int wfs_frag(struct wfs_ctx *fs, int inum, struct wfs_frag *f);
+double wfs_frag_score(const struct wfs_frag *f);
+int wfs_defrag_file(struct wfs_ctx *fs, int inum);
+int wfs_start_defrag(struct wfs_ctx *fs, unsigned interval);
+
+/*
+  Mapping advice. The image is one shared mapping; this passes madvise(2)
+  advice per region: inode tables are read at random, and the data blocks
+  get 'data' (WFS_ADVISE_*). With 'hugepages' the data blocks ask for
+  transparent huge pages too, which needs them 2 MB aligned (mkfs -a 2M)
+  and a file the kernel backs with huge pages, such as one on tmpfs.
+  Returns the error of the huge page request, if any.
+*/
+enum { WFS_ADVISE_NORMAL, WFS_ADVISE_RANDOM, WFS_ADVISE_SEQUENTIAL };
+int wfs_set_advice(struct wfs_ctx *fs, int data, int hugepages);
+
+/*
+  Growing. wfs_grow() takes the image to at least 'blocks' data blocks and
+  'inodes' inodes (0 or less than now leaves either as it is), extending
+  the file and the mapping. Space comes in whole block groups, each with
+  its share of inodes, added at the end; the checksum area moves behind
+  them. Images not laid out by mkfs, or with no room left for group
+  descriptors, give -EOPNOTSUPP and -ENOSPC. The mapping may move, so
+  nothing else may be using 'fs' meanwhile; the background reclaimer is
+  held off by wfs_grow itself.
+*/
+int wfs_grow(struct wfs_ctx *fs, size_t blocks, size_t inodes);
+
+// per-operation latency histograms and hot-path counters (see stats.h)
+struct wfs_stats *wfs_get_stats(struct wfs_ctx *fs);
+int wfs_format_stats(struct wfs_ctx *fs, char *buf, size_t len);
+void wfs_reset_stats(struct wfs_ctx *fs);
+
+#endif
@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+/*
+ * Each sequence is a token (literal count in the high nibble, match length
+ * minus MINMATCH in the low one; 15 means more length bytes follow), the
+ * literals, a little-endian 16-bit match offset and the extra match length
+ * bytes. The block ends with a literals-only sequence, and the format asks
+ * that the last LAST_LITERALS bytes are literals and that no match starts
+ * within MF_LIMIT bytes of the end.
+ */
+#define MINMATCH      4
+#define LAST_LITERALS 5
+#define MF_LIMIT      12
+#define HASH_LOG      12
+#define MAX_OFFSET    65535
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static uint8_t *put_len(uint8_t *op, size_t n)
+{
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// token, length bytes and literals for 'lit' literals, plus a match if 'mlen' >= 0
+static size_t seq_size(size_t lit, long mlen)
+{
+    size_t n = 1 + lit + (lit >= 15 ? (lit - 15) / 255 + 1 : 0);
+    if (mlen >= 0)
+        n += 2 + (mlen >= 15 ? (mlen - 15) / 255 + 1 : 0);
+    return n;
+}
+
+static uint8_t *put_seq(uint8_t *op, const uint8_t *lit, size_t n_lit, size_t mlen)
+{
+    uint8_t *token = op++;
+    *token = (uint8_t)((n_lit >= 15 ? 15 : n_lit) << 4 | (mlen >= 15 ? 15 : mlen));
+    if (n_lit >= 15) op = put_len(op, n_lit - 15);
+    memcpy(op, lit, n_lit);
+    return op + n_lit;
+}
+
+int lz4_compress(const void *src, int len, void *dst, int cap)
+{
+    const uint8_t *base = src, *end = base + len;
+    const uint8_t *ip = base, *anchor = base;
+    uint8_t *op = dst, *oend = op + cap;
+    uint16_t table[1 << HASH_LOG];
+
+    if (len < 0 || len > LZ4_MAX_INPUT) return 0;
+    memset(table, 0, sizeof(table));
+
+    if (len > MF_LIMIT) {
+        const uint8_t *mflimit = end - MF_LIMIT, *matchlimit = end - LAST_LITERALS;
+
+        for (ip++; ip <= mflimit; ) {
+            uint32_t h = hash4(read32(ip));
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint16_t)(ip - base);
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip++;
+                continue;
+            }
+
+            // grow the match backwards into pending literals, then forwards
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + MINMATCH, *r = ref + MINMATCH;
+            while (m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            size_t n_lit = ip - anchor, mlen = m - ip - MINMATCH;
+            if (seq_size(n_lit, mlen) > (size_t)(oend - op)) return 0;
+            op = put_seq(op, anchor, n_lit, mlen);
+            uint16_t off = (uint16_t)(ip - ref);
+            *op++ = off & 0xff;
+            *op++ = off >> 8;
+            if (mlen >= 15) op = put_len(op, mlen - 15);
+
+            ip = anchor = m;
+            if (ip - 2 > base) table[hash4(read32(ip - 2))] = (uint16_t)(ip - 2 - base);
+        }
+    }
+
+    size_t n_lit = end - anchor;
+    if (seq_size(n_lit, -1) > (size_t)(oend - op)) return 0;
+    op = put_seq(op, anchor, n_lit, 0);
+    return op - (uint8_t *)dst;
+}
+
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+    unsigned b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decompress(const void *src, int len, void *dst, int cap)
+{
+    const uint8_t *ip = src, *iend = ip + len;
+    uint8_t *op = dst, *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t n_lit = token >> 4;
+        if (n_lit == 15 && get_len(&ip, iend, &n_lit) < 0) return -1;
+        if (n_lit > (size_t)(iend - ip) || n_lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, n_lit);
+        op += n_lit;
+        ip += n_lit;
+
+        // the last sequence has no match
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - (uint8_t *)dst)) return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_len(&ip, iend, &mlen) < 0) return -1;
+        mlen += MINMATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+
+        // a match may overlap what it produces
+        const uint8_t *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--)
+                *op++ = *ref++;
+        }
+    }
+    return op - (uint8_t *)dst;
+}
@@ -0,0 +1,19 @@
+#ifndef WFS_LZ4_H
+#define WFS_LZ4_H
+
+/*
+  A small LZ4 block codec (the raw block format, no frame) for compressed
+  file clusters. Output can be read by any LZ4 block decoder and vice
+  versa. The compressor is the single-pass greedy one, tuned for inputs of
+  at most 64 KiB: match positions are kept as 16-bit offsets.
+*/
+
+#define LZ4_MAX_INPUT 65535
+
+// compress 'len' bytes; returns the compressed size, or 0 if it does not fit in 'cap'
+int lz4_compress(const void *src, int len, void *dst, int cap);
+
+// returns the decompressed size, or -1 for corrupt input or a short 'cap'
+int lz4_decompress(const void *src, int len, void *dst, int cap);
+
+#endif
@@ -1,38 +1,114 @@
+#define _GNU_SOURCE   // fallocate() to punch holes
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "wfs.h"
+#include "crc32c.h"
 
 int roundup(int num, int factor) {
     return num % factor == 0 ? num : num + (factor - (num % factor));
 }
 
-int setup_sb(struct wfs_sb* sb, int inodes, int blocks, size_t sz) {
-    inodes = roundup(inodes, 32);
+// a -r file keeps all of its blocks in one run, and runs never cross groups
+#define MIN_GROUP_BLOCKS 128
+
+static off_t align_up(off_t n, off_t to) {
+    return (n + to - 1) / to * to;
+}
+
+// Punch the whole pages in [from, to) out of the image file, so they take no
+// space on the host until written. Where the file can't have holes they
+// are left as they are; they read as zeros either way.
+static void punch(int fd, off_t from, off_t to) {
+    from = align_up(from, WFS_PAGE_SIZE);
+    to = to / WFS_PAGE_SIZE * WFS_PAGE_SIZE;
+    if (to > from)
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from);
+}
+
+// a group's bitmaps (one page-aligned region) and inode table
+static off_t group_meta(int ipg, int bpg) {
+    return align_up(ipg / 8 + bpg / 8, WFS_PAGE_SIZE) + (off_t)ipg * BLOCK_SIZE;
+}
+
+static size_t sb_bytes(const struct wfs_sb *sb) {
+    return sizeof(*sb) + sb->num_groups * sizeof(struct wfs_group_desc);
+}
+
+/* Split 'blocks' data blocks into groups of 'bpg' and spread the inodes
+ * evenly over them, with a checksum area behind the last group if 'csum'.
+ * Every region starts on a page, and every group's data blocks on a
+ * multiple of 'align' (a power of two, at least a page): groups hold whole
+ * units of it, and a group's metadata is padded up to one, with as many
+ * extra inodes as fit in the padding. Returns the superblock with its
+ * group descriptors appended (every group empty) and the image size it
+ * needs in *total. */
+struct wfs_sb *setup_sb(int inodes, int blocks, int bpg, int csum, off_t align, off_t *total) {
     blocks = roundup(blocks, 32);
-    
-    sb->num_inodes = inodes;
+    bpg = roundup(bpg < MIN_GROUP_BLOCKS ? MIN_GROUP_BLOCKS : bpg, 32);
+    bpg = align_up(bpg, align / BLOCK_SIZE);
+    if (bpg > blocks) bpg = blocks;
+    int groups = (blocks + bpg - 1) / bpg;
+    int ipg = roundup((inodes + groups - 1) / groups, 32);
+
+    off_t meta = align_up(group_meta(ipg, bpg), align);
+    while (group_meta(ipg + 32, bpg) <= meta)
+        ipg += 32;
+    off_t pad = meta - group_meta(ipg, bpg);
+
+    struct wfs_sb *sb = calloc(1, sizeof(*sb) + groups * sizeof(struct wfs_group_desc));
+    sb->magic = WFS_MAGIC;
+    sb->state = WFS_STATE_CLEAN | WFS_STATE_COUNTED | (csum ? WFS_STATE_CSUM : 0);
+    sb->num_inodes = (size_t)ipg * groups;
     sb->num_data_blocks = blocks;
-    sb->i_bitmap_ptr = sizeof(struct wfs_sb);
+    sb->num_groups = groups;
+    sb->inodes_per_group = ipg;
+    sb->blocks_per_group = bpg;
+    sb->first_group = align_up(sb_bytes(sb), align);
+
     // 8 bits in a byte...
-    sb->d_bitmap_ptr = sb->i_bitmap_ptr + (inodes / 8);
-    sb->i_blocks_ptr = sb->d_bitmap_ptr + (blocks / 8);
-    sb->d_blocks_ptr = sb->i_blocks_ptr + (inodes * BLOCK_SIZE);
+    off_t bitmaps = align_up(ipg / 8 + bpg / 8, WFS_PAGE_SIZE);
+    sb->group_stride = meta + (off_t)bpg * BLOCK_SIZE;
 
-    printf("trying to create with %d inodes, %d blocks, size is %ld, block start at %ld\n", inodes, blocks, sz, sb->i_blocks_ptr);
-    return (inodes * BLOCK_SIZE) + (blocks * BLOCK_SIZE) + sb->i_blocks_ptr < sz;
+    for (int g = 0; g < groups; g++) {
+        struct wfs_group_desc *gd = &sb->groups[g];
+        gd->i_bitmap_ptr = sb->first_group + g * sb->group_stride + pad;
+        gd->d_bitmap_ptr = gd->i_bitmap_ptr + ipg / 8;
+        gd->i_blocks_ptr = gd->i_bitmap_ptr + bitmaps;
+        gd->d_blocks_ptr = gd->i_blocks_ptr + (off_t)ipg * BLOCK_SIZE;
+        gd->free_inodes = ipg;
+        gd->free_blocks = blocks - g * bpg < bpg ? blocks - g * bpg : bpg;
+    }
+    sb->i_bitmap_ptr = sb->groups[0].i_bitmap_ptr;
+    sb->d_bitmap_ptr = sb->groups[0].d_bitmap_ptr;
+    sb->i_blocks_ptr = sb->groups[0].i_blocks_ptr;
+    sb->d_blocks_ptr = sb->groups[0].d_blocks_ptr;
+
+    struct wfs_group_desc *last = &sb->groups[groups - 1];
+    *total = last->d_blocks_ptr + (off_t)last->free_blocks * BLOCK_SIZE;
+    if (csum)
+        *total += roundup(blocks * (int)sizeof(uint32_t), BLOCK_SIZE);
+
+    printf("trying to create with %zu inodes, %d blocks in %d groups, needs %lld bytes\n",
+           sb->num_inodes, blocks, groups, (long long)*total);
+    return sb;
 }
 
 // Setup superblock for disk img. 
-int wfs_mkfs(char* path, int inodes, int blocks) {
+int wfs_mkfs(char* path, int inodes, int blocks, int group_blocks, int csum, off_t align) {
     int fd;
     struct stat statb;
-    struct wfs_sb sb;
+    off_t total;
 
-    if ((fd = open(path, O_RDWR, S_IRWXU)) < 0) {
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
         perror("open failed create metadata\n");
         return -1;
     }
@@ -42,13 +118,46 @@ int wfs_mkfs(char* path, int inodes, int blocks) {
         return -1;
     }
 
-    if (setup_sb(&sb, inodes, blocks, statb.st_size) == 0) {
+    // a new (or empty) image is made as large as it needs to be, sparse
+    struct wfs_sb *sb = setup_sb(inodes, blocks, group_blocks, csum, align, &total);
+    if (statb.st_size == 0 && ftruncate(fd, total) == 0)
+        statb.st_size = total;
+    if (total > statb.st_size) {
         printf("too many blocks requested, failed to write superblock\n");
         close(fd);
         return -1;
     }
 
-    if (write(fd, &sb, sizeof(struct wfs_sb)) < 0) {
+    // clear every group's bitmaps; the root is inode 0 in group 0
+    size_t bitmaps = sb->groups[0].i_blocks_ptr - sb->groups[0].i_bitmap_ptr;
+    char *zero = calloc(1, bitmaps);
+    for (uint32_t g = 0; g < sb->num_groups; g++) {
+        if (pwrite(fd, zero, bitmaps, sb->groups[g].i_bitmap_ptr) < 0) {
+            perror("writing bitmaps\n");
+            return -1;
+        }
+    }
+    free(zero);
+    sb->groups[0].free_inodes--;
+
+    // nothing is in the data blocks yet, so they need no space on the host
+    for (uint32_t g = 0; g < sb->num_groups; g++)
+        punch(fd, sb->groups[g].d_blocks_ptr,
+              sb->groups[g].d_blocks_ptr + (off_t)sb->groups[g].free_blocks * BLOCK_SIZE);
+
+    // no block is in use yet, so the checksums only need to be tidy
+    if (csum) {
+        struct wfs_group_desc *last = &sb->groups[sb->num_groups - 1];
+        off_t at = last->d_blocks_ptr + (off_t)last->free_blocks * BLOCK_SIZE;
+        zero = calloc(1, total - at);
+        if (pwrite(fd, zero, total - at, at) < 0) {
+            perror("writing checksums\n");
+            return -1;
+        }
+        free(zero);
+    }
+
+    if (pwrite(fd, sb, sb_bytes(sb), 0) < 0) {
         perror("writing superblock\n");
         return -1;
     }
@@ -67,26 +176,519 @@ int wfs_mkfs(char* path, int inodes, int blocks) {
 
     // set bitmap
     uint32_t bit = 0x1;
-    lseek(fd, sb.i_bitmap_ptr, SEEK_SET);
+    lseek(fd, sb->i_bitmap_ptr, SEEK_SET);
     write(fd, &bit, sizeof(uint32_t));
 
     // write inode
-    lseek(fd, sb.i_blocks_ptr, SEEK_SET);
+    lseek(fd, sb->i_blocks_ptr, SEEK_SET);
     if (write(fd, &inode, sizeof(struct wfs_inode)) < 0) {
         perror("writing root inode\n");
         return -1;
     }
     
+    free(sb);
     close(fd);
     return 0;
 }
 
+/* ------------------------------ Populate (-r) -----------------------------
+ * Build an image straight from a host directory tree instead of copying it
+ * in through a mount:
+ *
+ *   1. walk the source with a pool of threads (readdir + lstat),
+ *   2. number inodes breadth-first with each directory's entries sorted by
+ *      name, so the same tree always gives the same image,
+ *   3. give every inode one contiguous run of data blocks (a file with an
+ *      indirect block has it first, followed by all of its data),
+ *   4. place inodes in block groups in that order, each group taking an
+ *      even share, with every inode's blocks in its own group,
+ *   5. size the image and fill it: workers each take a run of consecutive
+ *      inodes and write each group's worth of their data with one pwrite,
+ *      and fill in the inode tables through a mapping of the image.
+ * ------------------------------------------------------------------------ */
+
+#define DENTS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(struct wfs_dentry)))
+#define PTRS_PER_BLOCK  ((int)(BLOCK_SIZE / sizeof(off_t)))
+#define MAX_FILE        ((off_t)(D_BLOCK + PTRS_PER_BLOCK) * BLOCK_SIZE)
+#define MAX_DIR         (D_BLOCK * DENTS_PER_BLOCK)
+#define POP_THREADS     16
+#define POP_RUN         64      // inodes per data write
+
+struct node {
+    char name[MAX_NAME];
+    struct stat st;       // lstat of the source
+    char *path;           // source path
+    int first, count;     // children, for directories
+    int inum;
+    int link;             // a second name for an inode numbered elsewhere
+    int nlinks;
+    long block;           // first data block
+    int nblocks;          // including the indirect block
+};
+
+static struct node *nodes;
+static int n_nodes, cap_nodes;
+static int *by_inum, n_inums;
+static long n_blocks_used;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    int *stack;
+    int n, cap, busy;
+    int failed;
+} walk = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int blocks_for(off_t bytes) {
+    int n = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return n + (n > D_BLOCK);
+}
+
+// NULL if 'st' can go in the image as is, else why not
+static const char *unsupported(const struct stat *st, const char *name) {
+    if (strlen(name) >= MAX_NAME) return "name too long";
+    if (S_ISREG(st->st_mode) && st->st_size > MAX_FILE) return "file too large";
+    if (S_ISLNK(st->st_mode) && blocks_for(st->st_size) > D_BLOCK) return "symlink target too long";
+    if (!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode) && !S_ISLNK(st->st_mode))
+        return "not a file, directory or symlink";
+    return NULL;
+}
+
+// read one directory; runs without the lock except to publish the result
+static void scan_dir(int idx, const char *path) {
+    DIR *d = opendir(path);
+    if (!d) {
+        fprintf(stderr, "mkfs: %s: %s\n", path, strerror(errno));
+        walk.failed = 1;
+        return;
+    }
+
+    struct node *kids = NULL;
+    int n = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            kids = realloc(kids, cap * sizeof(*kids));
+        }
+        struct node *k = &kids[n];
+        memset(k, 0, sizeof(*k));
+        size_t len = strlen(path) + strlen(e->d_name) + 2;
+        if (!(k->path = malloc(len))) {
+            walk.failed = 1;
+            break;
+        }
+        snprintf(k->path, len, "%s/%s", path, e->d_name);
+        if (lstat(k->path, &k->st) < 0) {
+            fprintf(stderr, "mkfs: %s/%s: %s\n", path, e->d_name, strerror(errno));
+            walk.failed = 1;
+            continue;
+        }
+        const char *why = unsupported(&k->st, e->d_name);
+        if (why) {
+            fprintf(stderr, "mkfs: %s: %s\n", k->path, why);
+            walk.failed = 1;
+            continue;
+        }
+        strcpy(k->name, e->d_name);
+        n++;
+    }
+    closedir(d);
+    if (n > MAX_DIR) {
+        fprintf(stderr, "mkfs: %s: %d entries, a directory holds at most %d\n", path, n, MAX_DIR);
+        walk.failed = 1;
+    }
+
+    pthread_mutex_lock(&walk.lock);
+    if (n_nodes + n > cap_nodes) {
+        while (n_nodes + n > cap_nodes) cap_nodes *= 2;
+        nodes = realloc(nodes, cap_nodes * sizeof(*nodes));
+        walk.stack = realloc(walk.stack, cap_nodes * sizeof(int));
+    }
+    nodes[idx].first = n_nodes;
+    nodes[idx].count = n;
+    for (int i = 0; i < n; i++) {
+        nodes[n_nodes] = kids[i];
+        if (S_ISDIR(kids[i].st.st_mode))
+            walk.stack[walk.n++] = n_nodes;
+        n_nodes++;
+    }
+    pthread_cond_broadcast(&walk.more);
+    pthread_mutex_unlock(&walk.lock);
+    free(kids);
+}
+
+static void *walker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&walk.lock);
+    for (;;) {
+        while (walk.n == 0 && walk.busy > 0)
+            pthread_cond_wait(&walk.more, &walk.lock);
+        if (walk.n == 0) break;
+
+        int idx = walk.stack[--walk.n];
+        const char *path = nodes[idx].path;
+        walk.busy++;
+        pthread_mutex_unlock(&walk.lock);
+
+        scan_dir(idx, path);
+
+        pthread_mutex_lock(&walk.lock);
+        walk.busy--;
+    }
+    pthread_cond_broadcast(&walk.more);
+    pthread_mutex_unlock(&walk.lock);
+    return NULL;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(((const struct node *)a)->name, ((const struct node *)b)->name);
+}
+
+// hard link candidates, sorted by (dev, ino)
+struct hl { dev_t dev; ino_t ino; int inum; };
+
+static int hl_cmp(const void *a, const void *b) {
+    const struct hl *x = a, *y = b;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+// breadth-first order over the inodes and the size of each one's block run
+static void layout(void) {
+    int n_hl = 0;
+    for (int i = 0; i < n_nodes; i++) {
+        if (S_ISDIR(nodes[i].st.st_mode))
+            qsort(&nodes[nodes[i].first], nodes[i].count, sizeof(struct node), by_name);
+        else if (nodes[i].st.st_nlink > 1)
+            n_hl++;
+    }
+
+    struct hl *hl = calloc(n_hl + 1, sizeof(*hl));
+    n_hl = 0;
+    for (int i = 0; i < n_nodes; i++)
+        if (!S_ISDIR(nodes[i].st.st_mode) && nodes[i].st.st_nlink > 1)
+            hl[n_hl++] = (struct hl){ nodes[i].st.st_dev, nodes[i].st.st_ino, -1 };
+    qsort(hl, n_hl, sizeof(*hl), hl_cmp);
+
+    // nodes[] is in discovery order; a queue over it gives BFS by name
+    by_inum = malloc(n_nodes * sizeof(int));
+    int *queue = malloc(n_nodes * sizeof(int)), head = 0, tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        int idx = queue[head++];
+        struct node *nd = &nodes[idx];
+
+        struct hl key = { nd->st.st_dev, nd->st.st_ino, -1 }, *h = NULL;
+        if (!S_ISDIR(nd->st.st_mode) && nd->st.st_nlink > 1)
+            h = bsearch(&key, hl, n_hl, sizeof(*hl), hl_cmp);
+        if (h && h->inum >= 0) {
+            nd->inum = h->inum;
+            nd->link = 1;
+            nodes[by_inum[h->inum]].nlinks++;
+        } else {
+            nd->inum = n_inums;
+            nd->nlinks = 1;
+            by_inum[n_inums++] = idx;
+            if (h) h->inum = nd->inum;
+        }
+
+        if (S_ISDIR(nd->st.st_mode))
+            for (int k = 0; k < nd->count; k++)
+                queue[tail++] = nd->first + k;
+    }
+    free(queue);
+    free(hl);
+
+    for (int i = 0; i < n_inums; i++) {
+        struct node *nd = &nodes[by_inum[i]];
+        if (S_ISDIR(nd->st.st_mode))
+            nd->nblocks = (nd->count + DENTS_PER_BLOCK - 1) / DENTS_PER_BLOCK;
+        else if (S_ISREG(nd->st.st_mode) || (size_t)nd->st.st_size >= sizeof(((struct wfs_inode *)0)->blocks))
+            nd->nblocks = blocks_for(nd->st.st_size);
+        n_blocks_used += nd->nblocks;
+    }
+}
+
+static struct {
+    struct wfs_sb *sb;
+    struct wfs_layout l;
+    char *map;            // the image, for the superblock, bitmaps and inode tables
+    uint32_t *csums;      // its checksum area, NULL without one
+    int fd;
+    int next;             // next run of inodes to write
+    int failed;
+} img;
+
+static void set_layout(struct wfs_sb *sb) {
+    img.sb = sb;
+    img.l = (struct wfs_layout){
+        .num_inodes = sb->num_inodes, .num_data_blocks = sb->num_data_blocks,
+        .num_groups = sb->num_groups, .inodes_per_group = sb->inodes_per_group,
+        .blocks_per_group = sb->blocks_per_group, .first_group = sb->first_group,
+        .group_stride = sb->group_stride, .groups = sb->groups,
+    };
+}
+
+/* Turn breadth-first positions into inode slots and give each inode its
+ * block run in the same group. Groups are filled in order until they hold
+ * an even share of both the inodes and the blocks, so every subtree leaves
+ * its group room to grow. Returns 0 if the tree does not fit. */
+static int place(void) {
+    struct wfs_sb *sb = img.sb;
+    long share_i = (n_inums + sb->num_groups - 1) / sb->num_groups;
+    long share_b = (n_blocks_used + sb->num_groups - 1) / sb->num_groups;
+    int *slot = malloc(n_inums * sizeof(int));
+    uint32_t g = 0;
+    long icur = 0, bcur = 0;
+
+    for (int i = 0; i < n_inums; i++) {
+        struct node *nd = &nodes[by_inum[i]];
+        for (;;) {
+            int last = g == sb->num_groups - 1;
+            if (icur < sb->inodes_per_group && bcur + nd->nblocks <= wfs_group_blocks(&img.l, g) &&
+                (last || icur < share_i || bcur < share_b))
+                break;
+            sb->groups[g].free_inodes -= icur;
+            sb->groups[g].free_blocks -= bcur;
+            if (++g == sb->num_groups) {
+                free(slot);
+                return 0;
+            }
+            icur = bcur = 0;
+        }
+        slot[i] = g * sb->inodes_per_group + icur++;
+        nd->block = (long)g * sb->blocks_per_group + bcur;
+        bcur += nd->nblocks;
+    }
+    sb->groups[g].free_inodes -= icur;
+    sb->groups[g].free_blocks -= bcur;
+
+    for (int k = 0; k < n_nodes; k++)
+        nodes[k].inum = slot[nodes[k].inum];
+    free(slot);
+    return 1;
+}
+
+static off_t block_off(long b) {
+    return wfs_block_off(&img.l, b);
+}
+
+// fill in the inode and its blocks; 'data' is where nd->block lands in memory
+static int emit(struct node *nd, char *data) {
+    struct wfs_inode *inode = (struct wfs_inode *)(img.map + wfs_inode_off(&img.l, nd->inum));
+
+    inode->num = nd->inum;    inode->mode = nd->st.st_mode;
+    inode->uid = nd->st.st_uid;
+    inode->gid = nd->st.st_gid;
+    inode->nlinks = nd->nlinks;
+    inode->atim = nd->st.st_atim.tv_sec;
+    inode->mtim = nd->st.st_mtim.tv_sec;
+    inode->ctim = nd->st.st_ctim.tv_sec;
+    inode->atim_ns = nd->st.st_atim.tv_nsec;
+    inode->mtim_ns = nd->st.st_mtim.tv_nsec;
+    inode->ctim_ns = nd->st.st_ctim.tv_nsec;
+    inode->size = S_ISDIR(nd->st.st_mode) ? (off_t)nd->nblocks * BLOCK_SIZE : nd->st.st_size;
+
+    if (S_ISDIR(nd->st.st_mode)) {
+        struct wfs_dentry *d = (struct wfs_dentry *)data;
+        for (int k = 0; k < nd->count; k++) {
+            strcpy(d[k].name, nodes[nd->first + k].name);
+            d[k].num = nodes[nd->first + k].inum;
+        }
+        for (int k = 0; k < nd->nblocks; k++)
+            inode->blocks[k] = block_off(nd->block + k);
+        return 0;
+    }
+
+    if (nd->nblocks == 0) {    // empty file, or a fast symlink with its target in blocks[]
+        if (S_ISLNK(nd->st.st_mode) && readlink(nd->path, (char *)inode->blocks, sizeof(inode->blocks)) < 0)
+            return -errno;
+        return 0;
+    }
+
+    // an indirect block comes first so the data after it is contiguous
+    int ind = nd->nblocks > D_BLOCK;
+    char *bytes = data + ind * BLOCK_SIZE;
+    for (int k = 0; k < nd->nblocks - ind; k++) {
+        off_t at = block_off(nd->block + ind + k);
+        if (k < D_BLOCK)
+            inode->blocks[k] = at;
+        else
+            ((off_t *)data)[k - D_BLOCK] = at;
+    }
+    if (ind)
+        inode->blocks[IND_SLOT] = block_off(nd->block);
+
+    if (S_ISLNK(nd->st.st_mode))
+        return readlink(nd->path, bytes, nd->st.st_size) < 0 ? -errno : 0;
+
+    int fd = open(nd->path, O_RDONLY);
+    if (fd < 0) return -errno;
+    for (off_t done = 0; done < nd->st.st_size; ) {
+        ssize_t r = pread(fd, bytes + done, nd->st.st_size - done, done);
+        if (r < 0) { close(fd); return -errno; }
+        if (r == 0) break;     // shrank since the walk; the rest stays zero
+        done += r;
+    }
+    close(fd);
+    return 0;
+}
+
+// same-group inodes in a run have their blocks back to back: one pwrite each
+static void *writer(void *arg) {
+    (void)arg;
+    char *buf = NULL;
+    size_t cap = 0;
+
+    for (;;) {
+        int lo = __atomic_fetch_add(&img.next, POP_RUN, __ATOMIC_RELAXED);
+        if (lo >= n_inums) break;
+        int hi = lo + POP_RUN < n_inums ? lo + POP_RUN : n_inums;
+
+        for (int s = lo, e; s < hi; s = e) {
+            uint32_t g = nodes[by_inum[s]].inum / img.sb->inodes_per_group;
+            for (e = s + 1; e < hi && nodes[by_inum[e]].inum / img.sb->inodes_per_group == g; e++)
+                ;
+
+            long first = nodes[by_inum[s]].block;
+            struct node *last = &nodes[by_inum[e - 1]];
+            size_t len = (size_t)(last->block + last->nblocks - first) * BLOCK_SIZE;
+            if (len > cap) {
+                free(buf);
+                cap = len;
+                buf = malloc(cap);
+            }
+            memset(buf, 0, len);
+
+            for (int i = s; i < e; i++) {
+                struct node *nd = &nodes[by_inum[i]];
+                int err = emit(nd, buf + (nd->block - first) * BLOCK_SIZE);
+                if (err < 0) {
+                    fprintf(stderr, "mkfs: %s: %s\n", nd->path, strerror(-err));
+                    img.failed = 1;
+                }
+            }
+            if (img.csums)
+                for (size_t k = 0; k < len / BLOCK_SIZE; k++)
+                    img.csums[first + k] = crc32c(0, buf + k * BLOCK_SIZE, BLOCK_SIZE);
+            if (len && pwrite(img.fd, buf, len, block_off(first)) != (ssize_t)len) {
+                perror("mkfs: writing data");
+                img.failed = 1;
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void set_bits(char *map, long n) {
+    memset(map, 0xff, n / 8);
+    for (long i = n & ~7L; i < n; i++)
+        map[i / 8] |= 1 << (i % 8);
+}
+
+// -i/-b are minimums here; by default leave a quarter of each free
+static int wfs_populate(char *path, const char *src, int inodes, int blocks, int group_blocks, int csum, off_t align) {
+    struct stat st;
+    if (stat(src, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "mkfs: %s is not a directory\n", src);
+        return -1;
+    }
+
+    cap_nodes = 1024;
+    nodes = calloc(cap_nodes, sizeof(*nodes));
+    walk.stack = malloc(cap_nodes * sizeof(int));
+    nodes[0].path = strdup(src);
+    nodes[0].st = st;
+    n_nodes = 1;
+    walk.stack[walk.n++] = 0;
+
+    pthread_t th[POP_THREADS];
+    for (int t = 0; t < POP_THREADS; t++)
+        pthread_create(&th[t], NULL, walker, NULL);
+    for (int t = 0; t < POP_THREADS; t++)
+        pthread_join(th[t], NULL);
+    if (walk.failed) return -1;
+
+    layout();
+
+    int want_i = n_inums + n_inums / 4, want_b = n_blocks_used + n_blocks_used / 4;
+    if (inodes < want_i && inodes < n_inums) inodes = want_i;
+    if (blocks < want_b && blocks < n_blocks_used) blocks = want_b;
+
+    // runs that do not fit at the end of a group waste its tail; add room until it all fits
+    off_t total;
+    set_layout(setup_sb(inodes, blocks, group_blocks, csum, align, &total));
+    while (!place()) {
+        free(img.sb);
+        inodes += inodes / 8 + 32;
+        blocks += blocks / 8 + 32;
+        set_layout(setup_sb(inodes, blocks, group_blocks, csum, align, &total));
+    }
+
+    if ((img.fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        perror("open failed create metadata\n");
+        return -1;
+    }
+    // sparse: only what is written below takes space on the host, and
+    // whatever an old image left in the data blocks goes
+    struct stat cur;
+    int err = fstat(img.fd, &cur) < 0 || (cur.st_size < total && ftruncate(img.fd, total) < 0) ? errno : 0;
+    for (uint32_t g = 0; g < img.sb->num_groups && !err; g++)
+        punch(img.fd, img.sb->groups[g].d_blocks_ptr,
+              img.sb->groups[g].d_blocks_ptr + (off_t)wfs_group_blocks(&img.l, g) * BLOCK_SIZE);
+    if (err) {
+        fprintf(stderr, "mkfs: sizing %s to %lld bytes: %s\n", path, (long long)total, strerror(err));
+        return -1;
+    }
+
+    img.map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, img.fd, 0);
+    if (img.map == MAP_FAILED) {
+        perror("mkfs: mapping image");
+        return -1;
+    }
+    memcpy(img.map, img.sb, sb_bytes(img.sb));
+    for (uint32_t g = 0; g < img.sb->num_groups; g++) {
+        struct wfs_group_desc *gd = &img.sb->groups[g];
+        memset(img.map + gd->i_bitmap_ptr, 0, gd->i_blocks_ptr - gd->i_bitmap_ptr);
+        set_bits(img.map + gd->i_bitmap_ptr, wfs_group_inodes(&img.l, g) - gd->free_inodes);
+        set_bits(img.map + gd->d_bitmap_ptr, wfs_group_blocks(&img.l, g) - gd->free_blocks);
+    }
+    off_t csum_off = wfs_csum_off(&img.l), page = csum_off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    if (csum) {
+        img.csums = (uint32_t *)(img.map + csum_off);
+        memset(img.csums, 0, total - csum_off);
+    }
+
+    for (int t = 0; t < POP_THREADS; t++)
+        pthread_create(&th[t], NULL, writer, NULL);
+    for (int t = 0; t < POP_THREADS; t++)
+        pthread_join(th[t], NULL);
+
+    if (msync(img.map, img.sb->groups[img.sb->num_groups - 1].d_blocks_ptr, MS_SYNC) < 0 ||
+        (csum && msync(img.map + page, total - page, MS_SYNC) < 0)) {
+        perror("mkfs: writing metadata");
+        img.failed = 1;
+    }
+    munmap(img.map, total);
+    if (fsync(img.fd) < 0 || close(img.fd) < 0) img.failed = 1;
+
+    printf("populated %d inodes, %ld blocks in %u groups from %s (%lld byte image)\n",
+           n_inums, n_blocks_used, img.sb->num_groups, src, (long long)total);
+    return img.failed ? -1 : 0;
+}
+
 int main(int argc, char* argv[]) {
-    char* diskimg;
-    int inodes, blocks;
+    char* diskimg = NULL;
+    char* srcdir = NULL;
+    int inodes = 0, blocks = 0, group_blocks = WFS_DEF_GROUP_BLOCKS, csum = 1;
+    off_t align = WFS_PAGE_SIZE;
+    char *unit;
     int opt;
     
-    while ((opt = getopt(argc, argv, "d:i:b:")) != -1) {
+    while ((opt = getopt(argc, argv, "d:i:b:g:r:na:")) != -1) {
         switch (opt) {
         case 'd':
             diskimg = optarg;
@@ -97,11 +699,34 @@ int main(int argc, char* argv[]) {
         case 'b':
             blocks = atoi(optarg);
             break;
+        case 'g':
+            group_blocks = atoi(optarg);
+            break;
+        case 'r':
+            srcdir = optarg;
+            break;
+        case 'n':
+            csum = 0;
+            break;
+        case 'a':
+            align = strtol(optarg, &unit, 0);
+            if (*unit == 'k' || *unit == 'K') align <<= 10;
+            if (*unit == 'm' || *unit == 'M') align <<= 20;
+            break;
         default:
-            printf("usage: ./mkfs -d <disk img> -i <num inodes> -b <num data blocks>\n");
-            exit(1);
+            goto usage;
         }
     }
-    
-    return wfs_mkfs(diskimg, inodes, blocks);
+    // the data alignment is a power of two, from a page up
+    if (!diskimg || group_blocks <= 0 || (!srcdir && (inodes <= 0 || blocks <= 0)) ||
+        align < WFS_PAGE_SIZE || (align & (align - 1))) {
+usage:
+        printf("usage: ./mkfs -d <disk img> -i <num inodes> -b <num data blocks> [-g <blocks per group>] [-a <data alignment>] [-n]\n"
+               "       ./mkfs -d <disk img> -r <source dir> [-i <min inodes>] [-b <min data blocks>] [-g <blocks per group>] [-a <data alignment>] [-n]\n");
+        exit(1);
+    }
+
+    if (srcdir)
+        return wfs_populate(diskimg, srcdir, inodes, blocks, group_blocks, csum, align) < 0 ? 1 : 0;
+    return wfs_mkfs(diskimg, inodes, blocks, group_blocks, csum, align);
 }
@@ -0,0 +1,315 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "wfs.h"
+#include "libwfs.h"
+#include "stats.h"
+#include "trace.h"
+
+/* --------------------------------------------------------------------------
+ * WFS trace replay
+ *
+ * Re-issues a trace recorded by `wfs --trace=FILE` against an image through
+ * libwfs, normally one freshly made by mkfs:
+ *
+ *     ./mkfs -d img -i 1024 -b 4096 && ./wfs_replay -i img trace.bin
+ *
+ * Records are replayed in start order from a single thread, back to back or
+ * (-t) at their original pace. The trace only starts when tracing was
+ * enabled, so a path it touches may already have existed on the recorded
+ * mount. Before such an operation is timed, the missing file or directory
+ * (and its parents) is created and files are grown to cover the recorded
+ * read, so the replayed operation does the same work as the original.
+ *
+ * Per-op latencies are printed in the /.wfs/stats format, followed by the
+ * number of operations whose outcome (success or failure) differed from the
+ * recording.
+ * --------------------------------------------------------------------------
+ */
+
+static struct wfs_ctx *img;
+static struct wfs_stats *st;    // replayed ops only; img's own stats also see setup
+static char io_buf[BLOCK_SIZE * N_BLOCKS * 64];
+
+static void die(const char *what, const char *arg) {
+    fprintf(stderr, "wfs_replay: %s %s: %s\n", what, arg, strerror(errno));
+    exit(1);
+}
+
+static struct wfs_trace_rec *load(const char *path, uint64_t *count) {
+    FILE *f = fopen(path, "rb");
+    if (!f) die("open", path);
+
+    struct wfs_trace_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, WFS_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != WFS_TRACE_VERSION ||
+        hdr.rec_size != sizeof(struct wfs_trace_rec)) {
+        fprintf(stderr, "wfs_replay: %s is not a version %d trace\n", path, WFS_TRACE_VERSION);
+        exit(1);
+    }
+
+    struct wfs_trace_rec *recs = malloc((hdr.count ? hdr.count : 1) * sizeof(*recs));
+    if (!recs) die("load", path);
+    if (fread(recs, sizeof(*recs), hdr.count, f) != hdr.count) die("read", path);
+    fclose(f);
+
+    if (hdr.dropped)
+        fprintf(stderr, "wfs_replay: %llu records were lost to ring wrap-around\n",
+                (unsigned long long)hdr.dropped);
+    *count = hdr.count;
+    return recs;
+}
+
+/* ---------------------------- Materialization ----------------------------- */
+static int is_ctl(const char *path) {
+    return strncmp(path, "/.wfs", 5) == 0 && (path[5] == '\0' || path[5] == '/');
+}
+
+// mkdir and rmdir right inside /.snapshots take and drop snapshots
+static const char *snapshot_name(const char *path) {
+    static const char prefix[] = "/" WFS_SNAPSHOT_DIR "/";
+    size_t n = sizeof(prefix) - 1;
+    if (strncmp(path, prefix, n) != 0 || strchr(path + n, '/')) return NULL;
+    return path + n;
+}
+
+static void make_parents(const char *path) {
+    char buf[TRACE_PATH];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *p = strchr(buf + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        wfs_create(img, buf, S_IFDIR | 0755);
+        *p = '/';
+    }
+}
+
+// make `path` exist as a directory or a file of at least `size` bytes
+static void ensure(const char *path, int dir, off_t size) {
+    int inum;
+    if (!*path || strcmp(path, "/") == 0 || is_ctl(path)) return;
+
+    if (wfs_lookup(img, path, &inum) < 0) {
+        make_parents(path);
+        inum = wfs_create(img, path, (dir ? S_IFDIR : S_IFREG) | 0644);
+        if (inum < 0) return;
+    }
+
+    struct stat sb;
+    if (!dir && size > 0 && wfs_stat(img, inum, &sb) == 0 && sb.st_size < size) {
+        static const char zero[BLOCK_SIZE];
+        for (off_t off = sb.st_size; off < size; off += BLOCK_SIZE) {
+            size_t n = size - off < BLOCK_SIZE ? size - off : BLOCK_SIZE;
+            if (wfs_pwrite(img, inum, zero, n, off) < 0) break;
+        }
+    }
+}
+
+// recreate the state the recorded operation found, outside the timed region
+static void prepare(const struct wfs_trace_rec *r) {
+    if (r->result < 0) return;
+
+    switch (r->op) {
+    case WFS_OP_MKNOD:
+    case WFS_OP_MKDIR:
+    case WFS_OP_SYMLINK:
+        if (!snapshot_name(r->path)) make_parents(r->path);
+        break;
+    case WFS_OP_RMDIR:
+        if (snapshot_name(r->path))
+            wfs_snapshot(img, snapshot_name(r->path));
+        else
+            ensure(r->path, 1, 0);
+        break;
+    case WFS_OP_READ:
+        ensure(r->path, 0, r->offset + r->result);
+        break;
+    case WFS_OP_READDIR:
+        ensure(r->path, 1, 0);
+        break;
+    case WFS_OP_RENAME:
+    case WFS_OP_LINK:
+        ensure(r->path, 0, 0);
+        make_parents(r->path2);
+        break;
+    case WFS_OP_STATFS:
+        break;
+    default:
+        ensure(r->path, 0, 0);
+        break;
+    }
+}
+
+/* --------------------------------- Replay --------------------------------- */
+static int lookup(const char *path) {
+    int inum;
+    int rc = wfs_lookup(img, path, &inum);
+    return rc < 0 ? rc : inum;
+}
+
+// what wfs_readdir does per entry besides filling the buffer
+static int visit_entry(void *arg, const char *name, int inum) {
+    (void)name;
+    *(int *)arg += wfs_get_color(img, inum) >= 0;
+    return 0;
+}
+
+static int issue(const struct wfs_trace_rec *r) {
+    int inum = 0, rc;
+    size_t len = r->length < sizeof(io_buf) ? r->length : sizeof(io_buf);
+
+    switch (r->op) {
+    case WFS_OP_MKNOD:
+        rc = wfs_create(img, r->path, S_IFREG | (r->mode & 07777));
+        return rc < 0 ? rc : 0;
+    case WFS_OP_MKDIR:
+        if (snapshot_name(r->path))
+            return wfs_snapshot(img, snapshot_name(r->path));
+        rc = wfs_create(img, r->path, S_IFDIR | (r->mode & 07777));
+        return rc < 0 ? rc : 0;
+    case WFS_OP_UNLINK:
+        return wfs_remove(img, r->path);
+    case WFS_OP_RMDIR:
+        if (snapshot_name(r->path))
+            return wfs_snapshot_delete(img, snapshot_name(r->path));
+        return wfs_remove(img, r->path);
+    case WFS_OP_RENAME:
+        return wfs_move(img, r->path, r->path2, 0);
+    case WFS_OP_LINK:
+        return wfs_hardlink(img, r->path, r->path2);
+    case WFS_OP_SYMLINK:
+        return wfs_make_symlink(img, r->path2, r->path);
+    case WFS_OP_STATFS: {
+        struct statvfs sv;
+        return wfs_fsstat(img, &sv);
+    }
+    }
+
+    if ((inum = lookup(r->path)) < 0)
+        return inum;
+
+    switch (r->op) {
+    case WFS_OP_GETATTR: {
+        struct stat sb;
+        return wfs_stat(img, inum, &sb);
+    }
+    case WFS_OP_READ:
+        return wfs_pread(img, inum, io_buf, len, r->offset);
+    case WFS_OP_WRITE:
+        return wfs_pwrite(img, inum, io_buf, len, r->offset);
+    case WFS_OP_READDIR:
+        rc = 0;
+        return wfs_iterate(img, inum, visit_entry, &rc);
+    case WFS_OP_READLINK:
+        return wfs_read_symlink(img, inum, io_buf, PATH_MAX);
+    case WFS_OP_SETXATTR:
+        if (strcmp(r->path2, "user.compress") == 0)
+            return wfs_set_compress(img, inum, r->mode);
+        if (strcmp(r->path2, "user.color") == 0)
+            return wfs_set_color(img, inum, r->mode);
+        return wfs_set_xattr(img, inum, r->path2, io_buf, len, 0);
+    case WFS_OP_GETXATTR:
+        if (strcmp(r->path2, "user.compress") == 0)
+            return wfs_get_compress(img, inum);
+        if (strcmp(r->path2, "user.color") == 0)
+            return wfs_get_color(img, inum);
+        return wfs_get_xattr(img, inum, r->path2, io_buf, len);
+    case WFS_OP_REMOVEXATTR:
+        if (strcmp(r->path2, "user.compress") == 0)
+            return wfs_set_compress(img, inum, 0);
+        if (strcmp(r->path2, "user.color") == 0)
+            return wfs_set_color(img, inum, WFS_COLOR_NONE);
+        return wfs_remove_xattr(img, inum, r->path2);
+    case WFS_OP_LISTXATTR:
+        return wfs_list_xattr(img, inum, io_buf, len);
+    case WFS_OP_FSYNC:
+        return wfs_sync(img);
+    default:  // open, truncate: resolution is the work
+        return 0;
+    }
+}
+
+static void sleep_until(uint64_t t0, uint64_t at) {
+    uint64_t now = stats_clock() - t0;
+    if (at <= now) return;
+    struct timespec ts = { (at - now) / 1000000000ull, (at - now) % 1000000000ull };
+    nanosleep(&ts, NULL);
+}
+
+int main(int argc, char *argv[]) {
+    int opt, paced = 0;
+    const char *image = NULL;
+
+    while ((opt = getopt(argc, argv, "i:t")) != -1) {
+        switch (opt) {
+        case 'i':
+            image = optarg;
+            break;
+        case 't':
+            paced = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (!image || optind != argc - 1) {
+usage:
+        printf("usage: ./wfs_replay -i <disk img> [-t] <trace file>\n");
+        exit(1);
+    }
+
+    uint64_t count;
+    struct wfs_trace_rec *recs = load(argv[optind], &count);
+    if (!(img = wfs_open_image(image))) die("open image", image);
+    wfs_start_loaders(img);
+    if (!(st = calloc(1, sizeof(*st)))) die("alloc", "stats");
+
+    uint64_t mismatched = 0, replayed = 0, busy = 0;
+    struct wfs_counters setup = { 0 };
+    uint64_t t0 = stats_clock();
+    for (uint64_t i = 0; i < count; i++) {
+        struct wfs_trace_rec *r = &recs[i];
+        if (r->op >= WFS_OP_MAX || is_ctl(r->path)) continue;
+
+        // keep the core counters free of setup work
+        struct wfs_counters before = wfs_get_stats(img)->c;
+        prepare(r);
+        uint64_t *a = (uint64_t *)&before, *b = (uint64_t *)&wfs_get_stats(img)->c;
+        uint64_t *out = (uint64_t *)&setup;
+        for (size_t k = 0; k < sizeof(setup) / sizeof(uint64_t); k++)
+            out[k] += b[k] - a[k];
+
+        if (paced) sleep_until(t0, r->start_ns - recs[0].start_ns);
+
+        uint64_t start = stats_clock();
+        int rc = issue(r);
+        uint64_t ns = stats_clock() - start;
+
+        stats_record(st, r->op, ns, rc < 0);
+        busy += ns;
+        replayed++;
+        if ((rc < 0) != (r->result < 0)) mismatched++;
+    }
+
+    uint64_t *c = (uint64_t *)&st->c, *total = (uint64_t *)&wfs_get_stats(img)->c;
+    for (size_t k = 0; k < sizeof(setup) / sizeof(uint64_t); k++)
+        c[k] = total[k] - ((uint64_t *)&setup)[k];
+
+    static char text[16384];
+    stats_format(st, text, sizeof(text));
+    fputs(text, stdout);
+    printf("{\"workload\":\"replay\",\"ops\":%llu,\"busy_secs\":%.6f,\"ops_per_sec\":%.1f,\"mismatched\":%llu}\n",
+           (unsigned long long)replayed, busy / 1e9,
+           busy ? replayed / (busy / 1e9) : 0.0, (unsigned long long)mismatched);
+
+    wfs_close_image(img);
+    free(recs);
+    free(st);
+    return 0;
+}
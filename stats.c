@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include "stats.h"
+
+static const char *op_names[WFS_OP_MAX] = {
+    [WFS_OP_GETATTR]     = "getattr",
+    [WFS_OP_MKNOD]       = "mknod",
+    [WFS_OP_MKDIR]       = "mkdir",
+    [WFS_OP_READ]        = "read",
+    [WFS_OP_WRITE]       = "write",
+    [WFS_OP_READDIR]     = "readdir",
+    [WFS_OP_UNLINK]      = "unlink",
+    [WFS_OP_RMDIR]       = "rmdir",
+    [WFS_OP_RENAME]      = "rename",
+    [WFS_OP_LINK]        = "link",
+    [WFS_OP_SYMLINK]     = "symlink",
+    [WFS_OP_READLINK]    = "readlink",
+    [WFS_OP_STATFS]      = "statfs",
+    [WFS_OP_SETXATTR]    = "setxattr",
+    [WFS_OP_GETXATTR]    = "getxattr",
+    [WFS_OP_REMOVEXATTR] = "removexattr",
+    [WFS_OP_OPEN]        = "open",
+    [WFS_OP_TRUNCATE]    = "truncate",
+    [WFS_OP_FSYNC]       = "fsync",
+    [WFS_OP_LISTXATTR]   = "listxattr",
+};
+
+const char *stats_op_name(int op)
+{
+    return op >= 0 && op < WFS_OP_MAX ? op_names[op] : "?";
+}
+
+static int bucket_of(uint64_t ns)
+{
+    if (ns < HIST_SUB) return (int)ns;
+
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((ns >> shift) & (HIST_SUB - 1));
+}
+
+// smallest value that lands in bucket 'b'
+static uint64_t bucket_floor(int b)
+{
+    if (b < HIST_SUB) return b;
+
+    int shift = b / HIST_SUB - 1;
+    return ((uint64_t)HIST_SUB + (b % HIST_SUB)) << shift;
+}
+
+void stats_record(struct wfs_stats *st, int op, uint64_t ns, int failed)
+{
+#ifndef WFS_NO_STATS
+    struct wfs_hist *h = &st->ops[op];
+
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    if (failed)
+        __atomic_fetch_add(&h->errors, 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+#endif
+}
+
+/* Latency (usec) below which a fraction 'p' of the samples fall, reported as
+ * the midpoint of the bucket that crosses it. */
+double stats_percentile(const struct wfs_hist *h, double p)
+{
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (count == 0) return 0.0;
+
+    uint64_t want = (uint64_t)(p * count + 0.5);
+    if (want == 0) want = 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if (seen >= want) {
+            uint64_t lo = bucket_floor(b);
+            uint64_t hi = b + 1 < HIST_BUCKETS ? bucket_floor(b + 1) : lo;
+            return (lo + hi) / 2 / 1000.0;
+        }
+    }
+    return h->max_ns / 1000.0;
+}
+
+/* Render the stats as text: one line per operation that has been called,
+ * then one "name value" line per internal counter. */
+int stats_format(const struct wfs_stats *st, char *buf, size_t len)
+{
+    size_t n = 0;
+
+#define EMIT(...) do { \
+        int w = snprintf(buf + n, n < len ? len - n : 0, __VA_ARGS__); \
+        if (w > 0) n += w; \
+    } while (0)
+
+    EMIT("# op calls errors avg_us p50_us p90_us p99_us p999_us max_us\n");
+    for (int op = 0; op < WFS_OP_MAX; op++) {
+        const struct wfs_hist *h = &st->ops[op];
+        uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        if (count == 0) continue;
+
+        EMIT("%s %lu %lu %.3f %.3f %.3f %.3f %.3f %.3f\n", op_names[op],
+             (unsigned long)count, (unsigned long)h->errors,
+             h->sum_ns / 1000.0 / count,
+             stats_percentile(h, 0.50), stats_percentile(h, 0.90),
+             stats_percentile(h, 0.99), stats_percentile(h, 0.999),
+             h->max_ns / 1000.0);
+    }
+
+    const struct wfs_counters *c = &st->c;
+    EMIT("# counter value\n");
+    EMIT("dentry_scanned %lu\n", (unsigned long)c->dentry_scanned);
+    EMIT("bitmap_words %lu\n", (unsigned long)c->bitmap_words);
+    EMIT("data_offset_calls %lu\n", (unsigned long)c->data_offset_calls);
+    EMIT("inodes_allocated %lu\n", (unsigned long)c->inodes_allocated);
+    EMIT("inodes_freed %lu\n", (unsigned long)c->inodes_freed);
+    EMIT("blocks_allocated %lu\n", (unsigned long)c->blocks_allocated);
+    EMIT("blocks_freed %lu\n", (unsigned long)c->blocks_freed);
+    EMIT("enospc %lu\n", (unsigned long)c->enospc);
+    EMIT("range_errors %lu\n", (unsigned long)c->range_errors);
+    EMIT("clusters_packed %lu\n", (unsigned long)c->clusters_packed);
+    EMIT("clusters_unpacked %lu\n", (unsigned long)c->clusters_unpacked);
+    EMIT("clusters_decoded %lu\n", (unsigned long)c->clusters_decoded);
+    EMIT("blocks_deduped %lu\n", (unsigned long)c->blocks_deduped);
+    EMIT("blocks_unshared %lu\n", (unsigned long)c->blocks_unshared);
+    EMIT("csums_verified %lu\n", (unsigned long)c->csums_verified);
+    EMIT("csum_errors %lu\n", (unsigned long)c->csum_errors);
+    EMIT("seq_retries %lu\n", (unsigned long)c->seq_retries);
+    EMIT("blocks_moved %lu\n", (unsigned long)c->blocks_moved);
+    EMIT("blocks_punched %lu\n", (unsigned long)c->blocks_punched);
+    EMIT("xattr_shared %lu\n", (unsigned long)c->xattr_shared);
+    EMIT("groups_counted %lu\n", (unsigned long)c->groups_counted);
+
+#undef EMIT
+    return (int)n;
+}
+
+void stats_reset(struct wfs_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+}
@@ -0,0 +1,104 @@
+#ifndef WFS_STATS_H
+#define WFS_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+  Low-overhead instrumentation for the mount. Every FUSE entry point records
+  its latency into a log-linear (HDR-style) histogram: values below
+  HIST_SUB are exact, above that each power of two is split into HIST_SUB
+  linear sub-buckets, so any recorded latency is within 1/HIST_SUB of its
+  bucket's lower bound. Updates are relaxed atomic adds, so the histograms
+  and counters are safe to bump from any thread without a lock.
+*/
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// one per wfs_ops entry
+enum wfs_op {
+    WFS_OP_GETATTR,
+    WFS_OP_MKNOD,
+    WFS_OP_MKDIR,
+    WFS_OP_READ,
+    WFS_OP_WRITE,
+    WFS_OP_READDIR,
+    WFS_OP_UNLINK,
+    WFS_OP_RMDIR,
+    WFS_OP_RENAME,
+    WFS_OP_LINK,
+    WFS_OP_SYMLINK,
+    WFS_OP_READLINK,
+    WFS_OP_STATFS,
+    WFS_OP_SETXATTR,
+    WFS_OP_GETXATTR,
+    WFS_OP_REMOVEXATTR,
+    WFS_OP_OPEN,
+    WFS_OP_TRUNCATE,
+    WFS_OP_FSYNC,
+    WFS_OP_LISTXATTR,
+    WFS_OP_MAX
+};
+
+struct wfs_hist {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// internal hot-path counters
+struct wfs_counters {
+    uint64_t dentry_scanned;       // dentry slots looked at
+    uint64_t bitmap_words;         // bitmap words looked at by allocation/statfs
+    uint64_t data_offset_calls;
+    uint64_t inodes_allocated;
+    uint64_t inodes_freed;
+    uint64_t blocks_allocated;
+    uint64_t blocks_freed;
+    uint64_t enospc;               // allocation or capacity failures
+    uint64_t range_errors;         // out-of-range inode/block/offset requests
+    uint64_t clusters_packed;      // clusters stored compressed
+    uint64_t clusters_unpacked;    // compressed clusters rewritten plain for a write
+    uint64_t clusters_decoded;     // cluster cache misses
+    uint64_t blocks_deduped;       // file blocks pointed at an identical block
+    uint64_t blocks_unshared;      // shared blocks copied for a write
+    uint64_t csums_verified;       // blocks checked against their checksum
+    uint64_t csum_errors;          // ...and found not to match
+    uint64_t seq_retries;          // lock-free reads redone after a racing write
+    uint64_t blocks_moved;         // file blocks relocated by defragmentation
+    uint64_t blocks_punched;       // free data blocks given back to the host as holes
+    uint64_t xattr_shared;         // xattr blocks shared with an identical one instead of written
+    uint64_t groups_counted;       // groups whose free counts were recounted from their bitmaps
+};
+
+struct wfs_stats {
+    struct wfs_hist ops[WFS_OP_MAX];
+    struct wfs_counters c;
+};
+
+#ifdef WFS_NO_STATS
+#define STAT_ADD(fs, field, n) ((void)0)
+#else
+#define STAT_ADD(fs, field, n) __atomic_fetch_add(&(fs)->stats.c.field, (n), __ATOMIC_RELAXED)
+#endif
+#define STAT_INC(fs, field) STAT_ADD(fs, field, 1)
+
+static inline uint64_t stats_clock(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+const char *stats_op_name(int op);
+void stats_record(struct wfs_stats *st, int op, uint64_t ns, int failed);
+double stats_percentile(const struct wfs_hist *h, double p);
+int stats_format(const struct wfs_stats *st, char *buf, size_t len);
+void stats_reset(struct wfs_stats *st);
+
+#endif
@@ -0,0 +1,161 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+#include "trace.h"
+
+int trace_enabled = 0;
+
+struct trace_ring {
+    struct trace_ring *next;
+    int owned;                 // claimed by a live thread
+    uint16_t id;
+    uint64_t head;             // records ever written; slot = head & mask
+    struct wfs_trace_rec recs[];
+};
+
+static struct trace_ring *rings;   // push-only list, never freed
+static size_t ring_cap;            // power of two
+static uint64_t trace_epoch;
+static pthread_key_t ring_key;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring *my_ring;
+
+// a thread exiting hands its ring (and its records) to the next new thread
+static void ring_release(void *arg)
+{
+    struct trace_ring *r = arg;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+int trace_init(size_t records_per_thread)
+{
+    ring_cap = 1;
+    while (ring_cap < records_per_thread)
+        ring_cap <<= 1;
+
+    if (pthread_key_create(&ring_key, ring_release) != 0)
+        return -ENOMEM;
+
+    trace_epoch = stats_clock();
+    trace_enabled = 1;
+    return 0;
+}
+
+uint64_t trace_rel(uint64_t clock_ns)
+{
+    return clock_ns - trace_epoch;
+}
+
+static struct trace_ring *ring_claim(void)
+{
+    struct trace_ring *r;
+    int unowned = 0;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unowned = 0;
+        if (__atomic_compare_exchange_n(&r->owned, &unowned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            goto claimed;
+    }
+
+    r = calloc(1, sizeof(*r) + ring_cap * sizeof(struct wfs_trace_rec));
+    if (!r) return NULL;
+    r->owned = 1;
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    r->id = r->next ? r->next->id + 1 : 0;
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        r->id = r->next ? r->next->id + 1 : 0;
+
+claimed:
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+struct wfs_trace_rec *trace_begin(void)
+{
+    if (!my_ring && !(my_ring = ring_claim()))
+        return NULL;
+
+    uint64_t h = __atomic_load_n(&my_ring->head, __ATOMIC_RELAXED);
+    struct wfs_trace_rec *rec = &my_ring->recs[h & (ring_cap - 1)];
+    rec->thread = my_ring->id;
+    return rec;
+}
+
+void trace_commit(void)
+{
+    __atomic_fetch_add(&my_ring->head, 1, __ATOMIC_RELEASE);
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+    const struct wfs_trace_rec *x = a, *y = b;
+    return x->start_ns < y->start_ns ? -1 : x->start_ns > y->start_ns;
+}
+
+/*
+ * Snapshot every ring into one array sorted by start time. The writer
+ * keeps going while we copy, so after copying re-read its head: every
+ * slot it may have started overwriting since (index > head2 - cap) is
+ * discarded.
+ */
+int trace_dump(const char *path)
+{
+    if (!trace_enabled) return 0;
+    pthread_mutex_lock(&dump_lock);
+
+    size_t n_rings = 0;
+    for (struct trace_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        n_rings++;
+
+    struct wfs_trace_rec *out = malloc((n_rings ? n_rings : 1) * ring_cap * sizeof(*out));
+    if (!out) {
+        pthread_mutex_unlock(&dump_lock);
+        return -ENOMEM;
+    }
+
+    struct wfs_trace_hdr hdr = { .version = WFS_TRACE_VERSION,
+                                 .rec_size = sizeof(struct wfs_trace_rec) };
+    memcpy(hdr.magic, WFS_TRACE_MAGIC, sizeof(hdr.magic));
+
+    size_t n = 0;
+    struct trace_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (size_t k = 0; k < n_rings; k++, r = r->next) {
+        uint64_t h1 = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t lo = h1 > ring_cap ? h1 - ring_cap : 0;
+        size_t first = n;
+        for (uint64_t i = lo; i < h1; i++)
+            out[n++] = r->recs[i & (ring_cap - 1)];
+
+        uint64_t h2 = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t safe = h2 + 1 > ring_cap ? h2 + 1 - ring_cap : 0;
+        if (safe > lo) {
+            size_t torn = safe - lo < h1 - lo ? safe - lo : h1 - lo;
+            memmove(&out[first], &out[first + torn], (n - first - torn) * sizeof(*out));
+            n -= torn;
+            lo += torn;
+        }
+        hdr.dropped += lo;
+    }
+    qsort(out, n, sizeof(*out), rec_cmp);
+    hdr.count = n;
+
+    int rc = 0;
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        rc = -errno;
+    } else {
+        if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fwrite(out, sizeof(*out), n, f) != n)
+            rc = -EIO;
+        if (fclose(f) != 0 && rc == 0)
+            rc = -errno;
+    }
+
+    free(out);
+    pthread_mutex_unlock(&dump_lock);
+    return rc;
+}
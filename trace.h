@@ -0,0 +1,57 @@
+#ifndef WFS_TRACE_H
+#define WFS_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Operation trace. When enabled, every FUSE callback appends one record to
+  a ring owned by the calling thread, so recording never takes a lock: the
+  writer fills the slot at `head` and then publishes it with a release
+  store. A dump copies each ring, drops anything the writer lapped while it
+  was copying, merges the records by start time and writes them out.
+
+  Trace file: struct wfs_trace_hdr followed by `count` wfs_trace_rec, all
+  in host byte order. `wfs_replay` re-issues a trace against an image.
+*/
+
+#define WFS_TRACE_MAGIC   "WFSTRACE"
+#define WFS_TRACE_VERSION 1
+#define TRACE_PATH        96    // longer paths are truncated
+#define TRACE_DEF_RECORDS 16384 // per thread
+
+struct wfs_trace_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    uint64_t count;
+    uint64_t dropped;      // records overwritten before they could be dumped
+};
+
+struct wfs_trace_rec {
+    uint64_t start_ns;     // since tracing was enabled
+    uint64_t dur_ns;
+    int64_t offset;        // read/write offset, truncate size
+    uint64_t length;       // read/write/xattr length
+    int32_t inum;          // -1 if the path did not resolve
+    int32_t result;        // return value handed back to FUSE
+    uint32_t mode;         // mknod/mkdir mode
+    uint16_t op;           // enum wfs_op
+    uint16_t thread;
+    char path[TRACE_PATH];
+    char path2[TRACE_PATH]; // rename/link target, symlink target, xattr name
+};
+
+extern int trace_enabled;
+
+int trace_init(size_t records_per_thread);
+
+// reserve the calling thread's next slot; trace_commit() publishes it
+struct wfs_trace_rec *trace_begin(void);
+void trace_commit(void);
+
+// stats_clock() timestamp -> ns since tracing was enabled
+uint64_t trace_rel(uint64_t clock_ns);
+int trace_dump(const char *path);
+
+#endif
@@ -2,19 +2,18 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
-#include <libgen.h>
 #include <stdlib.h>
 #include <fuse.h>
-#include <assert.h>
 #include <string.h>
 #include <ctype.h>
-#include <time.h>
 #include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include "wfs.h"
+#include "libwfs.h"
+#include "trace.h"
 
 /* --------------------------------------------------------------------------
  * CS537 P6 Filesystem Project Starter
@@ -33,8 +32,9 @@
  */
 
 /* --------------------------- Globals / Mount ------------------------------ */
-void *mregion; // mapped disk image
-int wfs_error; // last error to return through FUSE
+static struct wfs_ctx *fs; // the mounted image; all filesystem logic lives in libwfs.c
+static int advice = WFS_ADVISE_NORMAL, hugepages;  // given again to the image after it grows
+static unsigned defrag;     // --defrag interval in seconds, 0 for none
 
 struct color_entry { const char *name; uint8_t code; };
 static const struct color_entry color_table[] = {
@@ -63,6 +63,16 @@ int parse_color_name(const char *s, uint8_t *out_code) {
     return 0;
 }
 
+// user.compress: "lz4", "on" or "1" turn it on, "off" or "0" off; -1 otherwise
+static int parse_compress(const char *value, size_t size) {
+    char buf[8]; size_t n = 0;
+    while (n < size && value[n] && n + 1 < sizeof(buf)) { buf[n] = (char)tolower((unsigned char)value[n]); n++; }
+    buf[n] = '\0';
+    if (strcmp(buf, "lz4") == 0 || strcmp(buf, "on") == 0 || strcmp(buf, "1") == 0) return 1;
+    if (strcmp(buf, "off") == 0 || strcmp(buf, "0") == 0) return 0;
+    return -1;
+}
+
 /* Return the color name decorated with ANSI escape codes so terminals
  * show the name itself in that color. Note: this means any consumer
  * of the xattr will receive the escape sequences. If you want raw
@@ -116,819 +126,490 @@ void strip_ansi_codes(const char *in, char *out, size_t out_len)
     out[oi] = '\0';
 }
 
-int get_inode_from_path(char *path, struct wfs_inode **inode)
-{
-    /* TODO: Resolve absolute paths by splitting on '/' and walking from the root inode.
-     * For each component, scan the current directory's dentries (via data_offset) to find the child inode;
-     * on missing component return -ENOENT, otherwise set *inode to the final inode and return 0. */
-    
-    // Case: path is root
-    if (strcmp(path, "/") == 0) {
-        *inode = retrieve_inode(0);
-        return (*inode ? 0 : -ENOENT);
-    }
-
-    // Path must start with '/' (root file)
-    if (path[0] != '/')
-        return -ENOENT;
-
-    struct wfs_sb *sb = (struct wfs_sb *)mregion;
-
-    char *tmp = strdup(path);
-    if (!tmp) return -ENOMEM;
-
-    // Start at the root inode
-    struct wfs_inode *cur = retrieve_inode(0);
-    if (!cur) { free(tmp); return -ENOENT; }
-
-    char *token = strtok(tmp, "/");
-
-    // store inodes in path to handle ".."
-    struct wfs_inode** inode_path = malloc(sb->num_inodes * sizeof(struct wfs_inode *));
-    int idx = 0;
-    inode_path[idx] = cur;
-    
-
-    while (token) {
-
-        // Current must be directory
-        if (!S_ISDIR(cur->mode)) {
-            free(tmp);
-            free(inode_path);
-            return -ENOTDIR;
-        }
-
-        // do nothing if next directory in path is current one
-        if (strcmp(token, ".") == 0) {
-          token = strtok(NULL, "/");
-          continue;
-        }
-
-        // move back a directory
-        if (strcmp(token, "..") == 0) {
 
-          idx--;
-          cur = inode_path[idx];
+/* /.by-color/<color>/ lists the files tagged with that color, named by
+ * inode number, from the index libwfs keeps; each entry is the file itself. */
+#define COLOR_DIR "/.by-color"
 
-          token = strtok(NULL, "/");
-          continue;
-        }
-
-        //char *dirdata = data_offset(cur, 0, 0);
-        //if (!dirdata) {
-        //    free(tmp);
-        //    free(inode_path);
-        //    return -ENOENT;
-        //}
-
-        size_t dentry_size = sizeof(struct wfs_dentry);
-        size_t n_entries   = BLOCK_SIZE / dentry_size;
-
-        int found_inum = -1;
-
-        // iterate through each entry and each block
-        for (int i = 0; i < D_BLOCK; i++) {
-
-          off_t block_off = cur->blocks[i];
-          if (block_off == 0) continue;
-
-          struct wfs_dentry *ents = (struct wfs_dentry *)((char *)mregion + block_off);
-
-          // iterate through looking for matching inode in entries
-          for (int j = 0; j < n_entries; j++) {
-              if (ents[j].num == 0) continue; 
-              if (ents[j].name[0] == '\0') continue;
-
-              if (strcmp(ents[j].name, token) == 0) {
-                  found_inum = ents[j].num;
-                  break;
-              }
-          }
-          
-          if (found_inum >= 0) break;
-        }
-
-        if (found_inum < 0) {
-            free(tmp);
-            free(inode_path);
-            return -ENOENT;
-        }
-
-        cur = retrieve_inode(found_inum);
-        if (!cur) {
-            free(tmp);
-            free(inode_path);
-            return -ENOENT;
-        }
-
-        idx++;
-        inode_path[idx] = cur;
-        token = strtok(NULL, "/");
-    }
-
-    free(tmp);
-    free(inode_path);
-    *inode = cur;
-    return 0;
+enum { BY_COLOR_NONE, BY_COLOR_TOP, BY_COLOR_DIR, BY_COLOR_FILE };
 
+static int by_color(const char *path, uint8_t *code, int *inum)
+{
+    size_t n = strlen(COLOR_DIR);
+    if (strncmp(path, COLOR_DIR, n) != 0 || (path[n] != '\0' && path[n] != '/')) return BY_COLOR_NONE;
+    if (path[n] == '\0' || path[n + 1] == '\0') return BY_COLOR_TOP;
+
+    path += n + 1;
+    const char *slash = strchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : strlen(path);
+    char name[32];
+    if (len >= sizeof(name)) return -ENOENT;
+    memcpy(name, path, len);
+    name[len] = '\0';
+    if (!parse_color_name(name, code) || *code == WFS_COLOR_NONE) return -ENOENT;
+    if (!slash || slash[1] == '\0') return BY_COLOR_DIR;
+
+    char *end;
+    long num = strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' || num < 0 || num > INT_MAX || wfs_get_color(fs, num) != *code)
+        return -ENOENT;
+    *inum = num;
+    return BY_COLOR_FILE;
 }
 
-void free_bitmap(uint32_t position, uint32_t* bitmap) {
-    /*TODO: Clear the bit at 'position' in the bitmap */
-    
-    uint32_t position_word = position / 32;
-    uint32_t position_bit = position % 32;
+// inode the current operation resolved to, for the trace
+static __thread int op_inum;
 
-    // change bit in the word to 0
-    bitmap[position_word] = bitmap[position_word] & ~(1u << position_bit);
+/* Strip ANSI decorations (ls may hand back colored names) and resolve. */
+static int resolve(const char *path, int *inum)
+{
+    char clean[PATH_MAX];
+    strip_ansi_codes(path, clean, sizeof(clean));
+    uint8_t code;
+    int which = by_color(clean, &code, inum), rc;
+    if (which == BY_COLOR_NONE)
+        rc = wfs_lookup(fs, clean, inum);
+    else
+        rc = which == BY_COLOR_FILE ? 0 : -ENOENT;
+    op_inum = rc < 0 ? -1 : *inum;
+    return rc;
 }
 
-struct wfs_inode *retrieve_inode(int inum) {
-    /* TODO:
-     * Use superblock fields (i_blocks_ptr, BLOCK_SIZE stride) to compute a pointer to inode 'inum
-     * Also validate 'inum' via the inode bitmap before returning. */
-
-    struct wfs_sb *sb = (struct wfs_sb *)mregion;
-
-    // make sure inum is in range
-    if (inum < 0 || (size_t)inum >= sb->num_inodes) return NULL;
-
-    uint32_t *inode_bitmap = (uint32_t *)((char *)mregion + sb->i_bitmap_ptr);
-
-    // get word and bit that inode corresponds to 
-    uint32_t inode_word = (uint32_t)(inum / 32);
-    uint32_t inode_bit = (uint32_t)(inum % 32);
-
-    // if the bit isn't set, set error and return null
-    if (!((inode_bitmap[inode_word] >> inode_bit) & 1u)) {
-        wfs_error = -ENOENT;
-        return NULL;
-    }
-
-    // use offset of inode to get inode and return
-    off_t inode_off = sb->i_blocks_ptr + ((off_t)inum * BLOCK_SIZE);
-    struct wfs_inode *inode = (struct wfs_inode *)((char *)mregion + inode_off);
-
+/* ----------------------------- Instrumentation ---------------------------- */
+/* Every FUSE entry point times itself into its op's histogram and, when
+ * tracing, appends a record to its thread's trace ring:
+ *     OP_START(WFS_OP_X, path); ... return OP_DONE(rc);
+ * OP_START_IO records an offset/length, OP_START2 a second path.          */
+struct op_scope {
+    int op;
+    uint64_t start;
+    const char *path;
+    const char *path2;
+    off_t off;
+    size_t len;
+    uint32_t mode;
+};
 
-    return inode;
+#define OP_SCOPE(op, p, p2, o, l) \
+    struct op_scope op_scope = { (op), op_enter(), (p), (p2), (o), (l), 0 }; \
+    op_inum = -1
+#define OP_START(op, path)              OP_SCOPE(op, path, NULL, 0, 0)
+#define OP_START_IO(op, path, off, len) OP_SCOPE(op, path, NULL, off, len)
+#define OP_START2(op, from, to)         OP_SCOPE(op, from, to, 0, 0)
+#define OP_DONE(rc) op_done(&op_scope, (rc))
+
+static const char *trace_file;
+static volatile sig_atomic_t trace_dump_requested;
+
+/* Operations run side by side, but growing the image may move its mapping
+ * and needs them all out of the way. An operation holds the read side of
+ * its thread's stripe of the gate, so operations on different cores do not
+ * share a lock's cache line; a grow takes every stripe for writing. */
+#define GATE_STRIPES 64
+
+static struct gate_stripe {
+    _Alignas(64) pthread_rwlock_t lock;
+} gate[GATE_STRIPES];
+static __thread int gate_slot = -1;
+
+static uint64_t op_enter(void)
+{
+    static unsigned next_slot;
+    if (gate_slot < 0)
+        gate_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % GATE_STRIPES;
+    pthread_rwlock_rdlock(&gate[gate_slot].lock);
+    return stats_clock();
 }
 
-ssize_t allocate_block(uint32_t* bitmap, size_t len) {
-    for (uint32_t i = 0; i < len; i++) {
-        uint32_t bm_region = bitmap[i];
-        if (bm_region == 0xFFFFFFFF) {
-            continue;
-        }
-        for (uint32_t k = 0; k < 32; k++) {
-            if (!((bm_region >> k) & 0x1)) { // it is free
-                // allocate
-                bitmap[i] = bitmap[i] | (0x1 << k);
-                return 32*i + k;
-                //return block_region + (BLOCK_SIZE * (32*i + k));
-            }
-        }
+static void trace_op(const struct op_scope *sc, uint64_t end, int rc)
+{
+    struct wfs_trace_rec *r = trace_begin();
+    if (!r) return;
+
+    r->start_ns = trace_rel(sc->start);
+    r->dur_ns = end - sc->start;
+    r->offset = sc->off;
+    r->length = sc->len;
+    r->inum = op_inum;
+    r->result = rc;
+    r->mode = sc->mode;
+    r->op = sc->op;
+    snprintf(r->path, sizeof(r->path), "%s", sc->path ? sc->path : "");
+    snprintf(r->path2, sizeof(r->path2), "%s", sc->path2 ? sc->path2 : "");
+    trace_commit();
+
+    if (trace_dump_requested) {
+        trace_dump_requested = 0;
+        trace_dump(trace_file);
     }
-    return -1; // no free blocks found
 }
 
-struct wfs_inode *allocate_inode(void) {
-    /* TODO: Allocate an inode slot by marking the inode bitmap and return a
-     * pointer to the inode block within the mapped image (or NULL on failure). */
-
-    struct wfs_sb *sb = (struct wfs_sb*)mregion;
-    off_t i_bitmap_off = sb->i_bitmap_ptr;
-
-    // get pointer to bitmap offset
-    uint32_t *bitmap = (uint32_t *)((char *)mregion + i_bitmap_off);
-
-    // get number of entries in bitmap (round up)
-    size_t bitmap_entries = (sb->num_inodes + 31) / 32;
-
-    ssize_t free_idx = allocate_block(bitmap, bitmap_entries);
-    if (free_idx < 0) {
-      wfs_error = -ENOSPC;
-      return NULL;
-    }
-
-    // Set the corresponding bit in the bitmap to 1
-    uint32_t inode_word = free_idx / 32;
-    uint32_t inode_bit = free_idx % 32;
-    bitmap[inode_word] |= (1 << inode_bit); 
-
-    // get disk offset to new inode
-    off_t inode_off = sb->i_blocks_ptr + ((off_t)free_idx * BLOCK_SIZE);
-    memset((char *)mregion + inode_off, 0, BLOCK_SIZE);
-
-    // set inode num to be index in bitmap
-    struct wfs_inode *new_inode = (struct wfs_inode *)((char *)mregion + inode_off);
-    new_inode->num = (int)free_idx;
-
-    time_t curr_time = time(NULL);
-
-    // set times
-    new_inode->atim = curr_time;
-    new_inode->mtim = curr_time;
-    new_inode->ctim = curr_time;
-
-    return new_inode;
+static int op_done(const struct op_scope *sc, int rc)
+{
+    uint64_t end = stats_clock();
+    stats_record(wfs_get_stats(fs), sc->op, end - sc->start, rc < 0);
+    if (trace_enabled)
+        trace_op(sc, end, rc);
+    pthread_rwlock_unlock(&gate[gate_slot].lock);
+    return rc;
 }
 
-off_t allocate_data_block(void) {
-    /* TODO: Use the data bitmap to allocate a free data block and return its
-     * on-disk byte OFFSET. Handle error appropriately. */
-
-    
-    struct wfs_sb *sb = (struct wfs_sb*)mregion;
-    off_t d_bitmap_off = sb->d_bitmap_ptr;
-
-    // get pointer to bitmap offset
-    uint32_t *bitmap = (uint32_t *)((char *)mregion + d_bitmap_off);
-    
-    // get number of entries in bitmap
-    size_t bitmap_entries = (sb->num_data_blocks + 31) / 32;
-    ssize_t free_idx = allocate_block(bitmap, bitmap_entries);
-    if (free_idx < 0) {
-      wfs_error = -ENOSPC;
-      return wfs_error;
-    }
-
-    // get disk offset to new data block
-    off_t data_off = sb->d_blocks_ptr + ((off_t)free_idx * BLOCK_SIZE);
-    memset((char *)mregion + data_off, 0, BLOCK_SIZE);
-    
-    return data_off;
+// SIGUSR1 asks for a dump; the next operation to finish writes it
+static void trace_signal(int sig)
+{
+    (void)sig;
+    trace_dump_requested = 1;
 }
 
-void free_inode(struct wfs_inode *inode) {
-    /* TODO: Clear the inode bitmap entry and zero the inode block. */
-    struct wfs_sb *sb = (struct wfs_sb *)mregion;
-
-    int inode_idx = inode->num;
-    if (inode_idx >= sb->num_inodes) {
-      printf("Inode number out of range\n");
-      return;
-    }
-
-    // zero bitmap entry
-    uint32_t *bitmap = (uint32_t *)((char *)mregion + sb->i_bitmap_ptr);
-    free_bitmap((uint32_t)inode_idx, bitmap);
+/* The stats are exposed read-only at /.wfs/stats; writing or truncating the
+ * file resets them. /.wfs/grow reads as the image's data block and inode
+ * counts, and writing "<blocks> [<inodes>]" to it grows the image to at
+ * least that many. /.wfs/frag reads as the fragmentation score of the
+ * image and of each file in pieces; writing to it defragments every file.
+ * Writing to /.wfs/trim punches all free space out of the image file, and
+ * it reads as the bytes the last trim punched. The directory is not listed
+ * in readdir of "/". */
+#define CTL_DIR   "/.wfs"
+#define CTL_STATS CTL_DIR "/stats"
+#define CTL_GROW  CTL_DIR "/grow"
+#define CTL_FRAG  CTL_DIR "/frag"
+#define CTL_TRIM  CTL_DIR "/trim"
+
+enum { CTL_NONE, CTL_IS_DIR, CTL_IS_STATS, CTL_IS_GROW, CTL_IS_FRAG, CTL_IS_TRIM };
+
+static int ctl_file(const char *path)
+{
+    if (strcmp(path, CTL_DIR) == 0) return CTL_IS_DIR;
+    if (strcmp(path, CTL_STATS) == 0) return CTL_IS_STATS;
+    if (strcmp(path, CTL_GROW) == 0) return CTL_IS_GROW;
+    if (strcmp(path, CTL_FRAG) == 0) return CTL_IS_FRAG;
+    if (strcmp(path, CTL_TRIM) == 0) return CTL_IS_TRIM;
+    return CTL_NONE;
+}
 
-    // zero the inode block
-    off_t inode_off = sb->i_blocks_ptr + ((off_t)inode_idx * BLOCK_SIZE);
-    memset((char *)mregion + inode_off, 0, BLOCK_SIZE);
+static int ctl_getattr(int which, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_nlink = 1;
+    st->st_mode = which == CTL_IS_DIR ? (S_IFDIR | 0555) : (S_IFREG | 0644);
+    return 0;
 }
 
-void free_block(off_t blk_offset) {
-    /* TODO: Mark the data block free in the data bitmap and zero it. */
-    struct wfs_sb *sb = (struct wfs_sb *)mregion;
+static int ctl_read_stats(char *buf, size_t len, off_t off)
+{
+    size_t cap = 16384;
+    char *text = malloc(cap);
+    if (!text) return -ENOMEM;
 
-    if (blk_offset < sb->d_blocks_ptr || blk_offset > (sb->d_blocks_ptr + (sb->num_data_blocks * BLOCK_SIZE))) {
-      printf("Block offset out of range\n");
-      return;
-    }
+    size_t n = wfs_format_stats(fs, text, cap);
+    if (n >= cap) n = cap - 1;
 
-    off_t relative_off = blk_offset - sb->d_blocks_ptr;
-    uint32_t block_idx = (uint32_t)(relative_off / BLOCK_SIZE);
-    if ((size_t)block_idx >= sb->num_data_blocks) {
-      printf("Block index out of range\n");
-      return;
+    int copied = 0;
+    if ((size_t)off < n) {
+        copied = n - off < len ? n - off : len;
+        memcpy(buf, text + off, copied);
     }
-
-    // zero bitmap entry
-    uint32_t *bitmap = (uint32_t *)((char *)mregion + sb->d_bitmap_ptr);
-    free_bitmap(block_idx, bitmap);
-
-    // zero the data block
-    memset((char *)mregion + blk_offset, 0, BLOCK_SIZE);
+    free(text);
+    return copied;
 }
 
-/* Return pointer to file offset; alloc if requested. Supports direct + single indirect. */
-char *data_offset(struct wfs_inode *inode, off_t offset, int alloc) {
-    /*
-    - Translate a file byte offset into a location within the on-disk storage.
-    - Support the inode’s addressing model (direct blocks plus a single level of indirection).
-    - Enforce capacity limits and report errors appropriately.
-    - Optionally provision storage for missing pieces when requested.
-    - Return a pointer into the mapped image at the resolved location within a block.
-    */
-
-    int direct_blocks = D_BLOCK;
-    int blocks_per_indirect = BLOCK_SIZE / sizeof(off_t);
-
-    // capacity = direct blocks + blocks pointed to in indirect
-    off_t capacity = (direct_blocks + blocks_per_indirect) * BLOCK_SIZE;
-
-    if (offset >= capacity || offset < 0) {
-      printf("Offset out of range of data blocks\n");
-      wfs_error = -ENOSPC;
-      return NULL;
-    }
-
-    off_t block_idx = offset / BLOCK_SIZE;
-    off_t inner_offset = offset % BLOCK_SIZE;
-
-    off_t block_off = 0;
-
-    if (block_idx < direct_blocks) {
-        // Direct block
-        if (inode->blocks[block_idx] == 0) {
-            if (!alloc) return NULL;
-            off_t new_block = allocate_data_block();
-            if (new_block < 0) {
-                wfs_error = -ENOSPC;
-                return NULL;
-            }
-            inode->blocks[block_idx] = new_block;
-        }
-        block_off = inode->blocks[block_idx];
-    } else {
-        // Single indirect
-
-        // check indirect index
-        int indirect_idx = block_idx - direct_blocks;
-        if (indirect_idx < 0 || indirect_idx >= blocks_per_indirect) {
-          wfs_error = -ENOSPC;
-          return NULL;
-        }
-
-        if (inode->blocks[direct_blocks] == 0) {
-            if (!alloc) return NULL;
-            off_t new_indirect_block = allocate_data_block();
-            if (new_indirect_block < 0) {
-                wfs_error = -ENOSPC;
-                return NULL;
-            }
-            inode->blocks[direct_blocks] = new_indirect_block;
-
-            memset((char *)mregion + new_indirect_block, 0, BLOCK_SIZE);
-        }
-
-        off_t *indirect = (off_t *)((char *)mregion + inode->blocks[direct_blocks]);
-
-        if (indirect[indirect_idx] == 0) {
-            if (!alloc) return NULL;
-            off_t new_block = allocate_data_block();
-            if (new_block < 0) {
-                wfs_error = -ENOSPC;
-                return NULL;
-            }
-            indirect[indirect_idx] = new_block;
-        }
+static int ctl_read_grow(char *buf, size_t len, off_t off)
+{
+    struct statvfs st;
+    wfs_fsstat(fs, &st);
+    char text[64];
+    int n = snprintf(text, sizeof(text), "%lu %lu\n", (unsigned long)st.f_blocks, (unsigned long)st.f_files);
 
-        block_off = indirect[indirect_idx];
+    int copied = 0;
+    if (off < n) {
+        copied = n - off < (off_t)len ? n - off : (off_t)len;
+        memcpy(buf, text + off, copied);
     }
-
-    return (char *)mregion + block_off + inner_offset;
+    return copied;
 }
 
-void fillin_inode(struct wfs_inode* inode, mode_t mode)
+// runs inside the write to /.wfs/grow, which gives up its own stripe first
+static int ctl_write_grow(const char *buf, size_t len)
 {
-    inode->mode = mode;
-    inode->uid = getuid();
-    inode->gid = getgid();
-    inode->size = 0;
-    inode->nlinks = 1;
-    memset(inode->blocks, 0, sizeof(inode->blocks));
-
-    time_t curr_time = time(NULL);
-    inode->atim = curr_time;
-    inode->mtim = curr_time;
-    inode->ctim = curr_time;
-    inode->color = WFS_COLOR_NONE;
-
+    char text[64];
+    size_t blocks = 0, inodes = 0;
+    if (len >= sizeof(text)) return -EINVAL;
+    memcpy(text, buf, len);
+    text[len] = '\0';
+    if (sscanf(text, "%zu %zu", &blocks, &inodes) < 1) return -EINVAL;
+
+    pthread_rwlock_unlock(&gate[gate_slot].lock);
+    for (int i = 0; i < GATE_STRIPES; i++)
+        pthread_rwlock_wrlock(&gate[i].lock);
+
+    int rc = wfs_grow(fs, blocks, inodes);
+    if (rc == 0 && (advice != WFS_ADVISE_NORMAL || hugepages))
+        wfs_set_advice(fs, advice, hugepages);
+
+    for (int i = GATE_STRIPES - 1; i >= 0; i--)
+        pthread_rwlock_unlock(&gate[i].lock);
+    pthread_rwlock_rdlock(&gate[gate_slot].lock);
+    return rc < 0 ? rc : (int)len;
 }
 
-int add_dentry(struct wfs_inode* parent, int num, char* name)
+// a line per file in more than one piece, then the image's total
+static int ctl_read_frag(char *buf, size_t len, off_t off)
 {
-    /*TODO: insert dentry if there is an empty slot.
-    We will not do indirect blocks with directories*/
-    
-    // return error if parent inode isn't a directory
-    if (!S_ISDIR(parent->mode)) {
-      printf("Parent node is not a directory\n");
-      return 1;
-    }
-
-    if (strlen(name) >= MAX_NAME) {
-      printf("Name '%s' greater than %d chars\n", name, MAX_NAME);
-      return 1;
-    }
-
-    int num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
-
-    int next_block = -1;
-    struct wfs_dentry *next_free = NULL;
-    int next_free_block = -1;
-    
-    // check if the name already exists in the directory and return error if so
-    for (int i = 0; i < D_BLOCK; i++) {
-
-      off_t parent_off = parent->blocks[i];
-      
-      // if block is empty, set next block to be current block if first empty block found
-      if (parent_off == 0) {
-        if (next_block == -1) {
-          next_block = i;
-        } 
-        continue;
-      }
-
-      struct wfs_dentry *entries = (struct wfs_dentry *)((char *)mregion + parent_off);
-
-      // iterate through entries in block and return error if name is found in entry
-      for (int j = 0; j < num_entries; j++) {
-
-        if (entries[j].num == 0 || entries[j].name[0] == '\0') {
-          if (!next_free) {
-            next_free = &entries[j];
-            next_free_block = i;
-          }
-          continue;
-        }
-        
-        if (strcmp(entries[j].name, name) == 0) return -EEXIST;
-      }
-    }
-
-    // if free spot was found, add entry
-    if (next_free) {
-      strcpy(next_free->name, name);
-      next_free->num = num;
-
-      // update parent size if needed
-      off_t needed_size = (off_t)(next_free_block + 1) * BLOCK_SIZE;
-      if (parent->size < needed_size) {
-        parent->size = needed_size;
-      }
-
-      /// update modify and status change times
-      time_t curr_time = time(NULL);
-      parent->mtim = curr_time;
-      parent->ctim = curr_time;
-
-      return 0;
-    }
-
-    // if no empty block was found return error
-    if (next_block < 0) {
-      return -ENOSPC;
-    }
-
-    // allocate new block
-    off_t new_block = allocate_data_block();
-    if (new_block < 0) {
-      return new_block;
-    }
-
-    memset((char *)mregion + new_block, 0, BLOCK_SIZE);
+    size_t cap = 65536, n = 0;
+    char *text = malloc(cap);
+    if (!text) return -ENOMEM;
+
+    struct statvfs st;
+    wfs_fsstat(fs, &st);
+    struct wfs_frag sum = {0}, f;
+    for (fsblkcnt_t inum = 0; inum < st.f_files; inum++) {
+        if (wfs_frag(fs, inum, &f) < 0 || f.files == 0) continue;
+        sum.files++;
+        sum.blocks += f.blocks;
+        sum.fragments += f.fragments;
+        if (f.fragments > 1 && n < cap - 128)
+            n += snprintf(text + n, cap - n, "%lu %zu %zu %.1f\n", (unsigned long)inum, f.blocks, f.fragments,
+                          wfs_frag_score(&f));
+    }
+    n += snprintf(text + n, cap - n, "total %zu %zu %zu %.1f\n", sum.files, sum.blocks, sum.fragments,
+                  wfs_frag_score(&sum));
+
+    int copied = 0;
+    if ((size_t)off < n) {
+        copied = n - off < len ? n - off : len;
+        memcpy(buf, text + off, copied);
+    }
+    free(text);
+    return copied;
+}
 
-    parent->blocks[next_block] = new_block;
+static int ctl_write_frag(size_t len)
+{
+    struct statvfs st;
+    wfs_fsstat(fs, &st);
+    for (fsblkcnt_t inum = 0; inum < st.f_files; inum++)
+        wfs_defrag_file(fs, inum);
+    return (int)len;
+}
 
-    // update directory size based on number of allocated blocks
-    int num_alloc = 0;
-    for (int i = 0; i < D_BLOCK; ++i) {
-      if (parent->blocks[i] != 0) num_alloc++;
-    }
+static off_t last_trim;
 
-    // create entry
-    struct wfs_dentry *entry = (struct wfs_dentry *)((char *)mregion + parent->blocks[next_block]);
-    strcpy(entry->name, name);
-    entry->num = num;
+static int ctl_read_trim(char *buf, size_t len, off_t off)
+{
+    char text[32];
+    int n = snprintf(text, sizeof(text), "%lld\n", (long long)__atomic_load_n(&last_trim, __ATOMIC_RELAXED));
 
-    // update parent size to include block
-    off_t new_size = (off_t)(next_block + 1) * BLOCK_SIZE;
-    if (parent->size < new_size) {
-      parent->size = new_size;
+    int copied = 0;
+    if (off < n) {
+        copied = n - off < (off_t)len ? n - off : (off_t)len;
+        memcpy(buf, text + off, copied);
     }
+    return copied;
+}
 
-    // update modify and status change times
-    time_t curr_time = time(NULL);
-    parent->mtim = curr_time;
-    parent->ctim = curr_time;
-    
-    return 0;
+static int ctl_write_trim(size_t len)
+{
+    off_t n = wfs_trim(fs);
+    if (n < 0) return n;
+    __atomic_store_n(&last_trim, n, __ATOMIC_RELAXED);
+    return (int)len;
 }
 
-int remove_dentry(struct wfs_inode *dir, int inum)
+/* Snapshots are taken with mkdir in /.snapshots and dropped with rmdir. */
+#define SNAP_PREFIX "/" WFS_SNAPSHOT_DIR "/"
+
+static const char *snapshot_name(const char *path)
 {
-    /*TODO: Use inode 0 as a "deleted" inode. 
-    So any directory entry could be marked as 0 to indicate it is deleted. 
-    Removed dentries can result in "holes" in the dentry list, thus it is
-    important to use the first available slot in add_dentry() */
-
-    int num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
-    int found = 0;
-  
-    for (int i = 0; i < D_BLOCK; i++) {
-
-      off_t parent_offset = dir->blocks[i];
-
-      if (parent_offset == 0) continue;
-
-      struct wfs_dentry *entries = (struct wfs_dentry *)((char *)mregion + parent_offset);
-
-      // iterate through dentries to find matching inum
-      for (int j = 0; j < num_entries; j++) {
-        
-        // set to 0 once found
-        if (entries[j].num == inum) {
-          entries[j].num = 0;
-          entries[j].name[0] = '\0';
-          found = 1;
-          break;
-        }
-      }
-
-      // end early if inode already found and removed
-      if (found) {
-        
-        // update modify and status change times
-        time_t curr_time = time(NULL);
-        dir->mtim = curr_time;
-        dir->ctim = curr_time;
-        break;
-      }
-    }  
-
-    // return error if dentry with matching inum was never found
-    if (!found) {
-      return -ENOENT; 
-    }
-    
-    return 0;
+    size_t n = strlen(SNAP_PREFIX);
+    if (strncmp(path, SNAP_PREFIX, n) != 0 || strchr(path + n, '/')) return NULL;
+    return path + n;
 }
 
 /* --------------------------- FUSE Operations ------------------------------ */
 int wfs_getattr(const char *path, struct stat *st)
 {
-    char clean[PATH_MAX];
-    strip_ansi_codes(path, clean, sizeof(clean));
-
-    struct wfs_inode *inode;
-    if (get_inode_from_path((char*)clean, &inode) < 0)
-        return -ENOENT;
-
-    memset(st, 0, sizeof(*st)); // st fields default value is 0
-    st->st_ino = inode->num;
-    st->st_mode = inode->mode;
-    st->st_nlink = inode->nlinks;
-    st->st_uid = inode->uid;
-    st->st_gid = inode->gid;
-    st->st_size = inode->size;
-    st->st_blocks = (inode->size + 511) / 512;
+    OP_START(WFS_OP_GETATTR, path);
+    int which = ctl_file(path);
+    if (which != CTL_NONE)
+        return OP_DONE(ctl_getattr(which, st));
+    uint8_t code;
+    int inum;
+    which = by_color(path, &code, &inum);
+    if (which == BY_COLOR_TOP || which == BY_COLOR_DIR)
+        return OP_DONE(ctl_getattr(CTL_IS_DIR, st));
 
-    st->st_atime = inode->atim;
-    st->st_mtime = inode->mtim;
-    st->st_ctime = inode->ctim;
+    if (resolve(path, &inum) < 0)
+        return OP_DONE(-ENOENT);
 
-    return 0;
+    return OP_DONE(wfs_stat(fs, inum, st));
 }
 
 int wfs_mknod(const char *path, mode_t mode, dev_t dev)
 {
+    OP_START(WFS_OP_MKNOD, path);
+    op_scope.mode = mode;
     if (S_ISCHR(mode) || S_ISBLK(mode)) {
-        return -EPERM; 
+        return OP_DONE(-EPERM); 
     }
 
     char clean_path[PATH_MAX];
     strip_ansi_codes(path, clean_path, sizeof(clean_path));
 
-    char *path_dup1 = strdup(clean_path);
-    char *path_dup2 = strdup(clean_path);
-    if (!path_dup1 || !path_dup2) {
-        free(path_dup1); free(path_dup2);
-        return -ENOMEM;
-    }
-
-    char *parent_path = dirname(path_dup1);
-    char *filename = basename(path_dup2);
-
-    struct wfs_inode *parent_dir;
-    char clean_parent[PATH_MAX];
-    strip_ansi_codes(parent_path, clean_parent, sizeof(clean_parent));
-    int err = get_inode_from_path(clean_parent, &parent_dir);
-    if (err < 0) {
-        free(path_dup1); free(path_dup2);
-        return err;
-    }
-
-    if (!S_ISDIR(parent_dir->mode)) {
-        free(path_dup1); free(path_dup2);
-        return -ENOTDIR; 
-    }
-
-    struct wfs_inode *inode = allocate_inode();
-    if (!inode) {
-        free(path_dup1); free(path_dup2);
-        return -ENOSPC;
-    }
-
-    fillin_inode(inode, S_IFREG | mode);
-    inode->size = 0; 
-    int add_err = add_dentry(parent_dir, inode->num, filename);
-    if (add_err != 0) {
-        free_inode(inode); 
-        free(path_dup1); free(path_dup2);
-        return add_err; 
-    }
-
-    free(path_dup1);
-    free(path_dup2);
-
-    return 0;
+    int rc = wfs_create(fs, clean_path, S_IFREG | mode);
+    op_inum = rc < 0 ? -1 : rc;
+    return OP_DONE(rc < 0 ? rc : 0);
 }   
 
 int wfs_mkdir(const char *path, mode_t mode)
 { 
+    OP_START(WFS_OP_MKDIR, path);
+    op_scope.mode = mode;
     char clean_path[PATH_MAX];
     strip_ansi_codes(path, clean_path, sizeof(clean_path));
 
-    char *path_dup1 = strdup(clean_path);
-    char *path_dup2 = strdup(clean_path);
-    if (!path_dup1 || !path_dup2) {
-        free(path_dup1); free(path_dup2);
-        return -ENOMEM;
-    }
+    const char *snap = snapshot_name(clean_path);
+    if (snap)
+        return OP_DONE(wfs_snapshot(fs, snap));
 
-    char *parent_path = dirname(path_dup1);
-    char *dirname_str = basename(path_dup2);
+    int rc = wfs_create(fs, clean_path, S_IFDIR | mode);
+    op_inum = rc < 0 ? -1 : rc;
+    return OP_DONE(rc < 0 ? rc : 0);
+}
 
-    struct wfs_inode *parent = NULL;
-    char clean_parent[PATH_MAX];
-    strip_ansi_codes(parent_path, clean_parent, sizeof(clean_parent));
-    int err = get_inode_from_path(clean_parent, &parent);
-    if (err < 0) {
-        free(path_dup1); free(path_dup2);
-        return -ENOENT;
-    }
+int wfs_read(const char *path, char *buf, size_t len, off_t off, struct fuse_file_info *fi)
+{
+    OP_START_IO(WFS_OP_READ, path, off, len);
+    (void)fi;
 
-    if (!S_ISDIR(parent->mode)) {
-        free(path_dup1); free(path_dup2);
-        return -ENOTDIR;
-    }
+    if (ctl_file(path) == CTL_IS_STATS)
+        return OP_DONE(ctl_read_stats(buf, len, off));
+    if (ctl_file(path) == CTL_IS_GROW)
+        return OP_DONE(ctl_read_grow(buf, len, off));
+    if (ctl_file(path) == CTL_IS_FRAG)
+        return OP_DONE(ctl_read_frag(buf, len, off));
+    if (ctl_file(path) == CTL_IS_TRIM)
+        return OP_DONE(ctl_read_trim(buf, len, off));
 
-    // Check if dir already exists
-    char *path_copy = strdup(path);
-    if (!path_copy) return -ENOMEM;
+    int inum;
+    if (resolve(path, &inum) < 0)
+        return OP_DONE(-ENOENT);
 
-    char clean[PATH_MAX];
-    strip_ansi_codes(path, clean, sizeof(clean));
-    struct wfs_inode *existing = NULL;
-    if (get_inode_from_path(clean, &existing) == 0) {
-        free(path_copy); free(path_dup1); free(path_dup2);
-        return -EEXIST;
-    }
+    return OP_DONE(wfs_pread(fs, inum, buf, len, off));
+}
 
-    free(path_copy);
+int wfs_write(const char *path, const char *buf, size_t len, off_t off, struct fuse_file_info *fi)
+{
+    OP_START_IO(WFS_OP_WRITE, path, off, len);
+    (void)fi;
 
-    struct wfs_inode *inode = allocate_inode();
-    if (!inode) {
-        free(path_dup1); free(path_dup2);
-        return -ENOSPC;
+    if (ctl_file(path) == CTL_IS_STATS) {
+        wfs_reset_stats(fs);
+        return OP_DONE((int)len);
     }
+    if (ctl_file(path) == CTL_IS_GROW)
+        return OP_DONE(ctl_write_grow(buf, len));
+    if (ctl_file(path) == CTL_IS_FRAG)
+        return OP_DONE(ctl_write_frag(len));
+    if (ctl_file(path) == CTL_IS_TRIM)
+        return OP_DONE(ctl_write_trim(len));
 
-    // Create directory inode
-    fillin_inode(inode, S_IFDIR | mode);
-    inode->size = 0;
-    err = add_dentry(parent, inode->num, dirname_str);
-    if (err != 0) {
-        free_inode(inode);
-        free(path_dup1); free(path_dup2);
-        return err;
-    }
+    int inum;
+    if (resolve(path, &inum) < 0)
+        return OP_DONE(-ENOENT);
 
-    free(path_dup1);
-    free(path_dup2);
-    return 0;
+    return OP_DONE(wfs_pwrite(fs, inum, buf, len, off));
 }
-int wfs_read(const char *path, char *buf, size_t len, off_t off, struct fuse_file_info *fi)
+
+int wfs_open(const char *path, struct fuse_file_info *fi)
 {
-    (void)fi;
+    OP_START(WFS_OP_OPEN, path);
 
-    char clean[PATH_MAX];
-    strip_ansi_codes(path, clean, sizeof(clean));
-    struct wfs_inode *inode;
-    int ret = get_inode_from_path((char*)clean, &inode);
-    if (ret < 0)
-        return -ENOENT;
+    // generated on every read, so the size from getattr means nothing
+    int ctl = ctl_file(path);
+    if (ctl == CTL_IS_STATS || ctl == CTL_IS_GROW || ctl == CTL_IS_FRAG || ctl == CTL_IS_TRIM)
+        fi->direct_io = 1;
 
-    // Directories can not be read
-    if (S_ISDIR(inode->mode))
-        return -EISDIR;
-
-    // Offset at or beyond file limit => return 0
-    if (off >= inode->size)
-        return 0;
-
-    // Clamp read length to file size
-    size_t to_read = len;
-    if (off + len > inode->size)
-        to_read = inode->size - off;
-
-    size_t left_to_read = to_read;
-    while (left_to_read > 0) {
-      
-      off_t inner_off = off % BLOCK_SIZE;
-
-      int curr_chunk = BLOCK_SIZE - inner_off;
-
-      // cap chunk at what is left to read
-      if (curr_chunk > left_to_read) {
-        curr_chunk = left_to_read;
-      }
-
-      // Compute physical read location
-      char *src = data_offset(inode, off, 0);
-      if (!src) {
-        // fill with zeroes
-        memset(buf, 0, curr_chunk);
-      } else {
-        memcpy(buf, src, curr_chunk);
-      }
-
-      // update buffer and offset to read next chunk
-      buf += curr_chunk;
-      left_to_read -= curr_chunk;
-      off += curr_chunk;
-    }
+    return OP_DONE(0);
+}
 
-    inode->atim = time(NULL);
+int wfs_truncate(const char *path, off_t size)
+{
+    OP_START_IO(WFS_OP_TRUNCATE, path, size, 0);
 
-    return to_read;
+    int ctl = ctl_file(path);
+    if (ctl == CTL_IS_STATS) {
+        wfs_reset_stats(fs);
+        return OP_DONE(0);
+    }
+    if (ctl == CTL_IS_GROW || ctl == CTL_IS_FRAG || ctl == CTL_IS_TRIM)
+        return OP_DONE(0);
+
+    (void)size;
+    return OP_DONE(-ENOSYS);
 }
 
-int wfs_write(const char *path, const char *buf, size_t len, off_t off, struct fuse_file_info *fi)
+// the whole image goes out, along with any timestamps lazytime held back
+int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
+    OP_START(WFS_OP_FSYNC, path);
+    (void)datasync;
     (void)fi;
+    return OP_DONE(wfs_sync(fs));
+}
 
-    char clean[PATH_MAX];
-    strip_ansi_codes(path, clean, sizeof(clean));
-    struct wfs_inode *inode;
-    int ret = get_inode_from_path((char *)clean, &inode);
-    if (ret < 0)
-        return -ENOENT;
+struct readdir_state {
+    void *buf;
+    fuse_fill_dir_t filler;
+    int is_ls;
+};
 
-    // Directories can not be written to
-    if (S_ISDIR(inode->mode))
-        return -EISDIR;
-
-    int left_to_write = len;
-    off_t curr_off = off;
-  
-    while (left_to_write > 0) {
-      
-      off_t inner_off = curr_off % BLOCK_SIZE;
-      
-      int curr_chunk = BLOCK_SIZE - inner_off;
-      
-      // cap chunk at what is left to write
-      if (curr_chunk > left_to_write) {
-        curr_chunk = left_to_write;
-      }
-      
-      char *dst = data_offset(inode, curr_off, 1); 
-      if (!dst) {
-        printf("Allocation failed during write\n");
-        wfs_error = -ENOSPC;
-        return wfs_error;
-      }
-
-      memcpy(dst, buf, curr_chunk);
-
-      // update buffer and offset to write next chunk
-      buf += curr_chunk;
-      left_to_write -= curr_chunk;
-      curr_off += curr_chunk;
-      
+static int readdir_entry(void *arg, const char *name, int inum)
+{
+    struct readdir_state *rs = arg;
+    char out[MAX_NAME + 32];
+    int color = wfs_get_color(fs, inum);
+
+    if (rs->is_ls && color > WFS_COLOR_NONE) {
+        const wfs_color_info *info = wfs_color_from_code(color);
+        snprintf(out, sizeof(out),
+                 "%s%s\033[0m", info->ansi, name);
+    } else {
+        strip_ansi_codes(name, out, sizeof(out));
     }
 
-    // Update file size
-    off_t end = off + (off_t)len;
-    if (end > inode->size)
-        inode->size = end;
-
-    // update modify and status chagnge times
-    time_t curr_time = time(NULL);
-    inode->mtim = curr_time;
-    inode->ctim = curr_time;
-
-    return (int)len;
+    rs->filler(rs->buf, out, NULL, 0);
+    return 0;
 }
 
 int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi)
 {
+    OP_START(WFS_OP_READDIR, path);
     (void)off; (void)fi;
 
-    // Clean incoming path (per spec)
-    char clean_path[PATH_MAX];
-    strip_ansi_codes(path, clean_path, sizeof(clean_path));
+    uint8_t code;
+    int inum;
+    int which = by_color(path, &code, &inum);
+    if (which == BY_COLOR_TOP || which == BY_COLOR_DIR) {
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        if (which == BY_COLOR_DIR) {
+            struct readdir_state rs = { buf, filler, 0 };
+            return OP_DONE(wfs_iterate_color(fs, code, readdir_entry, &rs));
+        }
+        for (size_t i = 0; i < sizeof(color_table)/sizeof(color_table[0]); i++)
+            if (color_table[i].code != WFS_COLOR_NONE) filler(buf, color_table[i].name, NULL, 0);
+        return OP_DONE(0);
+    }
 
-    struct wfs_inode *inode;
-    int ret = get_inode_from_path(clean_path, &inode);
-    if (ret < 0) return ret;
+    int ret = resolve(path, &inum);
+    if (ret < 0) return OP_DONE(ret);
 
-    if (!S_ISDIR(inode->mode))
-        return -ENOTDIR;
+    struct stat st;
+    wfs_stat(fs, inum, &st);
+    if (!S_ISDIR(st.st_mode))
+        return OP_DONE(-ENOTDIR);
 
     // Always return "." and ".."
     filler(buf, ".", NULL, 0);
@@ -945,298 +626,108 @@ int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
         fscanf(fp, "%31s", caller);
         fclose(fp);
     }
-    int is_ls = (strcmp(caller, "ls") == 0);
-
-    size_t n_ents = BLOCK_SIZE / sizeof(struct wfs_dentry);
-
-    // Iterate all dentry blocks
-    for (int i = 0; i < D_BLOCK; i++) {
-        off_t blk = inode->blocks[i];
-        if (blk == 0) continue;
-
-        struct wfs_dentry *ents =
-            (struct wfs_dentry *)((char*)mregion + blk);
-
-        for (size_t j = 0; j < n_ents; j++) {
-
-            if (ents[j].num == 0 || ents[j].name[0] == '\0')
-                continue;
-
-            struct wfs_inode *child = retrieve_inode(ents[j].num);
-            if (!child)
-                continue;
-
-            char out[MAX_NAME + 32];
-
-            if (is_ls && child->color != WFS_COLOR_NONE) {
-                const wfs_color_info *info = wfs_color_from_code(child->color);
-                snprintf(out, sizeof(out),
-                         "%s%s\033[0m", info->ansi, ents[j].name);
-            } else {
-                strip_ansi_codes(ents[j].name, out, sizeof(out));
-            }
-
-            filler(buf, out, NULL, 0);
-        }
-    }
 
-    inode->atim = time(NULL);
-    return 0;
+    struct readdir_state rs = { buf, filler, strcmp(caller, "ls") == 0 };
+    return OP_DONE(wfs_iterate(fs, inum, readdir_entry, &rs));
 }
 
-
 int wfs_unlink(const char *path)
 { 
-    if (!path) return -ENOENT;
-    if (strlen(path) == 0) return -ENOENT;
-    if (path[0] != '/') return -ENOENT;
+    OP_START(WFS_OP_UNLINK, path);
+    if (!path) return OP_DONE(-ENOENT);
+    if (strlen(path) == 0) return OP_DONE(-ENOENT);
+    if (path[0] != '/') return OP_DONE(-ENOENT);
     if (strcmp(path, "/") == 0) {
       printf("Can't unlink root\n");
-      return 0; 
+      return OP_DONE(0); 
     }
 
     char clean_path[PATH_MAX];
     strip_ansi_codes(path, clean_path, sizeof(clean_path));
 
-    // get last slash in path
-    char *last_slash = strrchr(clean_path, '/');
-
-    // get file after last slash
-    char *filename = last_slash + 1;
-    if (filename[0] == '\0') return -ENOENT; 
-
-    char *parent_path;
-
-    // if the last slash is also the first, then the parent path is just the root
-    if (last_slash == clean_path) {
-
-        parent_path = malloc(2);
-        parent_path[0] = '/';
-        parent_path[1] = '\0';
-    } else { // otherwise get path leading up to last slash
-
-        int parent_len = last_slash - clean_path;
-
-        parent_path = malloc(parent_len + 1);
-        strncpy(parent_path, clean_path, parent_len);
-        parent_path[parent_len] = '\0';
-    }
-
-    // get parent inode
-    struct wfs_inode *parent = NULL;
-
-    char clean[PATH_MAX];
-    strip_ansi_codes(parent_path, clean, sizeof(clean));
-    int err = get_inode_from_path(clean, &parent);
-    if (err < 0) {
-      free(parent_path);
-      return err; 
-    }
-
-    if (!S_ISDIR(parent->mode)) {
-      free(parent_path); 
-      printf("Parent isn't directory\n");
-      return 0; 
-    }
-
-    int num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
-
-    // find entry for file in parent 
-    int found = -1;
-    for (int i = 0; i < D_BLOCK; i++) {
-
-        off_t block_off = parent->blocks[i];
-
-        if (block_off == 0) continue;
-
-        struct wfs_dentry *entries = (struct wfs_dentry *)((char *)mregion + block_off);
-
-        // iterate through entries
-        for (int j = 0; j < num_entries; j++) {
+    int inum;
+    int err = resolve(clean_path, &inum);
+    if (err < 0) return OP_DONE(err);
 
-            if (entries[j].num == 0 || entries[j].name[0] == '\0') continue;
-
-            if (strcmp(entries[j].name, filename) == 0) {
-                found = entries[j].num;
-                break;
-            }
-        }
-
-        if (found >= 0) break;
-    }
-
-    // return error if inum not found
-    if (found < 0) { 
-      free(parent_path); 
-      return -ENOENT; 
-    }
-
-    // make sure inode isn't directory
-    struct wfs_inode *file = retrieve_inode(found);
-    if (!file) { 
-      free(parent_path); 
-      return -ENOENT; 
-    }
-    
-    if (S_ISDIR(file->mode)) { 
-      free(parent_path); 
+    struct stat st;
+    wfs_stat(fs, inum, &st);
+    if (S_ISDIR(st.st_mode)) { 
       printf("File to unlink is a directory\n");
-      return 0; 
-    }
-
-    // remove entry from the parent
-    int err2 = remove_dentry(parent, found);
-    if (err2 < 0) { 
-      free(parent_path); 
-      return err2; 
-    }
-
-    // clear file data blocks
-    for (int i = 0; i < D_BLOCK; i++) {
-        if (file->blocks[i] != 0) {
-            free_block(file->blocks[i]);
-            file->blocks[i] = 0;
-        }
-    }
-
-    // free pointers and indrect block
-    if (file->blocks[IND_BLOCK] != 0) {
-
-        off_t indirect_off = file->blocks[IND_BLOCK];
-        off_t *indirect = (off_t *)((char *)mregion + indirect_off);
-
-        int num_per_block = BLOCK_SIZE / sizeof(off_t);
-
-        // free pointers and the blocks they point to
-        for (int i = 0; i < num_per_block; i++) {
-            if (indirect[i] != 0) {
-                free_block(indirect[i]);
-                indirect[i] = 0;
-            }
-        }
-
-        free_block(indirect_off);
-        file->blocks[IND_BLOCK] = 0;
+      return OP_DONE(0); 
     }
 
-    free_inode(file);
-
-    free(parent_path);
-    return 0;
+    return OP_DONE(wfs_remove(fs, clean_path));
 }
 
 int wfs_rmdir(const char *path)
 { 
+    OP_START(WFS_OP_RMDIR, path);
     char clean_path[PATH_MAX];
     strip_ansi_codes(path, clean_path, sizeof(clean_path));
 
-    if (strcmp(clean_path, "/") == 0) return -EPERM;
-
-    char *path_dup = strdup(clean_path);
-    char *path_dup2 = strdup(clean_path);
-    if (!path_dup) return -ENOMEM;
+    if (strcmp(clean_path, "/") == 0) return OP_DONE(-EPERM);
 
-    char *parent_path = dirname(path_dup);
-
-    struct wfs_inode *parent;
-    char clean_parent[PATH_MAX];
-    strip_ansi_codes(parent_path, clean_parent, sizeof(clean_parent));
-    int rc = get_inode_from_path(clean_parent, &parent);
-    if (rc < 0) { free(path_dup); free(path_dup2); return rc; }
-    if (!S_ISDIR(parent->mode)) { free(path_dup); free(path_dup2); return -ENOTDIR; }
-
-    struct wfs_inode *child;
-    char clean[PATH_MAX];
-    strip_ansi_codes(path_dup2, clean, sizeof(clean));
-    rc = get_inode_from_path(clean, &child);
-    if (rc < 0) { free(path_dup); free(path_dup2); return rc; }
-    if (!S_ISDIR(child->mode)) { free(path_dup); free(path_dup2); return -ENOTDIR; }
-
-    /*
-    // Checking is somehow broken so will need to be fixed for some future test
-    // Check empty
-    size_t entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
-    for (int i = 0; i < D_BLOCK; i++) {
-        if (child->blocks[i] == 0) continue;
-        struct wfs_dentry *ents = (struct wfs_dentry *)((char*)mregion + child->blocks[i]);
-        for (size_t j = 0; j < entries_per_block; j++) {
-            if (ents[j].num != 0 && ents[j].name[0] != '\0') {
-                free(path_dup);
-                return -ENOTEMPTY;
-            }
-        }
-    }
-    */
-
-    // Free data blocks of the directory
-    for (int i = 0; i < D_BLOCK; i++) {
-        if (child->blocks[i] != 0) {
-            free_block(child->blocks[i]);
-            child->blocks[i] = 0;
-        }
-    }
+    const char *snap = snapshot_name(clean_path);
+    if (snap)
+        return OP_DONE(wfs_snapshot_delete(fs, snap));
 
-    // Remove directory from parent
-    rc = remove_dentry(parent, child->num);
-    if (rc < 0) { free(path_dup); return rc; }
+    int inum;
+    int rc = resolve(clean_path, &inum);
+    if (rc < 0) return OP_DONE(rc);
 
-    // Free the inode itself
-    free_inode(child);
+    struct stat st;
+    wfs_stat(fs, inum, &st);
+    if (!S_ISDIR(st.st_mode)) return OP_DONE(-ENOTDIR);
 
-    free(path_dup);
-    return 0;
+    return OP_DONE(wfs_remove(fs, clean_path));
 }
 
-/* TODO PART 2: statfs implementation */
-int wfs_statfs(const char *path, struct statvfs *st)
+int wfs_rename(const char *from, const char *to)
 {
-    (void)path;
-
-    struct wfs_sb *sb = (struct wfs_sb *)mregion;
+    OP_START2(WFS_OP_RENAME, from, to);
+    char clean_from[PATH_MAX], clean_to[PATH_MAX];
+    strip_ansi_codes(from, clean_from, sizeof(clean_from));
+    strip_ansi_codes(to, clean_to, sizeof(clean_to));
 
-    // Total blocks and inodes
-    st->f_blocks = sb->num_data_blocks;
-    st->f_files  = sb->num_inodes;
-
-    // Count free data blocks
-    uint32_t *d_bitmap = (uint32_t *)((char *)mregion + sb->d_bitmap_ptr);
-    size_t d_bitmap_len = (sb->num_data_blocks + 31) / 32;
-    uint32_t free_blocks = 0;
+    // the FUSE 2 high-level API has no flags; renameat2 callers get plain rename
+    return OP_DONE(wfs_move(fs, clean_from, clean_to, 0));
+}
 
-    for (size_t i = 0; i < d_bitmap_len; i++) {
-        uint32_t word = d_bitmap[i];
-        for (int b = 0; b < 32; b++) {
-            uint32_t idx = i * 32 + b;
-            if (idx >= sb->num_data_blocks) break;
-            if (((word >> b) & 1) == 0) free_blocks++;
-        }
-    }
+int wfs_link(const char *from, const char *to)
+{
+    OP_START2(WFS_OP_LINK, from, to);
+    char clean_from[PATH_MAX], clean_to[PATH_MAX];
+    strip_ansi_codes(from, clean_from, sizeof(clean_from));
+    strip_ansi_codes(to, clean_to, sizeof(clean_to));
 
-    st->f_bfree  = free_blocks;
-    st->f_bavail = free_blocks;
+    return OP_DONE(wfs_hardlink(fs, clean_from, clean_to));
+}
 
-    // Count free inodes
-    uint32_t *i_bitmap = (uint32_t *)((char *)mregion + sb->i_bitmap_ptr);
-    size_t i_bitmap_len = (sb->num_inodes + 31) / 32;
-    uint32_t free_inodes = 0;
+int wfs_symlink(const char *target, const char *path)
+{
+    OP_START2(WFS_OP_SYMLINK, path, target);
+    char clean[PATH_MAX];
+    strip_ansi_codes(path, clean, sizeof(clean));
 
-    for (size_t i = 0; i < i_bitmap_len; i++) {
-        uint32_t word = i_bitmap[i];
-        for (int b = 0; b < 32; b++) {
-            uint32_t idx = i * 32 + b;
-            if (idx >= sb->num_inodes) break;
-            if (((word >> b) & 1) == 0) free_inodes++;
-        }
-    }
+    return OP_DONE(wfs_make_symlink(fs, target, clean));
+}
 
-    st->f_ffree = free_inodes;
+int wfs_readlink(const char *path, char *buf, size_t size)
+{
+    OP_START(WFS_OP_READLINK, path);
+    int inum;
+    int err = resolve(path, &inum);
+    if (err < 0) return OP_DONE(err);
 
-    // Defaults
-    st->f_bsize   = BLOCK_SIZE;
-    st->f_frsize  = BLOCK_SIZE;
-    st->f_namemax = MAX_NAME;
+    return OP_DONE(wfs_read_symlink(fs, inum, buf, size));
+}
 
-    return 0;
+/* TODO PART 2: statfs implementation */
+int wfs_statfs(const char *path, struct statvfs *st)
+{
+    OP_START(WFS_OP_STATFS, path);
+    (void)path;
+    return OP_DONE(wfs_fsstat(fs, st));
 }
 
 /* TODO PART 3: ensure time updates in read/write/readdir/add/remove operations
@@ -1246,17 +737,29 @@ Mtime/Ctime: upon content/metadata change */
 /* TODO PART 4: xattr user.color + colored names when process name == "ls" */
 int wfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
-    char clean[PATH_MAX];
-    strip_ansi_codes(path, clean, sizeof(clean));
-    struct wfs_inode *inode;
-    int rc = get_inode_from_path((char*)clean, &inode);
-    if (rc < 0) return rc;
+    OP_START_IO(WFS_OP_SETXATTR, path, 0, size);
+    op_scope.path2 = name;
+    int inum;
+    int rc = resolve(path, &inum);
+    if (rc < 0) return OP_DONE(rc);
 
-    if (strcmp(name, "user.color") != 0)
-        return -ENODATA;
+    if (strcmp(name, "user.compress") == 0) {
+        int on = value ? parse_compress(value, size) : -1;
+        if (on < 0)
+            return OP_DONE(-EINVAL);
+        op_scope.mode = on;
+        return OP_DONE(wfs_set_compress(fs, inum, on));
+    }
+
+    // any other user.* attribute is stored as given
+    if (strcmp(name, "user.color") != 0) {
+        if (strncmp(name, "user.", 5) != 0)
+            return OP_DONE(-ENOTSUP);
+        return OP_DONE(wfs_set_xattr(fs, inum, name, value ? value : "", size, flags));
+    }
 
     if (!value || size == 0)
-        return -EINVAL;
+        return OP_DONE(-EINVAL);
 
     // Normalize input
     char buf[32];
@@ -1271,55 +774,123 @@ int wfs_setxattr(const char *path, const char *name, const char *value, size_t s
 
     uint8_t code;
     if (!parse_color_name(stripped, &code))
-        return -EINVAL;
+        return OP_DONE(-EINVAL);
+    op_scope.mode = code;
 
-    inode->color = code;
-    inode->ctim = time(NULL);
-
-    return 0;
+    return OP_DONE(wfs_set_color(fs, inum, code));
 }
 int wfs_getxattr(const char *path, const char *name, char *value, size_t size)
 {
-    char clean[PATH_MAX];
-    strip_ansi_codes(path, clean, sizeof(clean));
-    struct wfs_inode *inode;
-    int rc = get_inode_from_path((char*)clean, &inode);
-    if (rc < 0) return rc;
-
-    if (strcmp(name, "user.color") != 0)
-        return -ENODATA;
-
-    const wfs_color_info* info = wfs_color_from_code(inode->color);
-    const char* raw_name = info->name;
+    OP_START_IO(WFS_OP_GETXATTR, path, 0, size);
+    op_scope.path2 = name;
+    int inum;
+    int rc = resolve(path, &inum);
+    if (rc < 0) return OP_DONE(rc);
+
+    const char* raw_name;
+    if (strcmp(name, "user.compress") == 0) {
+        rc = wfs_get_compress(fs, inum);
+        if (rc <= 0)
+            return OP_DONE(rc < 0 ? rc : -ENODATA);
+        raw_name = "lz4";
+    } else if (strcmp(name, "user.color") == 0) {
+        raw_name = wfs_color_from_code(wfs_get_color(fs, inum))->name;
+    } else {
+        return OP_DONE(wfs_get_xattr(fs, inum, name, value, size));
+    }
 
     size_t len = strlen(raw_name) + 1;
 
     if (size == 0)
-        return len;
+        return OP_DONE(len);
 
     if (size < len)
-        return -ERANGE;
+        return OP_DONE(-ERANGE);
 
     memcpy(value, raw_name, len);
-    return len;
+    return OP_DONE(len);
 }
 int wfs_removexattr(const char *path, const char *name)
 {
-    char clean[PATH_MAX];
-    strip_ansi_codes(path, clean, sizeof(clean));
-    struct wfs_inode *inode;
-    int rc = get_inode_from_path((char*)clean, &inode);
-    if (rc < 0) return rc;
+    OP_START2(WFS_OP_REMOVEXATTR, path, name);
+    int inum;
+    int rc = resolve(path, &inum);
+    if (rc < 0) return OP_DONE(rc);
+
+    if (strcmp(name, "user.compress") == 0)
+        return OP_DONE(wfs_set_compress(fs, inum, 0));
 
     if (strcmp(name, "user.color") != 0)
-        return -ENODATA;
+        return OP_DONE(wfs_remove_xattr(fs, inum, name));
 
-    inode->color = WFS_COLOR_NONE;
-    inode->ctim = time(NULL);
-    return 0;
+    return OP_DONE(wfs_set_color(fs, inum, WFS_COLOR_NONE));
+}
+
+int wfs_listxattr(const char *path, char *list, size_t size)
+{
+    OP_START_IO(WFS_OP_LISTXATTR, path, 0, size);
+    int inum;
+    int rc = resolve(path, &inum);
+    if (rc < 0) return OP_DONE(rc);
+
+    // user.color and user.compress are kept in the inode, the rest stored
+    char own[32];
+    size_t n = 0;
+    if (wfs_get_color(fs, inum) > WFS_COLOR_NONE)
+        n += sprintf(own + n, "user.color") + 1;
+    if (wfs_get_compress(fs, inum) > 0)
+        n += sprintf(own + n, "user.compress") + 1;
+
+    if (size == 0) {
+        rc = wfs_list_xattr(fs, inum, NULL, 0);
+        return OP_DONE(rc < 0 ? rc : rc + (int)n);
+    }
+    if (size < n)
+        return OP_DONE(-ERANGE);
+    memcpy(list, own, n);
+    rc = wfs_list_xattr(fs, inum, list + n, size - n);
+    if (rc > 0 && size == n)
+        return OP_DONE(-ERANGE);
+    return OP_DONE(rc < 0 ? rc : rc + (int)n);
+}
+
+/* Largest write request asked of the kernel. libfuse caps it at its own
+ * buffer size anyway, and it holds a whole file (WFS_MAX_FILE), so one
+ * write(2) reaches wfs_pwrite as a single call. */
+#define MAX_WRITE (128 * 1024)
+
+/* Runs once FUSE has daemonized, so the reclaimer, loader and defragmenter
+ * threads survive the fork. Also settles the request sizes with the
+ * kernel: big writes instead of a call per page, reads that need not wait
+ * for each other, and, where the kernel and libfuse have it, the writeback
+ * cache, which lets write(2) return once the data is in the page cache and
+ * batches it up for us. */
+static void *wfs_init(struct fuse_conn_info *conn)
+{
+    unsigned want = FUSE_CAP_ASYNC_READ;
+#ifdef FUSE_CAP_BIG_WRITES
+    want |= FUSE_CAP_BIG_WRITES;
+#endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    want |= FUSE_CAP_WRITEBACK_CACHE;
+#endif
+    conn->want |= conn->capable & want;
+    conn->max_write = MAX_WRITE;
+    conn->max_readahead = MAX_WRITE;
+    conn->max_background = 64;
+    conn->congestion_threshold = 48;
+
+    if (wfs_start_reclaimer(fs) < 0)
+        fprintf(stderr, "wfs: no background reclaimer, unlink frees inline\n");
+    if (wfs_start_loaders(fs) < 0)
+        fprintf(stderr, "wfs: no background loading, groups load on first use\n");
+    if (defrag && wfs_start_defrag(fs, defrag) < 0)
+        fprintf(stderr, "wfs: no background defragmentation\n");
+    return NULL;
 }
 
 static struct fuse_operations wfs_ops = {
+    .init = wfs_init,
     .getattr = wfs_getattr,
     .mknod = wfs_mknod,
     .mkdir = wfs_mkdir,
@@ -1328,57 +899,115 @@ static struct fuse_operations wfs_ops = {
     .readdir = wfs_readdir,
     .unlink = wfs_unlink,
     .rmdir = wfs_rmdir,
+    .rename = wfs_rename,
+    .link = wfs_link,
+    .symlink = wfs_symlink,
+    .readlink = wfs_readlink,
+    .open = wfs_open,
+    .truncate = wfs_truncate,
+    .fsync = wfs_fsync,
     .statfs = wfs_statfs,
     .setxattr = wfs_setxattr,
     .getxattr = wfs_getxattr,
     .removexattr = wfs_removexattr,
+    .listxattr = wfs_listxattr,
 };
 
 /* ------------------------------ Mount Entry ------------------------------- */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s <disk image> [--trace=FILE] [--trace-records=N] [--secure-delete] [--discard] "
+                    "[--relatime|--noatime] [--lazytime] [--compress] [--dedup] "
+                    "[--verify=all|metadata|none] [--advise=random|sequential] [--hugepages] "
+                    "[--defrag=SECONDS] <mount point> [FUSE options]\n", prog);
+}
+
 int main(int argc, char *argv[])
 {
     int fuse_stat;
-    struct stat sb;
-    int fd;
-    char* diskimage = strdup(argv[1]);
-
-    // shift args down by one for fuse
-    for (int i = 2; i < argc; i++) {
-        argv[i-1] = argv[i];
-    }
-    argc -= 1;
+    size_t trace_records = TRACE_DEF_RECORDS;
+    int secure_delete = 0, discard = 0;
+    int atime_mode = WFS_STRICTATIME, lazytime = 0, compress = 0, dedup = 0;
+    int verify = WFS_VERIFY_ALL;
 
-    // open the file
-    if ((fd = open(diskimage, O_RDWR, 0666)) < 0) {
-        perror("open failed main\n");
+    if (argc < 2) {
+        usage(argv[0]);
         return 1;
     }
+    char* diskimage = strdup(argv[1]);
 
-    // stat so we know how large the mmap needs to be
-    if (fstat(fd, &sb) < 0) {
-        perror("stat");
+    // shift args down by one for fuse, taking out our own options
+    int n = 1;
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--trace=", 8) == 0)
+            trace_file = argv[i] + 8;
+        else if (strncmp(argv[i], "--trace-records=", 16) == 0)
+            trace_records = strtoul(argv[i] + 16, NULL, 0);
+        else if (strcmp(argv[i], "--secure-delete") == 0)
+            secure_delete = 1;
+        else if (strcmp(argv[i], "--discard") == 0)
+            discard = 1;
+        else if (strcmp(argv[i], "--relatime") == 0)
+            atime_mode = WFS_RELATIME;
+        else if (strcmp(argv[i], "--noatime") == 0)
+            atime_mode = WFS_NOATIME;
+        else if (strcmp(argv[i], "--lazytime") == 0)
+            lazytime = 1;
+        else if (strcmp(argv[i], "--compress") == 0)
+            compress = 1;
+        else if (strcmp(argv[i], "--dedup") == 0)
+            dedup = 1;
+        else if (strcmp(argv[i], "--verify=all") == 0)
+            verify = WFS_VERIFY_ALL;
+        else if (strcmp(argv[i], "--verify=metadata") == 0)
+            verify = WFS_VERIFY_METADATA;
+        else if (strcmp(argv[i], "--verify=none") == 0)
+            verify = WFS_VERIFY_NONE;
+        else if (strcmp(argv[i], "--advise=random") == 0)
+            advice = WFS_ADVISE_RANDOM;
+        else if (strcmp(argv[i], "--advise=sequential") == 0)
+            advice = WFS_ADVISE_SEQUENTIAL;
+        else if (strcmp(argv[i], "--hugepages") == 0)
+            hugepages = 1;
+        else if (strncmp(argv[i], "--defrag=", 9) == 0)
+            defrag = strtoul(argv[i] + 9, NULL, 0);
+        else
+            argv[n++] = argv[i];
+    }
+    argc = n;
+
+    fs = wfs_open_image(diskimage);
+    if (!fs) {
+        perror("open failed main\n");
         return 1;
     }
-
-    // setup mmap
-    mregion = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (mregion == NULL) {
-        printf("error mmaping file\n");
-        return 1;
+    wfs_set_secure_delete(fs, secure_delete);
+    wfs_set_discard(fs, discard);
+    wfs_set_time_mode(fs, atime_mode, lazytime);
+    wfs_set_compress_default(fs, compress);
+    wfs_set_verify(fs, verify);
+    if (wfs_set_advice(fs, advice, hugepages) < 0)
+        fprintf(stderr, "wfs: no transparent huge pages for this image\n");
+    if (dedup && wfs_set_dedup(fs, 1) < 0)
+        fprintf(stderr, "wfs: this image can't be deduplicated, mounting without\n");
+
+    if (trace_file) {
+        if (trace_records == 0 || trace_init(trace_records) < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        signal(SIGUSR1, trace_signal);
     }
 
-    assert(retrieve_inode(0) != NULL);
+    for (int i = 0; i < GATE_STRIPES; i++)
+        pthread_rwlock_init(&gate[i].lock, NULL);
     fuse_stat = fuse_main(argc, argv, &wfs_ops, NULL);
 
-    munmap(mregion, sb.st_size);
-    close(fd);
+    if (trace_file && trace_dump(trace_file) < 0)
+        perror("trace dump failed");
+
+    wfs_close_image(fs);
+    free(diskimage);
 
     return fuse_stat;
 }
-
-
-
-
-
-
-
@@ -1,6 +1,8 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <stdint.h>
+#include <pthread.h>
+#include "stats.h"
 
 #define BLOCK_SIZE (512)
 #define MAX_NAME   (28)
@@ -8,22 +10,102 @@
 #define D_BLOCK    (6)
 #define IND_BLOCK  (D_BLOCK+1)
 #define N_BLOCKS   (IND_BLOCK+1)
+// data_offset() keeps the single indirect block right after the direct
+// ones, so blocks[IND_BLOCK] itself is never used for block pointers
+#define IND_SLOT   D_BLOCK
+// the largest file: the direct blocks and a full indirect block
+#define WFS_MAX_FILE ((off_t)(D_BLOCK + BLOCK_SIZE / sizeof(off_t)) * BLOCK_SIZE)
+
+// A file block that was allocated but has not been written yet (an
+// unwritten extent) has this bit set in its pointer; block offsets are
+// BLOCK_SIZE aligned, so it is never part of the address. Reads see zeros.
+#define BLK_UNWRITTEN ((off_t)1)
+
+// Files with compression on store each full cluster of WFS_CLUSTER_BLOCKS
+// blocks LZ4 compressed (lz4.h) when that saves a block. The cluster's
+// slots then hold its compressed blocks in order, tagged with this bit,
+// and the slots left over hold the bit alone. The first compressed block
+// starts with a struct wfs_cluster_hdr.
+#define BLK_COMPRESSED ((off_t)2)
+
+// A deduplicated block, which other file blocks may point at as well.
+// Every pointer to it carries this bit; the references are counted in
+// memory at open, and a write through one copies the block first.
+#define BLK_SHARED     ((off_t)4)
+#define BLK_FLAGS      (BLK_UNWRITTEN | BLK_COMPRESSED | BLK_SHARED)
+
+#define WFS_CLUSTER_BLOCKS 8
+#define WFS_CLUSTER_SIZE   (WFS_CLUSTER_BLOCKS * BLOCK_SIZE)
+
+struct wfs_cluster_hdr {
+    uint32_t clen;      // compressed bytes that follow
+};
+
+static inline off_t blk_addr(off_t ptr)
+{
+    return ptr & ~BLK_FLAGS;
+}
+
+// renameat2(2) flags, in case libc doesn't expose them
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE  (1 << 1)
+#endif
 
 /*
   The fields in the superblock should reflect the structure of the filesystem.
-  `mkfs` writes the superblock to offset 0 of the disk image. 
-  The disk image will have this format:
+  `mkfs` writes the superblock to offset 0 of the disk image, followed by
+  one descriptor per block group. Each group is laid out like a small image
+  of its own, and groups repeat every group_stride bytes:
+
+       first_group                              first_group + group_stride
+             v                                             v
++----+-------+---------+---------+--------+-------------+---------+----
+| SB |  GDT  | IBITMAP | DBITMAP | INODES | DATA BLOCKS | IBITMAP | ...
++----+-------+---------+---------+--------+-------------+---------+----
+             ^ i_bitmap_ptr      ^ i_blocks_ptr         group 1 ...
 
-          d_bitmap_ptr       d_blocks_ptr
-               v                  v
-+----+---------+---------+--------+--------------------------+
-| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        |
-+----+---------+---------+--------+--------------------------+
-0    ^                   ^
-i_bitmap_ptr        i_blocks_ptr
+  Inode n lives in group n / inodes_per_group and data block b (numbered
+  across the image) in group b / blocks_per_group; only the last group may
+  be short. The superblock's own *_ptr fields describe group 0, so an image
+  from before block groups (no WFS_MAGIC) reads as a single group.
 
+  mkfs starts the first group and every region in a group on a
+  WFS_PAGE_SIZE boundary, so no page holds two kinds of data and each
+  region can be given its own madvise(2) advice; `mkfs -a` aligns every
+  group's data blocks further, to 2 MB for huge pages. Nothing reading
+  an image depends on it.
+
+  With WFS_STATE_CSUM set, the last group's data blocks are followed by the
+  checksum area: a CRC32C (crc32c.h) of every data block, 4 bytes each,
+  indexed by block number.
 */
 
+#define WFS_MAGIC        0x32534657  /* "WFS2" */
+#define WFS_MAGIC_V1     0x31534657  /* "WFS1": flat, but has the state field */
+
+// wfs_sb.state
+#define WFS_STATE_CLEAN  0x1   // unmounted cleanly; fsck can skip the full scan
+#define WFS_STATE_ERRORS 0x2   // fsck found damage it did not repair
+#define WFS_STATE_SHARED 0x4   // some blocks are shared (BLK_SHARED)
+#define WFS_STATE_CSUM   0x8   // the image has a checksum area
+#define WFS_STATE_COUNTED 0x10 // the group descriptors' free counts are exact
+
+#define WFS_DEF_GROUP_BLOCKS (BLOCK_SIZE * 8)  // one bitmap block's worth
+#define WFS_PAGE_SIZE        4096
+
+// Block group descriptor
+struct wfs_group_desc {
+    off_t i_bitmap_ptr;
+    off_t d_bitmap_ptr;
+    off_t i_blocks_ptr;
+    off_t d_blocks_ptr;
+    uint32_t free_inodes;   // kept current by the allocator; see WFS_STATE_COUNTED
+    uint32_t free_blocks;
+};
+
 // Superblock
 struct wfs_sb {
     size_t num_inodes;
@@ -32,8 +114,77 @@ struct wfs_sb {
     off_t d_bitmap_ptr;
     off_t i_blocks_ptr;
     off_t d_blocks_ptr;
+    uint32_t magic;     // WFS_MAGIC; images from older mkfs have bitmap bits here
+    uint32_t state;
+    uint32_t num_groups;
+    uint32_t inodes_per_group;
+    uint32_t blocks_per_group;
+    uint32_t orphans;   // first unlinked inode awaiting reclaim, 0 if none
+    off_t first_group;
+    off_t group_stride;
+    struct wfs_group_desc groups[];
+};
+
+// Where everything is in an opened image; a flat image is one group.
+struct wfs_layout {
+    size_t num_inodes;
+    size_t num_data_blocks;
+    uint32_t num_groups;
+    uint32_t inodes_per_group;
+    uint32_t blocks_per_group;
+    off_t first_group;
+    off_t group_stride;
+    struct wfs_group_desc *groups;   // in the image, or &flat
+    struct wfs_group_desc flat;
+    off_t csum_ptr;                  // checksum area, 0 if there is none
 };
 
+int wfs_layout_init(struct wfs_layout *l, void *image, size_t size);
+
+static inline uint32_t wfs_group_inodes(const struct wfs_layout *l, uint32_t g)
+{
+    size_t left = l->num_inodes - (size_t)g * l->inodes_per_group;
+    return left < l->inodes_per_group ? left : l->inodes_per_group;
+}
+
+static inline uint32_t wfs_group_blocks(const struct wfs_layout *l, uint32_t g)
+{
+    size_t left = l->num_data_blocks - (size_t)g * l->blocks_per_group;
+    return left < l->blocks_per_group ? left : l->blocks_per_group;
+}
+
+static inline off_t wfs_inode_off(const struct wfs_layout *l, size_t inum)
+{
+    return l->groups[inum / l->inodes_per_group].i_blocks_ptr +
+           (off_t)(inum % l->inodes_per_group) * BLOCK_SIZE;
+}
+
+static inline off_t wfs_block_off(const struct wfs_layout *l, size_t b)
+{
+    return l->groups[b / l->blocks_per_group].d_blocks_ptr +
+           (off_t)(b % l->blocks_per_group) * BLOCK_SIZE;
+}
+
+// where the checksum area starts: right after the last group's data blocks
+static inline off_t wfs_csum_off(const struct wfs_layout *l)
+{
+    uint32_t last = l->num_groups - 1;
+    return l->groups[last].d_blocks_ptr + (off_t)wfs_group_blocks(l, last) * BLOCK_SIZE;
+}
+
+// image-wide number of the data block at byte offset 'off', -1 if it is none
+static inline ssize_t wfs_block_num(const struct wfs_layout *l, off_t off)
+{
+    if (off < l->groups[0].d_blocks_ptr) return -1;
+    size_t g = l->num_groups == 1 ? 0 : (size_t)(off - l->first_group) / l->group_stride;
+    if (g >= l->num_groups) return -1;
+
+    off_t rel = off - l->groups[g].d_blocks_ptr;
+    if (rel < 0 || rel % BLOCK_SIZE != 0 || rel / BLOCK_SIZE >= wfs_group_blocks(l, g))
+        return -1;
+    return (ssize_t)g * l->blocks_per_group + rel / BLOCK_SIZE;
+}
+
 // Inode
 // Color tag palette: stored compactly as a uint8_t enum code
 typedef enum {
@@ -63,25 +214,135 @@ struct wfs_inode {
     time_t     mtim;
     uint8_t color;
     off_t blocks[N_BLOCKS];
+    uint32_t next_orphan;  /* Next inode on the orphan list, 0 at the end */
+    uint32_t atim_ns;      /* Nanoseconds of atim, ctim and mtim */
+    uint32_t ctim_ns;
+    uint32_t mtim_ns;
+    uint32_t flags;        /* WFS_INODE_* */
+    off_t   xattr_blk;     /* Block with the xattrs that do not fit inline, 0 if none */
+};
+
+#define WFS_INODE_COMPRESS 1   // compress full clusters; on a directory, new entries inherit it
+#define WFS_INODE_SNAPSHOT 2   // part of a snapshot (or /.snapshots itself): read-only
+
+/*
+  Extended attributes. Each is a struct wfs_xattr followed by its name and
+  value, padded to 4 bytes; a zero name_len ends a list. An inode's xattrs
+  go in the rest of its slot after struct wfs_inode (WFS_XATTR_INLINE
+  bytes) while they fit, and the others in the block xattr_blk points at.
+  Inodes whose xattr blocks would be identical share one, and its header
+  counts them.
+*/
+struct wfs_xattr {
+    uint8_t  name_len;
+    uint8_t  pad;
+    uint16_t value_len;
 };
 
+#define WFS_XATTR_MAGIC 0x58534657  /* "WFSX" */
+
+struct wfs_xattr_hdr {
+    uint32_t magic;
+    uint32_t refs;      // inodes pointing at the block
+    uint32_t hash;      // CRC32C of the entries
+    uint32_t used;      // bytes of entries after the header
+};
+
+#define WFS_XATTR_INLINE (BLOCK_SIZE - sizeof(struct wfs_inode))
+#define WFS_XATTR_SPACE  (BLOCK_SIZE - sizeof(struct wfs_xattr_hdr))
+#define WFS_XATTR_CACHE  256
+
+#define WFS_LOADERS 8   // most threads loading group summaries after open
+
+
 // Directory entry
 struct wfs_dentry {
     char name[MAX_NAME];
     int num;
 };
 
-int get_inode_from_path(char* path, struct wfs_inode** inode);
-char* data_offset(struct wfs_inode* inode, off_t offset, int alloc);
-int add_dentry(struct wfs_inode* parent, int num, char* name);
-int remove_dentry(struct wfs_inode* inode, int inum);
-int dentry_to_num(char* name, struct wfs_inode* inode);
-void free_block(off_t blk);
-void free_inode(struct wfs_inode* inode);
-struct wfs_inode* retrieve_inode(int num);
-off_t allocate_data_block(void);
-struct wfs_inode* allocate_inode(void);
+// A timestamp update held back by lazytime; key is inode number + 1, 0 if free
+struct wfs_lazy_times {
+    uint32_t key;
+    uint32_t which;            // which of the three are still pending
+    struct timespec atim, ctim, mtim;
+};
+
+// Dedup index entry: a block with this content hash, and one file block
+// that points at it; blk is the block number + 1, 0 if the entry is free
+struct wfs_fingerprint {
+    uint64_t hash;
+    uint32_t blk;
+    uint32_t inum;
+    uint32_t idx;
+};
+
+// One opened image; everything in libwfs works on one of these.
+struct wfs_ctx {
+    void  *mregion;  // mapped disk image
+    size_t size;     // length of the mapping
+    int    fd;
+    struct wfs_layout layout;
+    pthread_mutex_t *group_locks;  // one per group, around bitmap updates
+    uint8_t *group_state;          // per group: which of its summaries are loaded
+    unsigned *group_gen;           // per group, bumped under its lock by every bitmap change
+    pthread_t loaders[WFS_LOADERS];
+    int    n_loaders;              // loader threads running
+    uint32_t load_next;            // next group for a loader to take
+    int    load_stop;
+    int    secure_delete;          // zero freed blocks instead of just unmarking them
+    int    discard;                // punch the pages freed blocks leave empty out of the file
+    pthread_mutex_t orphan_lock;   // sb->orphans and the next_orphan chain
+    pthread_rwlock_t grow_lock;    // read by the reclaimer while it frees, written by wfs_grow
+    pthread_cond_t  orphan_more;
+    pthread_t reclaimer;
+    int    reclaiming;             // reclaimer thread is running
+    int    reclaim_stop;
+    int    atime_mode;             // WFS_STRICTATIME, WFS_RELATIME or WFS_NOATIME
+    pthread_mutex_t lazy_lock;
+    struct wfs_lazy_times *lazy;   // lazytime only: pending updates, open addressing
+    size_t lazy_used;
+    int    compress_new;           // new files and directories start with compression on
+    pthread_mutex_t dedup_lock;    // refs and the fingerprint index
+    uint16_t *refs;                // per data block, once any block is shared
+    struct wfs_fingerprint *fingerprints;  // dedup mode only
+    size_t fp_mask;
+    uint32_t *csums;               // the checksum area, NULL if the image has none
+    uint64_t *verified;            // per data block: checksum checked or rewritten this mount
+    int    verify;                 // WFS_VERIFY_ALL, WFS_VERIFY_METADATA or WFS_VERIFY_NONE
+    pthread_mutex_t snapshot_lock; // one snapshot taken or deleted at a time
+    pthread_mutex_t namespace_lock;  // around every change to directory entries
+    unsigned *inode_seq;           // per inode, odd while its size or blocks change
+    uint64_t *colored[WFS_COLOR_MAX];  // per color tag but none, a bit per inode carrying it
+    pthread_mutex_t xattr_lock;    // every inode's xattrs and the xattr blocks' counts
+    off_t  xattr_cache[WFS_XATTR_CACHE];  // recently written xattr blocks, by hash
+    pthread_mutex_t defrag_lock;   // around defrag_stop, to wake the defragmenter
+    pthread_cond_t  defrag_wake;
+    pthread_t defragger;
+    int    defragging;             // defragmenter thread is running
+    int    defrag_stop;
+    unsigned defrag_interval;      // seconds between its passes
+    struct wfs_stats stats;
+};
+
+int get_inode_from_path(struct wfs_ctx* fs, const char* path, struct wfs_inode** inode);
+char* data_offset(struct wfs_ctx* fs, struct wfs_inode* inode, off_t offset, int alloc);
+int add_dentry(struct wfs_ctx* fs, struct wfs_inode* parent, int num, char* name);
+int remove_dentry(struct wfs_ctx* fs, struct wfs_inode* inode, int inum);
+int dentry_to_num(struct wfs_ctx* fs, const char* name, struct wfs_inode* inode);
+int set_dentry(struct wfs_ctx* fs, struct wfs_inode* dir, char* name, int num);
+int remove_dentry_name(struct wfs_ctx* fs, struct wfs_inode* dir, char* name);
+int dir_is_empty(struct wfs_ctx* fs, struct wfs_inode* dir);
+int rename_dentry(struct wfs_ctx* fs, const char* from, const char* to, unsigned int flags);
+void free_block(struct wfs_ctx* fs, off_t blk);
+void free_blocks(struct wfs_ctx* fs, off_t* blks, int n);
+void free_inode(struct wfs_ctx* fs, struct wfs_inode* inode);
+void free_inode_data(struct wfs_ctx* fs, struct wfs_inode* inode);
+void drop_link(struct wfs_ctx* fs, struct wfs_inode* inode);
+int write_inode_data(struct wfs_ctx* fs, struct wfs_inode* inode, const char* buf, size_t len, off_t off);
+struct wfs_inode* retrieve_inode(struct wfs_ctx* fs, int num);
+off_t allocate_data_block(struct wfs_ctx* fs, off_t goal);
+struct wfs_inode* allocate_inode(struct wfs_ctx* fs, struct wfs_inode* parent, int is_dir);
 void fillin_inode(struct wfs_inode* inode, mode_t mode);
-void create_root_dir(void);
 
 int wfs_getxattr(const char *path, const char *name, char *value, size_t size); 